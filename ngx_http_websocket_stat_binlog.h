@@ -0,0 +1,82 @@
+#ifndef _NGX_HTTP_WEBSOCKET_BINLOG
+#define _NGX_HTTP_WEBSOCKET_BINLOG
+
+// Layout of "ws_log ... format=binary" files, shared by the module and
+// tools/ws-log-decode. It uses no nginx types so the tools build without it.
+//
+// Every write of a worker starts with a file header, followed by records.
+// Each record starts with its own size, so readers skip types they do not
+// know. All numbers are little-endian.
+
+#include <stdint.h>
+
+#define WS_BINLOG_MAGIC "WSBL"
+#define WS_BINLOG_MAGIC_LEN 4
+#define WS_BINLOG_VERSION 1
+
+// magic, version, header size, pid of the writer, reserved
+#define WS_BINLOG_HEADER_SIZE 16
+#define WS_BINLOG_HEADER_VERSION 4
+#define WS_BINLOG_HEADER_SIZE_FIELD 6
+#define WS_BINLOG_HEADER_PID 8
+
+#define WS_BINLOG_RECORD_FRAME 1
+#define WS_BINLOG_RECORD_OPEN 2
+#define WS_BINLOG_RECORD_CLOSE 3
+
+#define WS_BINLOG_FLAG_FROM_CLIENT 0x01
+#define WS_BINLOG_FLAG_COMPRESSED 0x02
+
+// Frame records carry the opcode, payload size and the tcp bytes of the
+// read or write the frame came with ($ws_payload_full_size). Close records
+// carry the connection age in seconds in place of the payload size.
+#define WS_BINLOG_RECORD_SIZE 32
+#define WS_BINLOG_RECORD_LEN 0      // uint16, size of the whole record
+#define WS_BINLOG_RECORD_TYPE 2     // uint8
+#define WS_BINLOG_RECORD_FLAGS 3    // uint8
+#define WS_BINLOG_RECORD_OPCODE 4   // uint8, 3 bytes reserved after it
+#define WS_BINLOG_RECORD_TIME 8     // uint64, milliseconds since the epoch
+#define WS_BINLOG_RECORD_CONN 16    // uint32, hash of $request_id
+#define WS_BINLOG_RECORD_TCP 20     // uint32
+#define WS_BINLOG_RECORD_PAYLOAD 24 // uint64
+
+static inline void
+ws_binlog_put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline void
+ws_binlog_put32(uint8_t *p, uint32_t v)
+{
+    ws_binlog_put16(p, v);
+    ws_binlog_put16(p + 2, v >> 16);
+}
+
+static inline void
+ws_binlog_put64(uint8_t *p, uint64_t v)
+{
+    ws_binlog_put32(p, v);
+    ws_binlog_put32(p + 4, v >> 32);
+}
+
+static inline uint16_t
+ws_binlog_get16(const uint8_t *p)
+{
+    return p[0] | (uint16_t)p[1] << 8;
+}
+
+static inline uint32_t
+ws_binlog_get32(const uint8_t *p)
+{
+    return ws_binlog_get16(p) | (uint32_t)ws_binlog_get16(p + 2) << 16;
+}
+
+static inline uint64_t
+ws_binlog_get64(const uint8_t *p)
+{
+    return ws_binlog_get32(p) | (uint64_t)ws_binlog_get32(p + 4) << 32;
+}
+
+#endif
@@ -3,38 +3,12 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <linux/ipv6.h>
 #include "ngx_http_websocket_stat_format.h"
 
-const char PLACE_HOLDER_CHR = 'X';
-
 const char *HTTP_VAR = "$http_";
 size_t HTTP_VAR_LEN = sizeof("$http_") - 1;
 
-template_variable null_variable = {NULL, 0, 0, NULL};
-const char *http_header_var(ngx_http_request_t *r, void *data);
-template_variable header_variable = {NULL, 0, 50, http_header_var};
-
-typedef struct {
-    const template_variable *variable;
-    size_t pos;
-    int http_hdr;
-    int orig_pos;
-} variable_occurance;
-
-typedef struct {
-    const char *template;
-    variable_occurance *occ;
-} http_hdr_coccurance_ctx;
-
-static int
-compare_occurance(const void *_first, const void *_second)
-{
-    const variable_occurance **first = (const variable_occurance **)_first;
-    const variable_occurance **second = (const variable_occurance **)_second;
-    assert((*first)->orig_pos != (*second)->orig_pos);
-    return (*first)->orig_pos < (*second)->orig_pos ? -1 : 1;
-}
+static ngx_array_t *http_headers;
 
 #ifdef TEST
 ngx_array_t *
@@ -50,223 +24,227 @@ ngx_array_create(void *pool, size_t size, size_t el_size)
 void *
 ngx_array_push(ngx_array_t *array)
 {
-    return array->elts + array->nelts++ * array->el_size;
+    return (char *)array->elts + array->nelts++ * array->el_size;
 }
 #endif
-void
-insert_occurance(const template_variable *var, size_t pos,
-                 compiled_template *template_cmlp, int http_hdr_len)
-{
-    variable_occurance **oc =
-        ngx_array_push(template_cmlp->variable_occurances);
-    *oc = ngx_palloc(template_cmlp->pool, sizeof(variable_occurance));
-    (*oc)->variable = var;
-    (*oc)->orig_pos = pos;
-    (*oc)->http_hdr = http_hdr_len;
-}
 
-static void
-locate_http_variables(compiled_template *template_cmlp)
+u_char *
+template_copy(u_char *buf, u_char *last, const void *src, size_t len)
 {
-    const char *occurance = template_cmlp->template;
-    while (1) {
-        occurance = strstr(occurance, HTTP_VAR);
-        if (!occurance)
-            break;
-        int pos = occurance - template_cmlp->template;
-        int len = 0;
-        occurance += HTTP_VAR_LEN;
-        while (islower(*occurance) || *occurance == '_') {
-            occurance++;
-            len++;
-        }
-        insert_occurance(&header_variable, pos, template_cmlp, len);
+    if (buf <= last && len <= (size_t)(last - buf)) {
+        memcpy(buf, src, len);
     }
+    return buf + len;
 }
 
-static void
-find_variables(const char *template, compiled_template *template_cmlp)
+u_char *
+template_copy_str(u_char *buf, u_char *last, const char *str)
 {
-    int i = 0;
-    const template_variable *variables = template_cmlp->variables;
-    locate_http_variables(template_cmlp);
-    while (1) {
-        if (!memcmp(&variables[i], &null_variable, sizeof(template_variable)))
-            break;
-        const char *occurance = template;
-        while (1) {
-            occurance = strstr(occurance, variables[i].name);
-            if (occurance) {
-                int pos = occurance - template;
-                occurance += variables[i].name_len;
-                if (*occurance == '_')
-                    continue;
-                insert_occurance(variables + i, pos, template_cmlp, 0);
-            } else {
-                break;
-            }
-        }
-        i++;
-    }
-    qsort(template_cmlp->variable_occurances->elts,
-          template_cmlp->variable_occurances->nelts,
-          sizeof(variable_occurance *), compare_occurance);
+    return template_copy(buf, last, str, strlen(str));
 }
 
-size_t
-estimate_size(compiled_template *template_cmpl)
+u_char *
+template_uint(u_char *buf, u_char *last, unsigned long long n)
 {
-    size_t orig_size = strlen(template_cmpl->template);
-    int size_dif = 0;
-    unsigned int i;
-    for (i = 0; i < template_cmpl->variable_occurances->nelts; i++) {
-        variable_occurance *occ =
-            ((variable_occurance **)
-                 template_cmpl->variable_occurances->elts)[i];
-        if (occ->http_hdr) {
-            size_dif += occ->variable->len - (occ->http_hdr + HTTP_VAR_LEN);
-        } else {
-            size_dif += occ->variable->len - occ->variable->name_len;
-        }
-    }
-    return orig_size + size_dif;
+    u_char digits[sizeof("18446744073709551615") - 1];
+    u_char *p = digits + sizeof(digits);
+    do {
+        *--p = (u_char)('0' + n % 10);
+        n /= 10;
+    } while (n);
+    return template_copy(buf, last, p, digits + sizeof(digits) - p);
 }
 
-void
-_compile_template(compiled_template *template_cmpl)
+static template_segment *
+add_segment(compiled_template *template_cmpl)
 {
+    template_segment *seg = ngx_array_push(template_cmpl->segments);
+    seg->data = NULL;
+    seg->len = 0;
+    seg->variable = NULL;
+    seg->http_hdr = 0;
+    return seg;
+}
 
-    if (template_cmpl->variable_occurances->nelts == 0) {
-        template_cmpl->compiled_template_str = template_cmpl->template;
-        template_cmpl->max_result_len =
-            strlen(template_cmpl->compiled_template_str);
+static void
+add_literal(compiled_template *template_cmpl, const char *start,
+            const char *end)
+{
+    if (end == start)
         return;
-    }
-
-    size_t size = estimate_size(template_cmpl);
-    template_cmpl->compiled_template_str =
-        ngx_palloc(template_cmpl->pool, size + 1);
-    char *result_ptr = template_cmpl->compiled_template_str;
-    const char *template_ptr = template_cmpl->template;
-    size_t template_len = strlen(template_cmpl->template);
+    template_segment *seg = add_segment(template_cmpl);
+    seg->data = (u_char *)start;
+    seg->len = end - start;
+}
 
-    unsigned int i;
-    for (i = 0; i < template_cmpl->variable_occurances->nelts; i++) {
-        variable_occurance *occ =
-            ((variable_occurance **)
-                 template_cmpl->variable_occurances->elts)[i];
-        int s = occ->orig_pos - (template_ptr - template_cmpl->template);
-        memcpy(result_ptr, template_ptr, s);
-        template_ptr += s;
-        result_ptr += s;
-        memset(result_ptr, PLACE_HOLDER_CHR, occ->variable->len);
-        occ->pos = result_ptr - template_cmpl->compiled_template_str;
-        result_ptr += occ->variable->len;
-        template_ptr += occ->http_hdr ? (occ->http_hdr + HTTP_VAR_LEN)
-                                      : occ->variable->name_len;
+static const template_variable *
+match_variable(const template_variable *variables, const char *pos)
+{
+    const template_variable *match = NULL;
+    for (; variables->name; variables++) {
+        if (strncmp(pos, variables->name, variables->name_len) != 0)
+            continue;
+        // $request should not match beginning of $request_id
+        if (pos[variables->name_len] == '_')
+            continue;
+        if (!match || variables->name_len > match->name_len)
+            match = variables;
     }
-    int s = (template_len - (template_ptr - template_cmpl->template));
-    memcpy(result_ptr, template_ptr, s);
-    result_ptr += s;
-    *result_ptr = '\0';
-    template_cmpl->max_result_len =
-        strlen(template_cmpl->compiled_template_str);
+    return match;
 }
 
 void
-_remove_placeholder_chars(char *str)
+template_reset_http_headers()
 {
-    char *result_ptr = str;
-    while (*str != '\0') {
-        if (*str != PLACE_HOLDER_CHR) {
-            *result_ptr = *str;
-            result_ptr++;
-        }
-        str++;
-    }
-    *result_ptr = '\0';
+    http_headers = NULL;
 }
 
-char *
-apply_template(compiled_template *template_cmpl, ngx_http_request_t *r,
-               void *data)
+ngx_uint_t
+template_http_headers_count()
 {
-    char *result = malloc(strlen(template_cmpl->compiled_template_str) + 1);
-    strcpy(result, template_cmpl->compiled_template_str);
-    unsigned int i;
-    for (i = 0; i < template_cmpl->variable_occurances->nelts; i++) {
-        variable_occurance *occ =
-            ((variable_occurance **)
-                 template_cmpl->variable_occurances->elts)[i];
-        if (!occ->http_hdr) {
-            const char *op = occ->variable->operation(r, data);
-            size_t len = strlen(op);
-            memcpy(result + occ->pos, op,
-                   occ->variable->len < len ? occ->variable->len : len);
-        } else {
-            http_hdr_coccurance_ctx ctx = {template_cmpl->template, occ};
-            const char *op = occ->variable->operation(r, &ctx);
-            size_t len = strlen(op);
-            memcpy(result + occ->pos, op,
-                   occ->variable->len < len ? occ->variable->len : len);
+    return http_headers ? http_headers->nelts : 0;
+}
+
+// Registers $http_ variable name and returns its index. The name is stored
+// the way nginx keeps it in lowcase_key of request headers.
+static ngx_uint_t
+register_http_header(compiled_template *template_cmpl, const char *name,
+                     size_t len)
+{
+    ngx_uint_t i, hash = 0;
+    template_http_header *hdr;
+    u_char *lowcase = ngx_palloc(template_cmpl->pool, len);
+    for (i = 0; i < len; i++) {
+        lowcase[i] = name[i] == '_' ? '-' : name[i];
+        hash = ngx_hash(hash, lowcase[i]);
+    }
+    if (!http_headers) {
+        http_headers = ngx_array_create(template_cmpl->pool, 4,
+                                        sizeof(template_http_header));
+    }
+    hdr = http_headers->elts;
+    for (i = 0; i < http_headers->nelts; i++) {
+        if (hdr[i].hash == hash && hdr[i].name.len == len &&
+            memcmp(hdr[i].name.data, lowcase, len) == 0) {
+            return i;
         }
     }
-    _remove_placeholder_chars(result);
-    return result;
+    hdr = ngx_array_push(http_headers);
+    hdr->name.data = lowcase;
+    hdr->name.len = len;
+    hdr->hash = hash;
+    return http_headers->nelts - 1;
 }
 
-int
-compare_hdr(const char *hdr, size_t hdr_len, const char *template)
+static size_t
+http_header_name_len(const char *pos)
 {
-    while (hdr_len) {
-        if (*hdr != '-' || *template != '_')
-            if (tolower(*hdr) != tolower(*template))
-                return 0;
-        hdr++;
-        template ++;
-        hdr_len--;
+    size_t len = 0;
+    pos += HTTP_VAR_LEN;
+    // the characters nginx keeps in $http_ names
+    while (islower(*pos) || isdigit(*pos) || *pos == '_') {
+        pos++;
+        len++;
     }
-    return *hdr == '\0' ? 1 : 0;
+    return len;
 }
 
-const char *
-http_header_var(ngx_http_request_t *r, void *data)
+static void
+parse_template(compiled_template *template_cmpl)
 {
+    const char *literal = template_cmpl->template;
+    const char *pos = literal;
+    while ((pos = strchr(pos, '$'))) {
+        if (strncmp(pos, HTTP_VAR, HTTP_VAR_LEN) == 0) {
+            size_t len = http_header_name_len(pos);
+            if (len) {
+                add_literal(template_cmpl, literal, pos);
+                template_segment *seg = add_segment(template_cmpl);
+                seg->http_hdr = 1;
+                seg->http_hdr_index = register_http_header(
+                    template_cmpl, pos + HTTP_VAR_LEN, len);
+                pos += HTTP_VAR_LEN + len;
+                literal = pos;
+                continue;
+            }
+        }
+        const template_variable *var =
+            match_variable(template_cmpl->variables, pos);
+        if (var) {
+            add_literal(template_cmpl, literal, pos);
+            add_segment(template_cmpl)->variable = var;
+            pos += var->name_len;
+            literal = pos;
+            continue;
+        }
+        pos++;
+    }
+    add_literal(template_cmpl, literal, literal + strlen(literal));
+}
+
 #ifndef TEST
+void
+template_resolve_http_headers(ngx_http_request_t *r, ngx_str_t *values)
+{
     ngx_list_part_t *part;
     ngx_table_elt_t *header;
+    template_http_header *names;
+    ngx_uint_t i, n;
+
+    if (!http_headers)
+        return;
+    names = http_headers->elts;
     part = &r->headers_in.headers.part;
     header = part->elts;
-    http_hdr_coccurance_ctx *ctx = data;
-    int i = part->nelts - 1;
-    while (1) {
-        if (compare_hdr((char *)header[i].key.data, ctx->occ->http_hdr,
-                        ctx->template + ctx->occ->orig_pos + HTTP_VAR_LEN))
-            return (const char *)header[i].value.data;
-        if (--i < 0) {
-            if (!part->next)
+    for (i = 0; /* void */; i++) {
+        if (i >= part->nelts) {
+            if (part->next == NULL)
                 break;
             part = part->next;
             header = part->elts;
-            i = part->nelts - 1;
+            i = 0;
+        }
+        for (n = 0; n < http_headers->nelts; n++) {
+            if (values[n].data == NULL && header[i].hash == names[n].hash &&
+                header[i].key.len == names[n].name.len &&
+                ngx_strncmp(header[i].lowcase_key, names[n].name.data,
+                            names[n].name.len) == 0) {
+                values[n] = header[i].value;
+            }
         }
     }
+}
 #endif
 
-    return "???";
+u_char *
+apply_template(compiled_template *template_cmpl, ngx_http_request_t *r,
+               void *data, u_char *buf, u_char *last)
+{
+    template_segment *seg = template_cmpl->segments->elts;
+    template_segment *end = seg + template_cmpl->segments->nelts;
+    for (; seg < end; seg++) {
+        if (seg->variable) {
+            buf = seg->variable->operation(r, data, buf, last);
+        } else if (seg->http_hdr) {
+            buf = template_cmpl->header_operation(r, data, seg->http_hdr_index,
+                                                  buf, last);
+        } else {
+            buf = template_copy(buf, last, seg->data, seg->len);
+        }
+    }
+    return buf;
 }
 
 compiled_template *
 compile_template(char *template, const template_variable *variables,
-                 ngx_pool_t *pool)
+                 template_header_op header_operation, ngx_pool_t *pool)
 {
     compiled_template *templ = ngx_palloc(pool, sizeof(compiled_template));
-    templ->variable_occurances =
-        ngx_array_create(pool, 10, sizeof(variable_occurance *));
+    templ->segments = ngx_array_create(pool, 10, sizeof(template_segment));
     templ->variables = variables;
+    templ->header_operation = header_operation;
     templ->template = template;
     templ->pool = pool;
-    find_variables(templ->template, templ);
-    _compile_template(templ);
+    parse_template(templ);
     return templ;
 }
@@ -3,9 +3,19 @@
 
 #ifdef TEST
 
+#include <stddef.h>
+
 #define ngx_http_request_t void
 #define ngx_pool_t void
 #define ngx_palloc(pool, size) malloc(size)
+#define ngx_hash(key, c) ((ngx_uint_t)key * 31 + c)
+typedef unsigned char u_char;
+typedef unsigned long ngx_uint_t;
+
+typedef struct {
+    size_t len;
+    u_char *data;
+} ngx_str_t;
 
 typedef struct {
     size_t nelts;
@@ -20,24 +30,46 @@ typedef struct {
 
 #endif
 
-// typedef const char (*template_op)(ngx_http_request_t *r);
-
-typedef const char *(*template_op)(ngx_http_request_t *r, void *data);
+// Variable operations write their value at buf and return the position right
+// after it. A value that does not fit before last is not written, but the
+// returned position still accounts for its full length, so the caller can
+// detect the overflow and render again into a larger buffer.
+typedef u_char *(*template_op)(ngx_http_request_t *r, void *data, u_char *buf,
+                               u_char *last);
 
 typedef struct {
     char *name;
     size_t name_len;
-    size_t len;
     template_op operation;
 } template_variable;
 
 #define VAR_NAME(name) name, sizeof(name) - 1
 
+// Operation for $http_* variables. Header names used by all templates are
+// collected at compile time, index refers to the name in that list.
+typedef u_char *(*template_header_op)(ngx_http_request_t *r, void *data,
+                                      ngx_uint_t index, u_char *buf,
+                                      u_char *last);
+
+// Header name as nginx stores it in lowcase_key, with its hash.
 typedef struct {
-    ngx_array_t *variable_occurances;
-    char *compiled_template_str;
-    size_t max_result_len;
+    ngx_str_t name;
+    ngx_uint_t hash;
+} template_http_header;
+
+// Compiled template is a sequence of segments: literal text or a variable.
+typedef struct {
+    u_char *data; // literal text
+    size_t len;
+    const template_variable *variable;
+    int http_hdr;
+    ngx_uint_t http_hdr_index;
+} template_segment;
+
+typedef struct {
+    ngx_array_t *segments;
     const template_variable *variables;
+    template_header_op header_operation;
     char *template;
     ngx_pool_t *pool;
 } compiled_template;
@@ -45,7 +77,21 @@ typedef struct {
 // Public functions
 compiled_template *compile_template(char *template,
                                     const template_variable *variables,
+                                    template_header_op header_operation,
                                     ngx_pool_t *pool);
-char *apply_template(compiled_template *template_cmpl, ngx_http_request_t *r,
-                     void *data);
+u_char *apply_template(compiled_template *template_cmpl, ngx_http_request_t *r,
+                       void *data, u_char *buf, u_char *last);
+
+// Header names referenced by compiled templates
+void template_reset_http_headers();
+ngx_uint_t template_http_headers_count();
+#ifndef TEST
+// Looks up every referenced header once, values are indexed like the names.
+void template_resolve_http_headers(ngx_http_request_t *r, ngx_str_t *values);
+#endif
+
+// Helpers for variable operations
+u_char *template_copy(u_char *buf, u_char *last, const void *src, size_t len);
+u_char *template_copy_str(u_char *buf, u_char *last, const char *str);
+u_char *template_uint(u_char *buf, u_char *last, unsigned long long n);
 #endif
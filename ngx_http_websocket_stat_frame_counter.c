@@ -1,5 +1,11 @@
 #include "ngx_http_websocket_stat_frame_counter.h"
 #include <assert.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define FRAME_COUNTER_SIMD
+#include <immintrin.h>
+#endif
 
 const char *
 frame_type_to_str(frame_type frame)
@@ -23,20 +29,93 @@ frame_type_to_str(frame_type frame)
 }
 
 void
-move_buffer(u_char **buffer, ssize_t *size, int step)
+move_buffer(u_char **buffer, ssize_t *size, ssize_t step)
 {
     *buffer += step;
     *size -= step;
 }
 
+// Decodes a frame header in one step when all of it is in the buffer.
+// Returns 0 if the header is split or invalid and has to go through the
+// state machine, which rejects it.
+static int
+decode_header(u_char **buffer, ssize_t *size,
+              ngx_frame_counter_t *frame_counter)
+{
+    u_char *p = *buffer;
+    uint16_t len16;
+    uint32_t len32[2];
+    ssize_t header_size = 2;
+
+    if (*size < 2) {
+        return 0;
+    }
+    u_char len = p[1] & 0x7f;
+    u_char masked = p[1] >> 7;
+    if (len == 126) {
+        header_size += 2;
+    } else if (len == 127) {
+        header_size += 8;
+    }
+    if (masked) {
+        header_size += MASK_SIZE;
+    }
+    if (*size < header_size) {
+        return 0;
+    }
+    if (len == 127 && (p[2] & 0x80)) {
+        return 0;
+    }
+
+    frame_counter->current_frame_type = p[0] & 0x0f;
+    frame_counter->fin = p[0] >> 7;
+    frame_counter->rsv1 = (p[0] >> 6) & 1;
+    frame_counter->payload_masked = masked;
+    if (len == 126) {
+        memcpy(&len16, p + 2, sizeof(len16));
+        frame_counter->current_payload_size = ntohs(len16);
+    } else if (len == 127) {
+        memcpy(len32, p + 2, sizeof(len32));
+        frame_counter->current_payload_size =
+            ((uint64_t)ntohl(len32[0]) << 32) | ntohl(len32[1]);
+    } else {
+        frame_counter->current_payload_size = len;
+    }
+    if (masked) {
+        memcpy(frame_counter->mask, p + header_size - MASK_SIZE, MASK_SIZE);
+    }
+    frame_counter->bytes_consumed = 0;
+    frame_counter->stage = PAYLOAD;
+    move_buffer(buffer, size, header_size);
+    return 1;
+}
+
 char
 frame_counter_process_message(u_char **buffer, ssize_t *size,
                               ngx_frame_counter_t *frame_counter)
 {
+    frame_counter->chunk_size = 0;
     while (*size > 0) {
         switch (frame_counter->stage) {
         case HEADER:
+            if (decode_header(buffer, size, frame_counter)) {
+                // skip the payload right away if it is all here
+                if (*size >= frame_counter->current_payload_size) {
+                    frame_counter->chunk = *buffer;
+                    frame_counter->chunk_size =
+                        frame_counter->current_payload_size;
+                    frame_counter->chunk_offset = 0;
+                    move_buffer(buffer, size,
+                                frame_counter->current_payload_size);
+                    frame_counter->stage = HEADER;
+                    return 1;
+                }
+                break;
+            }
+            // header is split between buffers
             frame_counter->current_frame_type = **buffer & 0x0f;
+            frame_counter->fin = **buffer >> 7;
+            frame_counter->rsv1 = (**buffer >> 6) & 1;
             move_buffer(buffer, size, 1);
             frame_counter->stage = PAYLOAD_LEN;
             frame_counter->bytes_consumed =
@@ -56,40 +135,34 @@ frame_counter_process_message(u_char **buffer, ssize_t *size,
                     frame_counter->payload_masked ? MASK : PAYLOAD;
             } else if (len == 126) {
                 frame_counter->stage = PAYLOAD_LEN_LARGE;
-            } else if (len == 127) {
-                frame_counter->stage = PAYLOAD_LEN_HUGE;
             } else {
-                // WTF?
-                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                              "Wrong payload length");
-                exit(-1);
+                frame_counter->stage = PAYLOAD_LEN_HUGE;
             }
             break;
         case PAYLOAD_LEN_LARGE:
         case PAYLOAD_LEN_HUGE: {
-            int i;
-            if (frame_counter->stage == PAYLOAD_LEN_LARGE) {
-                assert(*size >= 2);
-                i = 2;
-            } else {
-                assert(*size >= 8);
-                i = 8;
+            int len_size = frame_counter->stage == PAYLOAD_LEN_LARGE ? 2 : 8;
+            if (len_size == 8 && frame_counter->bytes_consumed == 0 &&
+                (**buffer & 0x80)) {
+                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                              "websocket frame length is over 2^63, "
+                              "frames are not counted any more");
+                frame_counter->stage = INVALID;
+                break;
             }
-            while (1) {
-                frame_counter->current_payload_size |= **buffer;
-                move_buffer(buffer, size, 1);
-                if (--i)
-                    frame_counter->current_payload_size <<= 8;
-                else
-                    break;
+            frame_counter->current_payload_size =
+                (frame_counter->current_payload_size << 8) | **buffer;
+            move_buffer(buffer, size, 1);
+            if (++frame_counter->bytes_consumed == len_size) {
+                frame_counter->stage =
+                    frame_counter->payload_masked ? MASK : PAYLOAD;
+                frame_counter->bytes_consumed = 0;
             }
-            frame_counter->stage =
-                frame_counter->payload_masked ? MASK : PAYLOAD;
-            frame_counter->bytes_consumed = 0;
             break;
         }
         case MASK:
             assert(frame_counter->payload_masked);
+            frame_counter->mask[frame_counter->bytes_consumed] = **buffer;
             move_buffer(buffer, size, 1);
             frame_counter->bytes_consumed++;
             if (frame_counter->bytes_consumed == MASK_SIZE) {
@@ -102,24 +175,33 @@ frame_counter_process_message(u_char **buffer, ssize_t *size,
             }
             break;
         case PAYLOAD:
-            if (*size >= (u_int)(frame_counter->current_payload_size -
-                                 frame_counter->bytes_consumed)) {
-                move_buffer(buffer, size,
-                            frame_counter->current_payload_size -
-                                frame_counter->bytes_consumed);
+            frame_counter->chunk = *buffer;
+            frame_counter->chunk_offset = frame_counter->bytes_consumed;
+            if (*size >= frame_counter->current_payload_size -
+                             frame_counter->bytes_consumed) {
+                frame_counter->chunk_size =
+                    frame_counter->current_payload_size -
+                    frame_counter->bytes_consumed;
+                move_buffer(buffer, size, frame_counter->chunk_size);
                 frame_counter->stage = HEADER;
                 return 1;
             } else {
+                frame_counter->chunk_size = *size;
                 frame_counter->bytes_consumed += *size;
                 if (frame_counter->bytes_consumed >
                     frame_counter->current_payload_size) {
-                    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "Unknown error");
+                    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                                  "Unknown error");
                     frame_counter->stage = HEADER;
                 }
                 *buffer += *size;
                 *size = 0;
             }
             break;
+        case INVALID:
+            *buffer += *size;
+            *size = 0;
+            break;
         default:
             ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "Unknown stage");
             move_buffer(buffer, size, 1);
@@ -127,3 +209,83 @@ frame_counter_process_message(u_char **buffer, ssize_t *size,
     }
     return 0;
 }
+
+typedef void (*unmask_pt)(u_char *dst, const u_char *src, size_t len,
+                          uint32_t mask);
+
+// mask is the key already rotated to the start of src, in memory order
+static void
+unmask_word(u_char *dst, const u_char *src, size_t len, uint32_t mask)
+{
+    uint64_t mask64 = ((uint64_t)mask << 32) | mask;
+    uint64_t word;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&word, src + i, 8);
+        word ^= mask64;
+        memcpy(dst + i, &word, 8);
+    }
+    for (; i < len; i++) {
+        dst[i] = src[i] ^ ((u_char *)&mask)[i % 4];
+    }
+}
+
+#ifdef FRAME_COUNTER_SIMD
+__attribute__((target("sse2"))) static void
+unmask_sse2(u_char *dst, const u_char *src, size_t len, uint32_t mask)
+{
+    __m128i mask128 = _mm_set1_epi32((int)mask);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(v, mask128));
+    }
+    unmask_word(dst + i, src + i, len - i, mask);
+}
+
+__attribute__((target("avx2"))) static void
+unmask_avx2(u_char *dst, const u_char *src, size_t len, uint32_t mask)
+{
+    __m256i mask256 = _mm256_set1_epi32((int)mask);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_xor_si256(v, mask256));
+    }
+    unmask_sse2(dst + i, src + i, len - i, mask);
+}
+#endif
+
+static unmask_pt unmask_impl = unmask_word;
+
+const char *
+frame_counter_unmask_init(void)
+{
+#ifdef FRAME_COUNTER_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        unmask_impl = unmask_avx2;
+        return "avx2";
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        unmask_impl = unmask_sse2;
+        return "sse2";
+    }
+#endif
+    unmask_impl = unmask_word;
+    return "word";
+}
+
+void
+frame_counter_unmask(u_char *dst, const u_char *src, size_t len,
+                     const u_char *mask, size_t offset)
+{
+    u_char rotated[4];
+    uint32_t mask32;
+    for (int i = 0; i < 4; i++) {
+        rotated[i] = mask[(offset + i) % 4];
+    }
+    memcpy(&mask32, rotated, 4);
+    unmask_impl(dst, src, len, mask32);
+}
@@ -1,5 +1,19 @@
+#ifdef TEST
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef intptr_t ngx_int_t;
+typedef unsigned char u_char;
+#define ngx_log_error(...)
+
+#else
+
 #include <ngx_core.h>
 
+#endif
+
 static const unsigned int MASK_SIZE = 4;
 
 typedef enum {
@@ -8,7 +22,10 @@ typedef enum {
     PAYLOAD_LEN_LARGE,
     PAYLOAD_LEN_HUGE,
     MASK,
-    PAYLOAD
+    PAYLOAD,
+    // a frame length with the most significant bit set, RFC 6455 5.2; the
+    // rest of the stream is passed over without counting
+    INVALID
 } packet_reading_stage;
 
 typedef enum { CONTINUATION, TEXT, BINARY, CLOSE = 8, PING, PONG } frame_type;
@@ -21,11 +38,27 @@ typedef struct {
     ngx_int_t bytes_consumed;
     packet_reading_stage stage;
     char payload_masked : 1;
+    // FIN and RSV1 (compressed, RFC 7692) bits of the current frame
+    char fin : 1;
+    char rsv1 : 1;
     frame_type current_frame_type;
     ngx_int_t current_payload_size;
+    u_char mask[4];
+    // payload passed over by the last call, still masked, and its offset
+    // within the frame payload; chunk_size is 0 if there was none
+    u_char *chunk;
+    ngx_int_t chunk_size;
+    ngx_int_t chunk_offset;
 } ngx_frame_counter_t;
 
 const char *frame_type_to_str(frame_type frame);
 char frame_counter_process_message(u_char **buffer, ssize_t *size,
                                    ngx_frame_counter_t *frame_counter);
-const char *frame_type_to_str(frame_type frame);
+
+// XORs len bytes of payload with the mask key, offset is the position of src
+// within the payload. src and dst may be the same buffer.
+void frame_counter_unmask(u_char *dst, const u_char *src, size_t len,
+                          const u_char *mask, size_t offset);
+// Picks the fastest unmask implementation this CPU supports and returns
+// its name. Without it the portable one is used.
+const char *frame_counter_unmask_init(void);
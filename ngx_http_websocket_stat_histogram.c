@@ -0,0 +1,55 @@
+#include "ngx_http_websocket_stat_histogram.h"
+
+static uint64_t
+bucket_max(ngx_uint_t bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    ngx_uint_t exp = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    ngx_uint_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    uint64_t width = (uint64_t)1 << (exp - HISTOGRAM_SUB_BITS);
+    return ((HISTOGRAM_SUB_BUCKETS + sub) * width) + width - 1;
+}
+
+void
+histogram_merge(ngx_http_websocket_histogram_t *total,
+                ngx_http_websocket_histogram_t *h)
+{
+    ngx_uint_t i;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        total->counts[i] += h->counts[i];
+    }
+}
+
+ngx_atomic_uint_t
+histogram_count(ngx_http_websocket_histogram_t *h)
+{
+    ngx_atomic_uint_t count = 0;
+    ngx_uint_t i;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count += h->counts[i];
+    }
+    return count;
+}
+
+uint64_t
+histogram_percentile(ngx_http_websocket_histogram_t *h, ngx_uint_t permille)
+{
+    ngx_atomic_uint_t count = histogram_count(h), seen = 0, rank;
+    ngx_uint_t i;
+    if (count == 0) {
+        return 0;
+    }
+    rank = (count * permille + 999) / 1000;
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            return bucket_max(i);
+        }
+    }
+    return bucket_max(HISTOGRAM_BUCKETS - 1);
+}
@@ -0,0 +1,59 @@
+#ifndef _NGX_HTTP_WEBSOCKET_HISTOGRAM
+#define _NGX_HTTP_WEBSOCKET_HISTOGRAM
+
+#ifdef TEST
+
+#include <stdint.h>
+
+typedef volatile unsigned long ngx_atomic_t;
+typedef unsigned long ngx_atomic_uint_t;
+typedef unsigned long ngx_uint_t;
+#define ngx_inline inline
+
+#else
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#endif
+
+// Log bucketed histogram with fixed memory. Every power of two range is split
+// into 2^HISTOGRAM_SUB_BITS linear buckets, so a value is reported within
+// 12.5% of what was recorded. Values below 2^HISTOGRAM_SUB_BITS are exact.
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS                                                      \
+    ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+    ngx_atomic_t counts[HISTOGRAM_BUCKETS];
+} ngx_http_websocket_histogram_t;
+
+static ngx_inline ngx_uint_t
+histogram_bucket(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+    ngx_uint_t exp = 63 - __builtin_clzll(value);
+    ngx_uint_t sub = (value >> (exp - HISTOGRAM_SUB_BITS)) &
+                     (HISTOGRAM_SUB_BUCKETS - 1);
+    return (exp - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// Histograms live in per-worker shards and have a single writer, so a sample
+// is one plain increment without a locked instruction.
+static ngx_inline void
+histogram_record(ngx_http_websocket_histogram_t *h, uint64_t value)
+{
+    h->counts[histogram_bucket(value)]++;
+}
+
+void histogram_merge(ngx_http_websocket_histogram_t *total,
+                     ngx_http_websocket_histogram_t *h);
+ngx_atomic_uint_t histogram_count(ngx_http_websocket_histogram_t *h);
+// Returns the highest value of the bucket holding the given percentile,
+// expressed in tenths of a percent (p99.9 is 999).
+uint64_t histogram_percentile(ngx_http_websocket_histogram_t *h,
+                              ngx_uint_t permille);
+#endif
@@ -0,0 +1,184 @@
+#include "ngx_http_websocket_stat_inflate.h"
+#include "ngx_http_websocket_stat_frame_counter.h"
+
+#define WS_DEFLATE_MAX_WINDOW_BITS 15
+
+// Unmasked input and thrown away output, shared by all streams of a worker.
+static u_char inflate_in[4096];
+static u_char inflate_out[16384];
+
+// Looks for name, optionally followed by "=value", at the start of a
+// parameter. Returns the value, empty if there is none, or NULL.
+static u_char *
+match_param(u_char *p, u_char *last, const char *name, u_char **end)
+{
+    size_t len = ngx_strlen(name);
+    if ((size_t)(last - p) < len || ngx_strncasecmp(p, (u_char *)name, len)) {
+        return NULL;
+    }
+    p += len;
+    if (p < last && *p != '=' && *p != ';' && *p != ',' && *p != ' ') {
+        return NULL;
+    }
+    if (p < last && *p == '=') {
+        p++;
+    }
+    if (p < last && *p == '"') {
+        p++;
+    }
+    *end = p;
+    while (*end < last && **end >= '0' && **end <= '9') {
+        (*end)++;
+    }
+    return p;
+}
+
+static void
+parse_window_bits(u_char *p, u_char *end, int *bits)
+{
+    ngx_int_t n = ngx_atoi(p, end - p);
+    if (n >= 8 && n <= WS_DEFLATE_MAX_WINDOW_BITS) {
+        *bits = n;
+    }
+}
+
+void
+ws_deflate_parse(ngx_str_t *extensions, ngx_http_websocket_deflate_t *deflate)
+{
+    u_char *p = extensions->data, *last = p + extensions->len, *value, *end;
+
+    deflate->enabled = 0;
+    deflate->window_bits[0] = WS_DEFLATE_MAX_WINDOW_BITS;
+    deflate->window_bits[1] = WS_DEFLATE_MAX_WINDOW_BITS;
+    if (p == NULL) {
+        return;
+    }
+    // extensions are separated by commas, their parameters by semicolons
+    while (p < last) {
+        while (p < last && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+        if (!deflate->enabled) {
+            if (match_param(p, last, "permessage-deflate", &end) == NULL) {
+                while (p < last && *p != ',') {
+                    p++;
+                }
+                continue;
+            }
+            deflate->enabled = 1;
+        } else if ((value = match_param(p, last, "server_max_window_bits",
+                                        &end))) {
+            // the upstream compresses what it sends to the client
+            parse_window_bits(value, end, &deflate->window_bits[0]);
+        } else if ((value = match_param(p, last, "client_max_window_bits",
+                                        &end))) {
+            parse_window_bits(value, end, &deflate->window_bits[1]);
+        }
+        while (p < last && *p != ';' && *p != ',') {
+            p++;
+        }
+        if (p < last && *p == ',') {
+            // only the first permessage-deflate counts
+            return;
+        }
+        p++;
+    }
+}
+
+size_t
+ws_inflate_memory(int window_bits)
+{
+    // the window and the inflate state, see zconf.h
+    return ((size_t)1 << window_bits) + 8192;
+}
+
+static voidpf
+inflate_alloc(voidpf opaque, uInt items, uInt size)
+{
+    return ngx_palloc(opaque, items * size);
+}
+
+static void
+inflate_free(voidpf opaque, voidpf address)
+{
+}
+
+ngx_int_t
+ws_inflate_init(ngx_http_websocket_inflate_t *stream, ngx_pool_t *pool,
+                int window_bits)
+{
+    ngx_memzero(&stream->zstream, sizeof(z_stream));
+    stream->zstream.zalloc = inflate_alloc;
+    stream->zstream.zfree = inflate_free;
+    stream->zstream.opaque = pool;
+    // raw deflate, without zlib header
+    if (inflateInit2(&stream->zstream, -window_bits) != Z_OK) {
+        return NGX_ERROR;
+    }
+    stream->active = 1;
+    stream->memory = ws_inflate_memory(window_bits);
+    return NGX_OK;
+}
+
+static ssize_t
+inflate_run(ngx_http_websocket_inflate_t *stream, u_char *data, size_t len)
+{
+    z_stream *zs = &stream->zstream;
+    ssize_t out = 0;
+    int rc;
+
+    zs->next_in = data;
+    zs->avail_in = len;
+    do {
+        zs->next_out = inflate_out;
+        zs->avail_out = sizeof(inflate_out);
+        rc = inflate(zs, Z_SYNC_FLUSH);
+        out += sizeof(inflate_out) - zs->avail_out;
+        if (rc == Z_STREAM_END) {
+            // a message may end with a final block, the next one starts a
+            // new stream with the same window
+            rc = inflateReset(zs);
+        }
+        if (rc == Z_BUF_ERROR) {
+            // nothing more to do with this input
+            break;
+        }
+        if (rc != Z_OK) {
+            stream->active = 0;
+            return NGX_ERROR;
+        }
+    } while (zs->avail_in || zs->avail_out == 0);
+    return out;
+}
+
+ssize_t
+ws_inflate_feed(ngx_http_websocket_inflate_t *stream, u_char *data,
+                size_t len, const u_char *mask, size_t offset)
+{
+    ssize_t out = 0, n;
+    size_t size;
+
+    if (mask == NULL) {
+        return inflate_run(stream, data, len);
+    }
+    while (len) {
+        size = ngx_min(len, sizeof(inflate_in));
+        frame_counter_unmask(inflate_in, data, size, mask, offset);
+        n = inflate_run(stream, inflate_in, size);
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        out += n;
+        data += size;
+        offset += size;
+        len -= size;
+    }
+    return out;
+}
+
+ssize_t
+ws_inflate_finish(ngx_http_websocket_inflate_t *stream)
+{
+    static u_char tail[] = {0x00, 0x00, 0xff, 0xff};
+    return inflate_run(stream, tail, sizeof(tail));
+}
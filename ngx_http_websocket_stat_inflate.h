@@ -0,0 +1,40 @@
+#ifndef _NGX_HTTP_WEBSOCKET_INFLATE
+#define _NGX_HTTP_WEBSOCKET_INFLATE
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <zlib.h>
+
+// permessage-deflate parameters accepted by the upstream, RFC 7692. Window
+// bits are indexed by from_client.
+typedef struct {
+    unsigned enabled : 1;
+    int window_bits[2];
+} ngx_http_websocket_deflate_t;
+
+// Inflates compressed messages of one direction as they pass, only to count
+// their real size. The output is thrown away.
+typedef struct {
+    z_stream zstream;
+    unsigned active : 1; // initialized and did not fail
+    size_t memory;       // what the stream may allocate
+} ngx_http_websocket_inflate_t;
+
+// Parses Sec-WebSocket-Extensions of the handshake response.
+void ws_deflate_parse(ngx_str_t *extensions,
+                      ngx_http_websocket_deflate_t *deflate);
+// Memory a stream with these window bits takes at most.
+size_t ws_inflate_memory(int window_bits);
+// The stream allocates from the pool, its memory goes away with it.
+ngx_int_t ws_inflate_init(ngx_http_websocket_inflate_t *stream,
+                          ngx_pool_t *pool, int window_bits);
+// Inflates a piece of compressed payload, unmasking it first if mask is
+// given. offset is the position of data within the frame payload. Returns
+// the number of uncompressed bytes or NGX_ERROR, the stream is not usable
+// after an error.
+ssize_t ws_inflate_feed(ngx_http_websocket_inflate_t *stream, u_char *data,
+                        size_t len, const u_char *mask, size_t offset);
+// Ends a message, the sender stripped the tail of its flush block.
+ssize_t ws_inflate_finish(ngx_http_websocket_inflate_t *stream);
+
+#endif
@@ -0,0 +1,241 @@
+#include "ngx_http_websocket_stat_limit.h"
+
+ngx_int_t
+ws_limit_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_websocket_limit_t *olimit = data;
+    ngx_http_websocket_limit_t *limit = shm_zone->data;
+    size_t len;
+
+    if (olimit) {
+        limit->sh = olimit->sh;
+        limit->shpool = olimit->shpool;
+        return NGX_OK;
+    }
+
+    limit->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+    if (shm_zone->shm.exists) {
+        limit->sh = limit->shpool->data;
+        return NGX_OK;
+    }
+
+    limit->sh = ngx_slab_alloc(limit->shpool,
+                               sizeof(ngx_http_websocket_limit_sh_t));
+    if (limit->sh == NULL) {
+        return NGX_ERROR;
+    }
+    limit->shpool->data = limit->sh;
+    ngx_rbtree_init(&limit->sh->rbtree, &limit->sh->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    len = sizeof(" in ws_limit_conn zone \"\"") + shm_zone->shm.name.len;
+    limit->shpool->log_ctx = ngx_slab_alloc(limit->shpool, len);
+    if (limit->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_sprintf(limit->shpool->log_ctx, " in ws_limit_conn zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ws_limit_acquire(ngx_http_websocket_limit_t *limit, ngx_str_t *key,
+                 ngx_http_websocket_limit_node_t **nodep)
+{
+    ngx_http_websocket_limit_node_t *node;
+    uint32_t hash = ngx_crc32_short(key->data, key->len);
+    ngx_int_t rc = NGX_OK;
+
+    ngx_shmtx_lock(&limit->shpool->mutex);
+
+    node = (ngx_http_websocket_limit_node_t *)ngx_str_rbtree_lookup(
+        &limit->sh->rbtree, key, hash);
+    if (node == NULL) {
+        node = ngx_slab_alloc_locked(
+            limit->shpool,
+            offsetof(ngx_http_websocket_limit_node_t, data) + key->len);
+        if (node == NULL) {
+            rc = NGX_BUSY;
+            goto done;
+        }
+        ngx_memcpy(node->data, key->data, key->len);
+        node->sn.str.data = node->data;
+        node->sn.str.len = key->len;
+        node->sn.node.key = hash;
+        node->conn = 0;
+        ngx_rbtree_insert(&limit->sh->rbtree, &node->sn.node);
+    } else if (node->conn >= limit->max) {
+        rc = NGX_BUSY;
+        goto done;
+    }
+    node->conn++;
+    *nodep = node;
+
+done:
+    ngx_shmtx_unlock(&limit->shpool->mutex);
+    return rc;
+}
+
+void
+ws_limit_release(ngx_http_websocket_limit_t *limit,
+                 ngx_http_websocket_limit_node_t *node)
+{
+    ngx_shmtx_lock(&limit->shpool->mutex);
+    if (--node->conn == 0) {
+        ngx_rbtree_delete(&limit->sh->rbtree, &node->sn.node);
+        ngx_slab_free_locked(limit->shpool, node);
+    }
+    ngx_shmtx_unlock(&limit->shpool->mutex);
+}
+
+ngx_int_t
+ws_limit_acquire_counter(ngx_atomic_t *counter, ngx_uint_t max)
+{
+    ngx_atomic_uint_t n;
+    if (max == 0) {
+        ngx_atomic_fetch_add(counter, 1);
+        return NGX_OK;
+    }
+    // the check and the increment are one step, so bursts cannot overshoot
+    do {
+        n = *counter;
+        if (n >= max) {
+            return NGX_BUSY;
+        }
+    } while (!ngx_atomic_cmp_set(counter, n, n + 1));
+    return NGX_OK;
+}
+
+ngx_int_t
+ws_rate_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_websocket_rate_t *orate = data;
+    ngx_http_websocket_rate_t *rate = shm_zone->data;
+    size_t len;
+
+    if (orate) {
+        rate->sh = orate->sh;
+        rate->shpool = orate->shpool;
+        return NGX_OK;
+    }
+
+    rate->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+    if (shm_zone->shm.exists) {
+        rate->sh = rate->shpool->data;
+        return NGX_OK;
+    }
+
+    rate->sh =
+        ngx_slab_alloc(rate->shpool, sizeof(ngx_http_websocket_rate_sh_t));
+    if (rate->sh == NULL) {
+        return NGX_ERROR;
+    }
+    rate->shpool->data = rate->sh;
+    ngx_rbtree_init(&rate->sh->rbtree, &rate->sh->sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_queue_init(&rate->sh->queue);
+
+    len = sizeof(" in ws_limit_rate zone \"\"") + shm_zone->shm.name.len;
+    rate->shpool->log_ctx = ngx_slab_alloc(rate->shpool, len);
+    if (rate->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_sprintf(rate->shpool->log_ctx, " in ws_limit_rate zone \"%V\"%Z",
+                &shm_zone->shm.name);
+    // running out of memory is handled by dropping idle keys
+    rate->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+static ngx_uint_t
+rate_excess(ngx_http_websocket_rate_t *rate,
+            ngx_http_websocket_rate_node_t *node, ngx_msec_t now)
+{
+    ngx_msec_int_t ms = (ngx_msec_int_t)(now - node->last);
+    ngx_uint_t drained;
+    if (ms < 0) {
+        ms = 0;
+    }
+    drained = rate->rate * ms / 1000;
+    return node->excess > drained ? node->excess - drained : 0;
+}
+
+// Frees least recently used keys: all drained ones among the first few, or
+// the oldest one regardless when force is set.
+static void
+rate_expire(ngx_http_websocket_rate_t *rate, ngx_msec_t now, int force)
+{
+    ngx_http_websocket_rate_node_t *node;
+    ngx_queue_t *q;
+    ngx_uint_t n;
+
+    for (n = 0; n < 3; n++) {
+        if (ngx_queue_empty(&rate->sh->queue)) {
+            return;
+        }
+        q = ngx_queue_last(&rate->sh->queue);
+        node = ngx_queue_data(q, ngx_http_websocket_rate_node_t, queue);
+        if (!force && rate_excess(rate, node, now) > 0) {
+            return;
+        }
+        force = 0;
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&rate->sh->rbtree, &node->sn.node);
+        ngx_slab_free_locked(rate->shpool, node);
+    }
+}
+
+ngx_int_t
+ws_rate_account(ngx_http_websocket_rate_t *rate, ngx_str_t *key,
+                ngx_msec_t *delay)
+{
+    ngx_http_websocket_rate_node_t *node;
+    uint32_t hash = ngx_crc32_short(key->data, key->len);
+    ngx_msec_t now = ngx_current_msec;
+    ngx_uint_t excess;
+    size_t size;
+
+    ngx_shmtx_lock(&rate->shpool->mutex);
+
+    node = (ngx_http_websocket_rate_node_t *)ngx_str_rbtree_lookup(
+        &rate->sh->rbtree, key, hash);
+    if (node == NULL) {
+        rate_expire(rate, now, 0);
+        size = offsetof(ngx_http_websocket_rate_node_t, data) + key->len;
+        node = ngx_slab_alloc_locked(rate->shpool, size);
+        if (node == NULL) {
+            rate_expire(rate, now, 1);
+            node = ngx_slab_alloc_locked(rate->shpool, size);
+            if (node == NULL) {
+                ngx_shmtx_unlock(&rate->shpool->mutex);
+                return NGX_BUSY;
+            }
+        }
+        ngx_memcpy(node->data, key->data, key->len);
+        node->sn.str.data = node->data;
+        node->sn.str.len = key->len;
+        node->sn.node.key = hash;
+        node->excess = 0;
+        node->last = now;
+        ngx_rbtree_insert(&rate->sh->rbtree, &node->sn.node);
+        ngx_queue_insert_head(&rate->sh->queue, &node->queue);
+        excess = 0;
+    } else {
+        ngx_queue_remove(&node->queue);
+        ngx_queue_insert_head(&rate->sh->queue, &node->queue);
+        excess = rate_excess(rate, node, now) + 1000;
+        if (excess > rate->burst) {
+            ngx_shmtx_unlock(&rate->shpool->mutex);
+            return NGX_BUSY;
+        }
+    }
+    node->excess = excess;
+    node->last = now;
+
+    ngx_shmtx_unlock(&rate->shpool->mutex);
+
+    *delay = rate->nodelay ? 0 : excess * 1000 / rate->rate;
+    return NGX_OK;
+}
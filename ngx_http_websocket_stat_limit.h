@@ -0,0 +1,71 @@
+#ifndef _NGX_HTTP_WEBSOCKET_LIMIT
+#define _NGX_HTTP_WEBSOCKET_LIMIT
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+// Number of open websocket connections per key. A node exists while the key
+// has connections and is freed with the last one.
+typedef struct {
+    ngx_str_node_t sn;
+    ngx_uint_t conn;
+    u_char data[1];
+} ngx_http_websocket_limit_node_t;
+
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+} ngx_http_websocket_limit_sh_t;
+
+typedef struct {
+    ngx_http_websocket_limit_sh_t *sh;
+    ngx_slab_pool_t *shpool;
+    ngx_shm_zone_t *shm_zone;
+    ngx_http_complex_value_t key;
+    ngx_uint_t max;
+} ngx_http_websocket_limit_t;
+
+ngx_int_t ws_limit_init(ngx_shm_zone_t *shm_zone, void *data);
+// Takes one of max slots of the key. Returns NGX_BUSY when all of them are
+// taken or the zone is out of memory.
+ngx_int_t ws_limit_acquire(ngx_http_websocket_limit_t *limit, ngx_str_t *key,
+                           ngx_http_websocket_limit_node_t **node);
+void ws_limit_release(ngx_http_websocket_limit_t *limit,
+                      ngx_http_websocket_limit_node_t *node);
+// Same reservation for a plain shared counter, max 0 means no limit.
+ngx_int_t ws_limit_acquire_counter(ngx_atomic_t *counter, ngx_uint_t max);
+
+// Token bucket of new connections per key. excess is the number of tokens
+// taken over the rate, in thousandths; it drains at the rate and requests
+// are refused when it would grow above burst.
+typedef struct {
+    ngx_str_node_t sn;
+    ngx_queue_t queue;
+    ngx_msec_t last;
+    ngx_uint_t excess;
+    u_char data[1];
+} ngx_http_websocket_rate_node_t;
+
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t queue; // least recently used last
+} ngx_http_websocket_rate_sh_t;
+
+typedef struct {
+    ngx_http_websocket_rate_sh_t *sh;
+    ngx_slab_pool_t *shpool;
+    ngx_shm_zone_t *shm_zone;
+    ngx_http_complex_value_t key; // no key limits all connections together
+    ngx_uint_t rate;              // requests per 1000 seconds
+    ngx_uint_t burst;             // in thousandths
+    unsigned nodelay : 1;
+} ngx_http_websocket_rate_t;
+
+ngx_int_t ws_rate_init(ngx_shm_zone_t *shm_zone, void *data);
+// Takes a token of the key. Returns NGX_BUSY when the burst is exhausted,
+// otherwise sets delay to the time the request should wait, in ms.
+ngx_int_t ws_rate_account(ngx_http_websocket_rate_t *rate, ngx_str_t *key,
+                          ngx_msec_t *delay);
+#endif
@@ -0,0 +1,252 @@
+#include "ngx_http_websocket_stat_log.h"
+#include "ngx_http_websocket_stat_binlog.h"
+#include "ngx_http_websocket_stat_syslog.h"
+#ifndef TEST
+#include <ngx_event.h>
+#endif
+
+static u_char LINE_END = '\n';
+
+#define SCRATCH_MIN_SIZE (4 * 1024)
+
+// Lines that do not fit into the log buffer are rendered here. It only grows,
+// so once the longest line has been seen logging does not allocate.
+static u_char *scratch;
+static size_t scratch_size;
+
+static void
+ws_log_write_fd(ngx_open_file_t *file, struct iovec *iov, int iovcnt,
+                size_t len)
+{
+    ssize_t n;
+    if (file->fd == NGX_INVALID_FILE) {
+        return;
+    }
+    n = writev(file->fd, iov, iovcnt);
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "writev() to \"%V\" failed", &file->name);
+    } else if ((size_t)n != len) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "writev() to \"%V\" was incomplete: %z of %uz",
+                      &file->name, n, len);
+    }
+}
+
+static void
+ws_log_file_flush(ngx_open_file_t *file, ngx_log_t *log)
+{
+    struct iovec iov;
+    ngx_http_websocket_log_buf_t *buffer = file->data;
+    size_t len = buffer->pos - buffer->start;
+
+    if (len) {
+        iov.iov_base = buffer->start;
+        iov.iov_len = len;
+        ws_log_write_fd(file, &iov, 1, len);
+        buffer->pos = buffer->start;
+    }
+    if (buffer->event && buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
+    }
+}
+
+static void
+ws_log_flush_handler(ngx_event_t *ev)
+{
+    ws_log_file_flush(ev->data, ev->log);
+}
+
+static void
+ws_log_arm_timer(ngx_http_websocket_log_buf_t *buffer)
+{
+    if (buffer->pos == buffer->start && buffer->event &&
+        !buffer->event->timer_set) {
+        ngx_add_timer(buffer->event, buffer->flush);
+    }
+}
+
+ngx_int_t
+ws_log_set_buffer(ngx_conf_t *cf, ngx_http_websocket_log_t *log, size_t size,
+                  ngx_msec_t flush)
+{
+    ngx_http_websocket_log_buf_t *buffer = log->file->data;
+
+    if (buffer) {
+        // the same file is already buffered by another ws_log
+        if (buffer->last - buffer->start != (ssize_t)size ||
+            buffer->flush != flush) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "ws_log \"%V\" already defined with "
+                               "different buffer or flush",
+                               &log->file->name);
+            return NGX_ERROR;
+        }
+        log->buffer = buffer;
+        return NGX_OK;
+    }
+
+    buffer = ngx_pcalloc(cf->pool, sizeof(ngx_http_websocket_log_buf_t));
+    if (buffer == NULL) {
+        return NGX_ERROR;
+    }
+    buffer->start = ngx_pnalloc(cf->pool, size);
+    if (buffer->start == NULL) {
+        return NGX_ERROR;
+    }
+    buffer->pos = buffer->start;
+    buffer->last = buffer->start + size;
+    buffer->flush = flush;
+    if (flush) {
+        buffer->event = ngx_pcalloc(cf->pool, sizeof(ngx_event_t));
+        if (buffer->event == NULL) {
+            return NGX_ERROR;
+        }
+        buffer->event->data = log->file;
+        buffer->event->handler = ws_log_flush_handler;
+        buffer->event->log = &cf->cycle->new_log;
+        // do not keep exiting workers alive, exit flushes the buffer anyway
+        buffer->event->cancelable = 1;
+    }
+
+    log->file->flush = ws_log_file_flush;
+    log->file->data = buffer;
+    log->buffer = buffer;
+    return NGX_OK;
+}
+
+static ngx_int_t
+ws_log_grow_scratch(size_t size)
+{
+    u_char *p;
+    size_t new_size = scratch_size ? scratch_size : SCRATCH_MIN_SIZE;
+    while (new_size < size) {
+        new_size *= 2;
+    }
+    p = ngx_alloc(new_size, ngx_cycle->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_free(scratch);
+    scratch = p;
+    scratch_size = new_size;
+    return NGX_OK;
+}
+
+u_char *
+ws_log_render_scratch(ws_log_render_pt render, void *data, size_t *len)
+{
+    u_char *p;
+
+    if (scratch == NULL && ws_log_grow_scratch(SCRATCH_MIN_SIZE) != NGX_OK) {
+        return NULL;
+    }
+    for (;;) {
+        p = render(data, scratch, scratch + scratch_size - 1);
+        if (p <= scratch + scratch_size - 1) {
+            break;
+        }
+        if (ws_log_grow_scratch(p - scratch + 1) != NGX_OK) {
+            return NULL;
+        }
+    }
+    *len = p - scratch;
+    return scratch;
+}
+
+void
+ws_log_render(ngx_http_websocket_log_t *log, ws_log_render_pt render,
+              void *data)
+{
+    u_char *p, *line;
+    size_t len;
+    ngx_http_websocket_log_buf_t *buffer = log->buffer;
+
+    if (log->syslog) {
+        ws_syslog_render(log->syslog, render, data);
+        return;
+    }
+    if (buffer) {
+        // leave room for the line end
+        p = render(data, buffer->pos, buffer->last - 1);
+        if (p > buffer->last - 1 && buffer->pos != buffer->start) {
+            ws_log_file_flush(log->file, ngx_cycle->log);
+            p = render(data, buffer->pos, buffer->last - 1);
+        }
+        if (p <= buffer->last - 1) {
+            ws_log_arm_timer(buffer);
+            *p++ = LINE_END;
+            buffer->pos = p;
+            return;
+        }
+        // the line is larger than the whole buffer
+    }
+
+    line = ws_log_render_scratch(render, data, &len);
+    if (line == NULL) {
+        return;
+    }
+    line[len++] = LINE_END;
+
+    struct iovec iov;
+    iov.iov_base = line;
+    iov.iov_len = len;
+    ws_log_write_fd(log->file, &iov, 1, len);
+}
+
+// Every write starts with a file header, so any flushed piece of the file,
+// whichever worker wrote it and whether or not the log was rotated, can be
+// read on its own.
+static u_char *
+ws_log_binary_header(u_char *p)
+{
+    ngx_memcpy(p, WS_BINLOG_MAGIC, WS_BINLOG_MAGIC_LEN);
+    ws_binlog_put16(p + WS_BINLOG_HEADER_VERSION, WS_BINLOG_VERSION);
+    ws_binlog_put16(p + WS_BINLOG_HEADER_SIZE_FIELD, WS_BINLOG_HEADER_SIZE);
+    ws_binlog_put32(p + WS_BINLOG_HEADER_PID, ngx_pid);
+    ws_binlog_put32(p + WS_BINLOG_HEADER_PID + 4, 0);
+    return p + WS_BINLOG_HEADER_SIZE;
+}
+
+void
+ws_log_record(ngx_http_websocket_log_t *log,
+              ngx_http_websocket_log_record_t *record)
+{
+    ngx_http_websocket_log_buf_t *buffer = log->buffer;
+    size_t size = WS_BINLOG_RECORD_SIZE;
+    u_char *p;
+
+    if (buffer->pos == buffer->start) {
+        size += WS_BINLOG_HEADER_SIZE;
+    }
+    if (size > (size_t)(buffer->last - buffer->pos)) {
+        ws_log_file_flush(log->file, ngx_cycle->log);
+    }
+    if (buffer->pos == buffer->start) {
+        ws_log_arm_timer(buffer);
+        buffer->pos = ws_log_binary_header(buffer->pos);
+    }
+
+    p = buffer->pos;
+    ws_binlog_put16(p + WS_BINLOG_RECORD_LEN, WS_BINLOG_RECORD_SIZE);
+    p[WS_BINLOG_RECORD_TYPE] = record->type;
+    p[WS_BINLOG_RECORD_FLAGS] = record->flags;
+    p[WS_BINLOG_RECORD_OPCODE] = record->opcode;
+    ngx_memzero(p + WS_BINLOG_RECORD_OPCODE + 1, 3);
+    ws_binlog_put64(p + WS_BINLOG_RECORD_TIME, record->time);
+    ws_binlog_put32(p + WS_BINLOG_RECORD_CONN, record->conn);
+    ws_binlog_put32(p + WS_BINLOG_RECORD_TCP, record->tcp);
+    ws_binlog_put64(p + WS_BINLOG_RECORD_PAYLOAD, record->payload);
+    buffer->pos = p + WS_BINLOG_RECORD_SIZE;
+}
+
+void
+ws_log_flush(ngx_http_websocket_log_t *log)
+{
+    if (log->syslog) {
+        ws_syslog_flush(log->syslog);
+    }
+    if (log->buffer) {
+        ws_log_file_flush(log->file, ngx_cycle->log);
+    }
+}
@@ -0,0 +1,173 @@
+#ifndef _NGX_HTTP_WEBSOCKET_LOG
+#define _NGX_HTTP_WEBSOCKET_LOG
+
+#ifdef TEST
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef intptr_t ngx_int_t;
+typedef uintptr_t ngx_uint_t;
+typedef unsigned char u_char;
+typedef int ngx_fd_t;
+typedef int ngx_socket_t;
+typedef int ngx_err_t;
+typedef ngx_uint_t ngx_msec_t;
+typedef volatile unsigned long ngx_atomic_t;
+typedef void ngx_pool_t;
+
+typedef struct {
+    int level;
+} ngx_log_t;
+
+typedef struct {
+    size_t len;
+    u_char *data;
+} ngx_str_t;
+
+typedef struct ngx_event_s ngx_event_t;
+struct ngx_event_s {
+    void *data;
+    void (*handler)(ngx_event_t *ev);
+    ngx_log_t *log;
+    unsigned timer_set : 1;
+    unsigned cancelable : 1;
+};
+
+typedef struct {
+    ngx_log_t *log;
+    ngx_log_t new_log;
+} ngx_cycle_t;
+
+typedef struct {
+    ngx_pool_t *pool;
+    ngx_cycle_t *cycle;
+} ngx_conf_t;
+
+typedef struct {
+    void (*handler)(void *data);
+    void *data;
+} ngx_pool_cleanup_t;
+
+typedef struct ngx_open_file_s ngx_open_file_t;
+struct ngx_open_file_s {
+    ngx_fd_t fd;
+    ngx_str_t name;
+    void (*flush)(ngx_open_file_t *file, ngx_log_t *log);
+    void *data;
+};
+
+typedef struct {
+    struct sockaddr *sockaddr;
+    socklen_t socklen;
+    ngx_str_t name;
+} ngx_addr_t;
+
+typedef struct {
+    ngx_addr_t server;
+} ngx_syslog_peer_t;
+
+#define NGX_OK 0
+#define NGX_ERROR -1
+#define NGX_CONF_OK NULL
+#define NGX_INVALID_FILE -1
+#define NGX_EINTR EINTR
+#define NGX_EAGAIN EAGAIN
+#define NGX_MAXHOSTNAMELEN 256
+#define NGX_HAVE_SENDMMSG 1
+
+#define ngx_min(a, b) ((a) < (b) ? (a) : (b))
+#define ngx_max(a, b) ((a) > (b) ? (a) : (b))
+#define ngx_memcpy memcpy
+#define ngx_cpymem(dst, src, n) ((u_char *)memcpy(dst, src, n) + (n))
+#define ngx_memzero(buf, n) memset(buf, 0, n)
+#define ngx_alloc(size, log) malloc(size)
+#define ngx_free free
+#define ngx_pcalloc(pool, size) calloc(1, size)
+#define ngx_pnalloc(pool, size) malloc(size)
+#define ngx_time() time(NULL)
+#define ngx_pid getpid()
+#define ngx_errno errno
+#define ngx_socket_errno errno
+#define ngx_socket socket
+#define ngx_socket_n "socket()"
+#define ngx_nonblocking(s) fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK)
+#define ngx_nonblocking_n "fcntl(O_NONBLOCK)"
+#define ngx_close_socket close
+#define ngx_log_error(...)
+#define ngx_conf_log_error(...)
+#define ngx_atomic_fetch_add(value, add) __sync_fetch_and_add(value, add)
+#define ngx_add_timer(ev, timer) (ev)->timer_set = 1
+#define ngx_del_timer(ev) (ev)->timer_set = 0
+
+// provided by the test
+extern ngx_cycle_t *ngx_cycle;
+ngx_pool_cleanup_t *ngx_pool_cleanup_add(ngx_pool_t *p, size_t size);
+char *ngx_syslog_process_conf(ngx_conf_t *cf, ngx_syslog_peer_t *peer);
+u_char *ngx_syslog_add_header(ngx_syslog_peer_t *peer, u_char *buf);
+
+#else
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#endif
+
+// Per-worker memory buffer in front of the websocket log file. It is written
+// out when it fills up, when the flush timer fires, on log reopen and at
+// worker exit.
+typedef struct {
+    u_char *start;
+    u_char *pos;
+    u_char *last;
+    ngx_event_t *event;
+    ngx_msec_t flush;
+} ngx_http_websocket_log_buf_t;
+
+// See ngx_http_websocket_stat_syslog.h
+typedef struct ngx_http_websocket_syslog_s ngx_http_websocket_syslog_t;
+
+// Either file or syslog is set.
+typedef struct {
+    ngx_open_file_t *file;
+    ngx_http_websocket_log_buf_t *buffer;
+    ngx_http_websocket_syslog_t *syslog;
+    // format=binary, see ngx_http_websocket_stat_binlog.h; always buffered
+    unsigned binary : 1;
+} ngx_http_websocket_log_t;
+
+// One event of a binary log, WS_BINLOG_RECORD_* type and flags.
+typedef struct {
+    ngx_uint_t type;
+    ngx_uint_t flags;
+    ngx_uint_t opcode;
+    uint64_t time;
+    uint32_t conn;
+    uint32_t tcp;
+    uint64_t payload;
+} ngx_http_websocket_log_record_t;
+
+// Renders a line at buf, see template_op for the overflow convention.
+typedef u_char *(*ws_log_render_pt)(void *data, u_char *buf, u_char *last);
+
+ngx_int_t ws_log_set_buffer(ngx_conf_t *cf, ngx_http_websocket_log_t *log,
+                            size_t size, ngx_msec_t flush);
+// Renders a line of any length into a scratch buffer of the worker, with room
+// for a line end after it. Returns the line, or NULL if out of memory.
+u_char *ws_log_render_scratch(ws_log_render_pt render, void *data,
+                              size_t *len);
+void ws_log_render(ngx_http_websocket_log_t *log, ws_log_render_pt render,
+                   void *data);
+void ws_log_record(ngx_http_websocket_log_t *log,
+                   ngx_http_websocket_log_record_t *record);
+void ws_log_flush(ngx_http_websocket_log_t *log);
+
+#endif
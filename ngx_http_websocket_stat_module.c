@@ -1,5 +1,14 @@
+#include "ngx_http_websocket_stat_binlog.h"
 #include "ngx_http_websocket_stat_format.h"
 #include "ngx_http_websocket_stat_frame_counter.h"
+#include "ngx_http_websocket_stat_histogram.h"
+#include "ngx_http_websocket_stat_inflate.h"
+#include "ngx_http_websocket_stat_limit.h"
+#include "ngx_http_websocket_stat_registry.h"
+#include "ngx_http_websocket_stat_log.h"
+#include "ngx_http_websocket_stat_syslog.h"
+#include "ngx_http_websocket_stat_tap.h"
+#include "ngx_http_websocket_stat_zone.h"
 #include <assert.h>
 #include <ngx_config.h>
 #include <ngx_core.h>
@@ -9,31 +18,153 @@
 #include <openssl/evp.h>
 #include <openssl/sha.h>
 
-#define UID_LENGTH 32
 #define KEY_SIZE 24
 #define ACCEPT_SIZE 28
 #define GUID_SIZE 36
 // It contains 36 characters.
 char const *const kWsGUID = "369FB0B6-FA25-58EB-A6DB-D6BC1ED96C22";
 char const *const kWsKey = "Sec-WebSocket-Key";
+// Payload of pings sent by ws_ping, pongs echoing it are not proxied.
+#define PING_PAYLOAD_SIZE 7
+char const *const kWsPingPayload = "ngx-png";
 
-#define TEMPLATE_BUFF_SIZE (4 * 1024)
+// Request variables available in log templates. Their indexes are resolved
+// at configuration time and values are captured once at upgrade.
+typedef enum {
+    CORE_VAR_REQUEST,
+    CORE_VAR_URI,
+    CORE_VAR_REMOTE_USER,
+    CORE_VAR_REMOTE_ADDR,
+    CORE_VAR_REMOTE_PORT,
+    CORE_VAR_SERVER_ADDR,
+    CORE_VAR_SERVER_PORT,
+    CORE_VAR_REQUEST_ID,
+    CORE_VARS_COUNT
+} core_var_id;
+
+static ngx_str_t core_var_names[CORE_VARS_COUNT] = {
+    ngx_string("request"),     ngx_string("uri"),
+    ngx_string("remote_user"), ngx_string("remote_addr"),
+    ngx_string("remote_port"), ngx_string("server_addr"),
+    ngx_string("server_port"), ngx_string("request_id")};
+
+// Traffic allowance of one direction of a connection, in thousandths of a
+// byte and of a frame. Bytes are never overdrawn, frames are known only
+// after the data is parsed so they may go below zero.
+typedef struct {
+    ngx_msec_t last;
+    int64_t bytes;
+    int64_t frames;
+} ngx_http_websocket_bucket_t;
 
 typedef struct {
     time_t ws_conn_start_time;
-    ngx_frame_counter_t frame_counter;
+    // parsers of both directions, indexed by from_client
+    ngx_frame_counter_t frame_counter[2];
     ngx_str_t connection_id;
+    // hash of connection_id, picks sampled connections and stands for the
+    // connection in binary logs
+    uint32_t id_hash;
+    ngx_str_t core_vars[CORE_VARS_COUNT];
+    // $http_* values captured at upgrade, indexed like template header names
+    ngx_str_t *http_headers;
+    // log sampling decided at upgrade: whether frames of this connection are
+    // logged at all and how many frames are left until the next logged one
+    unsigned log_connection : 1;
+    ngx_uint_t log_frame_countdown;
+    // counters of this connection's key in every ws_stat_zone
+    ngx_http_websocket_zone_counters_t **zone_counters;
+    ngx_uint_t zone_count;
+    unsigned closed : 1;
+    // ws_limit_traffic state, indexed by from_client
+    ngx_http_websocket_bucket_t bucket[2];
+    ngx_event_t shape_timer[2];
+    // closes the connection once it is older than ws_conn_age
+    ngx_event_t age_timer;
+    // ws_ping: when the client last sent anything and how many pings went
+    // unanswered since
+    ngx_event_t ping_timer;
+    ngx_msec_t last_activity;
+    ngx_uint_t pings_missed;
+    unsigned ping_sent : 1;
+    // a close waiting for the frame going to the client to end, see
+    // close_connection
+    ngx_event_t close_timer;
+    ngx_msec_t close_deadline;
+    int close_status;
+    const char *close_reason;
+    // permessage-deflate as negotiated at upgrade, whether the message being
+    // passed is compressed and, on sampled connections, the inflate streams,
+    // all indexed by from_client
+    ngx_str_t extensions;
+    ngx_http_websocket_deflate_t deflate;
+    u_char compressed[2];
+    ngx_http_websocket_inflate_t *inflate[2];
+    // entry in ws_stat_registry, NULL when the table was full
+    ngx_http_websocket_registry_slot_t *registry_slot;
+    // open connections of this worker, for ws_admin_close and
+    // ws_drain_on_reload
+    ngx_queue_t queue;
+    unsigned queued : 1;
+    ngx_http_request_t *request;
 
 } ngx_http_websocket_stat_ctx;
 
+#define WS_OPCODES 16
+
 typedef struct {
-    ngx_atomic_t *frames;
-    ngx_atomic_t *total_payload_size;
-    ngx_atomic_t *total_size;
+    ngx_atomic_t frames;
+    ngx_atomic_t payload;
+} ngx_http_websocket_stat_opcode_t;
+
+typedef struct {
+    ngx_atomic_t frames;
+    ngx_atomic_t total_payload_size;
+    ngx_atomic_t total_size;
+    // only the owning worker writes them, so they are updated without locking
+    ngx_http_websocket_stat_opcode_t opcodes[WS_OPCODES];
+    ngx_http_websocket_histogram_t payload_sizes;
+    // frames of permessage-deflate messages and their payload, and payload
+    // of sampled connections before and after inflating
+    ngx_atomic_t compressed_frames;
+    ngx_atomic_t compressed_payload;
+    ngx_atomic_t inflate_in;
+    ngx_atomic_t inflate_out;
 } ngx_http_websocket_stat_statistic_t;
 
-ngx_http_websocket_stat_statistic_t frames_in;
-ngx_http_websocket_stat_statistic_t frames_out;
+// Every worker owns one shard of counters in the shared zone, so workers never
+// write to the same cache line. Readers add the shards up.
+typedef struct {
+    ngx_http_websocket_stat_statistic_t frames_in;
+    ngx_http_websocket_stat_statistic_t frames_out;
+    // connection lifetime in seconds, recorded at close
+    ngx_http_websocket_histogram_t conn_age;
+    // connections that negotiated permessage-deflate, ones picked by
+    // ws_inflate_sample and ones left out for lack of memory
+    ngx_atomic_t deflate_connections;
+    ngx_atomic_t inflate_connections;
+    ngx_atomic_t inflate_skipped;
+    // lines ws_log sent to syslog and ones dropped when the socket did not
+    // take them
+    ngx_atomic_t log_sent;
+    ngx_atomic_t log_dropped;
+} ngx_http_websocket_stat_shard_t;
+
+#define STAT_CACHE_LINE 128
+
+// ws_drain_on_reload: connections still open in exiting workers and
+// connections closed by the drain. Shards are allocated anew with every
+// configuration, so these live in a zone of their own that nginx keeps over
+// reloads, where the workers of the new configuration see the old ones drain.
+typedef struct {
+    ngx_atomic_t draining;
+    ngx_atomic_t drained;
+} ngx_http_websocket_drain_sh_t;
+
+u_char *stat_shards;
+size_t stat_shard_size;
+ngx_uint_t stat_nshards;
+ngx_http_websocket_stat_shard_t *stat_shard;
 
 ngx_frame_counter_t frame_counter_in;
 ngx_frame_counter_t frame_counter_out;
@@ -42,7 +173,10 @@ ngx_http_websocket_stat_ctx *stat_counter;
 typedef struct {
     int from_client;
     ngx_http_websocket_stat_ctx *ws_ctx;
-    u_char *buf;
+    // payload of the frame being logged, still masked; NULL when the frame
+    // started in an earlier read
+    u_char *payload;
+    size_t payload_size;
     size_t pending_size;
 
 } template_ctx_s;
@@ -57,19 +191,48 @@ static char *ngx_http_ws_logfile(ngx_conf_t *cf, ngx_command_t *cmd,
                                  void *conf);
 static char *ngx_http_ws_log_format(ngx_conf_t *cf, ngx_command_t *cmd,
                                     void *conf);
+static char *ngx_http_ws_log_sample(ngx_conf_t *cf, ngx_command_t *cmd,
+                                    void *conf);
+static char *ngx_http_ws_stat_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                   void *conf);
+static char *ngx_http_ws_limit_conn(ngx_conf_t *cf, ngx_command_t *cmd,
+                                    void *conf);
+static char *ngx_http_ws_limit_rate(ngx_conf_t *cf, ngx_command_t *cmd,
+                                    void *conf);
+static char *ngx_http_ws_limit_traffic(ngx_conf_t *cf, ngx_command_t *cmd,
+                                       void *conf);
+static char *ngx_http_ws_ping(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_ws_inflate_sample(ngx_conf_t *cf, ngx_command_t *cmd,
+                                        void *conf);
+static char *ngx_http_ws_tap(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_ws_drain_on_reload(ngx_conf_t *cf, ngx_command_t *cmd,
+                                         void *conf);
+static char *ngx_http_ws_stat_registry(ngx_conf_t *cf, ngx_command_t *cmd,
+                                       void *conf);
+static char *ngx_http_ws_admin_close(ngx_conf_t *cf, ngx_command_t *cmd,
+                                     void *conf);
 static ngx_int_t ngx_http_websocket_stat_handler(ngx_http_request_t *r);
+static ngx_table_elt_t *find_header(ngx_list_t *headers,
+                                    const char *header_name);
 static ngx_int_t ngx_http_websocket_stat_init(ngx_conf_t *cf);
 
 static void *ngx_http_websocket_stat_create_main_conf(ngx_conf_t *cf);
-const char *get_core_var(ngx_http_request_t *r, const char *variable);
+static void *ngx_http_websocket_stat_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_websocket_stat_merge_loc_conf(ngx_conf_t *cf,
+                                                    void *parent, void *child);
+static ngx_int_t ngx_http_websocket_stat_init_module(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_websocket_stat_init_process(ngx_cycle_t *cycle);
+static void ngx_http_websocket_stat_exit_process(ngx_cycle_t *cycle);
 
 static void send_close_packet(ngx_connection_t *connection, int status,
                               const char *reason);
 
 static ngx_atomic_t *ngx_websocket_stat_active;
+// of the configuration the worker started with, NULL without
+// ws_drain_on_reload
+static ngx_http_websocket_drain_sh_t *drain_sh;
 
-char CARET_RETURN = '\n';
-ngx_log_t *ws_log = NULL;
+ngx_http_websocket_log_t *ws_log = NULL;
 const char *UNKNOWN_VAR = "???";
 
 static void
@@ -91,33 +254,161 @@ Base64Encode(unsigned char *hash, int hash_len, char *buffer, int len)
     BIO_free_all(b64);
 }
 
-void
-websocket_log(char *str)
+typedef struct {
+    compiled_template *template;
+    ngx_http_request_t *r;
+    void *ctx;
+} log_line_ctx_s;
+
+static u_char *
+render_log_line(void *data, u_char *buf, u_char *last)
+{
+    log_line_ctx_s *line = data;
+    return apply_template(line->template, line->r, line->ctx, buf, last);
+}
+
+compiled_template *log_template;
+compiled_template *log_close_template;
+compiled_template *log_open_template;
+
+// Binary logs keep the fields of the event and skip the template.
+static void
+log_record(compiled_template *template, template_ctx_s *ctx)
 {
-    if (!ws_log)
+    ngx_http_websocket_log_record_t record;
+    ngx_http_websocket_stat_ctx *ws = ctx->ws_ctx;
+    ngx_frame_counter_t *fc;
+    ngx_time_t *tp = ngx_timeofday();
+
+    if (ws == NULL) {
         return;
-    ngx_write_fd(ws_log->file->fd, str, strlen(str));
-    ngx_write_fd(ws_log->file->fd, &CARET_RETURN, sizeof(char));
+    }
+    ngx_memzero(&record, sizeof(record));
+    record.time = (uint64_t)tp->sec * 1000 + tp->msec;
+    record.conn = ws->id_hash;
+    if (ctx->from_client) {
+        record.flags |= WS_BINLOG_FLAG_FROM_CLIENT;
+    }
+    if (template == log_open_template) {
+        record.type = WS_BINLOG_RECORD_OPEN;
+    } else if (template == log_close_template) {
+        record.type = WS_BINLOG_RECORD_CLOSE;
+        record.payload = ngx_time() - ws->ws_conn_start_time;
+    } else {
+        fc = &ws->frame_counter[ctx->from_client];
+        record.type = WS_BINLOG_RECORD_FRAME;
+        record.opcode = fc->current_frame_type;
+        record.payload = fc->current_payload_size;
+        record.tcp = ctx->pending_size;
+        if (ws->compressed[ctx->from_client] &&
+            fc->current_frame_type < CLOSE) {
+            record.flags |= WS_BINLOG_FLAG_COMPRESSED;
+        }
+    }
+    ws_log_record(ws_log, &record);
 }
 
 void
 ws_do_log(compiled_template *template, ngx_http_request_t *r, void *ctx)
 {
     if (ws_log) {
-        char *log_line = apply_template(template, r, ctx);
-        websocket_log(log_line);
-        free(log_line);
+        if (ws_log->binary) {
+            log_record(template, ctx);
+            return;
+        }
+        log_line_ctx_s line = {template, r, ctx};
+        ws_log_render(ws_log, render_log_line, &line);
+    }
+}
+
+// Unlike the log, the tap gets every frame, sampling does not apply.
+static void
+tap_frame(ngx_http_websocket_stat_ctx *ws, int from_client, ssize_t tcp)
+{
+    ws_tap_record_t record;
+    ngx_frame_counter_t *fc = &ws->frame_counter[from_client];
+    ngx_time_t *tp = ngx_timeofday();
+
+    ngx_memzero(&record, sizeof(record));
+    record.time = (uint64_t)tp->sec * 1000 + tp->msec;
+    record.payload = fc->current_payload_size;
+    record.conn = ws->id_hash;
+    record.tcp = tcp;
+    record.opcode = fc->current_frame_type;
+    if (from_client) {
+        record.flags |= WS_TAP_FROM_CLIENT;
+    }
+    if (ws->compressed[from_client] && fc->current_frame_type < CLOSE) {
+        record.flags |= WS_TAP_COMPRESSED;
     }
+    ws_tap_push(&record);
 }
 
+// Open and close events are logged either for every connection or only for
+// connections picked by ws_log_sample.
+#define WS_SAMPLE_EVENTS_ALL 0
+#define WS_SAMPLE_EVENTS_SAMPLED 1
+
+// ws_drain_on_reload window when none is given, in milliseconds.
+#define WS_DRAIN_WINDOW 10000
+// ws_inflate_sample memory per worker when none is given.
+#define WS_INFLATE_MEMORY (1024 * 1024)
+// ws_tap records per worker when none is given.
+#define WS_TAP_RECORDS 65536
+// ws_log syslog: datagram size, fits into an ethernet frame over IPv4, and
+// flush time when none are given.
+#define WS_SYSLOG_DATAGRAM 1472
+#define WS_SYSLOG_FLUSH 1000
+
 typedef struct ngx_http_websocket_main_conf_s {
     int max_ws_connections;
     int max_ws_age;
+    // ws_conn_age jitter= and rate=, closes per second per worker
+    ngx_msec_t age_jitter;
+    ngx_uint_t age_close_rate;
+    // ws_ping interval and missed pongs before the connection is closed
+    ngx_msec_t ping_interval;
+    ngx_uint_t ping_misses;
+    // ws_drain_on_reload window and closes per second per worker
+    ngx_flag_t drain;
+    ngx_msec_t drain_window;
+    ngx_uint_t drain_rate;
+    ngx_http_websocket_drain_sh_t *drain_sh;
+    ngx_http_websocket_registry_t *registry;
+    ngx_int_t core_var_index[CORE_VARS_COUNT];
+    // ws_log_sample rates, 1/N is stored as N
+    ngx_uint_t sample_frame;
+    ngx_uint_t sample_connection;
+    ngx_uint_t sample_events;
+    // ws_inflate_sample rate, 1/N is stored as N, 0 is off, and memory all
+    // inflate streams of a worker may take, each worker counts its own
+    ngx_uint_t inflate_sample;
+    size_t inflate_memory;
+    // ws_tap file and records in each ring of it
+    ngx_str_t tap_path;
+    ngx_uint_t tap_records;
+    ngx_array_t *zones;  // of ngx_http_websocket_zone_t *
+    // of ngx_shm_zone_t *, named by ws_stat zone= and checked once all
+    // ws_stat_zone are known
+    ngx_array_t *stat_zones;
+    ngx_array_t *limits; // of ngx_http_websocket_limit_t *
+    ngx_array_t *rates;  // of ngx_http_websocket_rate_t *
+    // ws_limit_traffic bytes and frames per second, indexed by from_client,
+    // 0 is no limit
+    ngx_uint_t traffic_bytes[2];
+    ngx_uint_t traffic_frames[2];
 } ngx_http_websocket_main_conf_t;
 
-compiled_template *log_template;
-compiled_template *log_close_template;
-compiled_template *log_open_template;
+#define WS_STAT_FORMAT_TEXT 0
+#define WS_STAT_FORMAT_JSON 1
+#define WS_STAT_FORMAT_PROMETHEUS 2
+
+typedef struct {
+    ngx_uint_t format;
+    ngx_shm_zone_t *zone;  // ws_stat zone=
+    ngx_flag_t connections; // ws_stat connections
+} ngx_http_websocket_loc_conf_t;
+
 
 char *default_log_template_str =
     "$time_local: packet received from $ws_packet_source";
@@ -128,21 +419,44 @@ ssize_t (*orig_recv)(ngx_connection_t *c, u_char *buf, size_t size);
 
 static ngx_command_t ngx_http_websocket_stat_commands[] = {
 
-    {ngx_string("ws_stat"),               /* directive */
-     NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS, /* location context and takes
-                                             no arguments*/
-     ngx_http_websocket_stat,             /* configuration setup function */
-     0, /* No offset. Only one context is supported. */
+    {ngx_string("ws_stat"), /* directive */
+     NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS |
+         NGX_CONF_TAKE123, /* location context, format= zone= connections */
+     ngx_http_websocket_stat, /* configuration setup function */
+     NGX_HTTP_LOC_CONF_OFFSET, /* Output format is kept per location. */
      0, /* No offset when storing the module configuration on struct. */
      NULL},
     {ngx_string("ws_max_connections"), NGX_HTTP_SRV_CONF | NGX_CONF_TAKE1,
      ngx_http_websocket_max_conn_setup, 0, 0, NULL},
-    {ngx_string("ws_conn_age"), NGX_HTTP_SRV_CONF | NGX_CONF_TAKE1,
+    {ngx_string("ws_conn_age"), NGX_HTTP_SRV_CONF | NGX_CONF_TAKE123,
      ngx_http_websocket_max_conn_age, 0, 0, NULL},
-    {ngx_string("ws_log"), NGX_HTTP_SRV_CONF | NGX_CONF_TAKE1,
+    {ngx_string("ws_log"), NGX_HTTP_SRV_CONF | NGX_CONF_TAKE1234,
      ngx_http_ws_logfile, 0, 0, NULL},
     {ngx_string("ws_log_format"), NGX_HTTP_SRV_CONF | NGX_CONF_1MORE,
      ngx_http_ws_log_format, 0, 0, NULL},
+    {ngx_string("ws_log_sample"), NGX_HTTP_SRV_CONF | NGX_CONF_1MORE,
+     ngx_http_ws_log_sample, 0, 0, NULL},
+    {ngx_string("ws_stat_zone"), NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE23,
+     ngx_http_ws_stat_zone, 0, 0, NULL},
+    {ngx_string("ws_limit_conn"), NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE3,
+     ngx_http_ws_limit_conn, 0, 0, NULL},
+    {ngx_string("ws_limit_rate"), NGX_HTTP_MAIN_CONF | NGX_CONF_2MORE,
+     ngx_http_ws_limit_rate, 0, 0, NULL},
+    {ngx_string("ws_limit_traffic"), NGX_HTTP_SRV_CONF | NGX_CONF_1MORE,
+     ngx_http_ws_limit_traffic, 0, 0, NULL},
+    {ngx_string("ws_ping"), NGX_HTTP_SRV_CONF | NGX_CONF_TAKE12,
+     ngx_http_ws_ping, 0, 0, NULL},
+    {ngx_string("ws_inflate_sample"), NGX_HTTP_SRV_CONF | NGX_CONF_TAKE12,
+     ngx_http_ws_inflate_sample, 0, 0, NULL},
+    {ngx_string("ws_drain_on_reload"),
+     NGX_HTTP_SRV_CONF | NGX_CONF_NOARGS | NGX_CONF_TAKE12,
+     ngx_http_ws_drain_on_reload, 0, 0, NULL},
+    {ngx_string("ws_tap"), NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE12,
+     ngx_http_ws_tap, 0, 0, NULL},
+    {ngx_string("ws_stat_registry"), NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+     ngx_http_ws_stat_registry, 0, 0, NULL},
+    {ngx_string("ws_admin_close"), NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+     ngx_http_ws_admin_close, 0, 0, NULL},
     ngx_null_command /* command termination */
 };
 
@@ -157,8 +471,8 @@ static ngx_http_module_t ngx_http_websocket_stat_module_ctx = {
     NULL, /* create server configuration */
     NULL, /* merge server configuration */
 
-    NULL, /* create location configuration */
-    NULL  /* merge location configuration */
+    ngx_http_websocket_stat_create_loc_conf, /* create location configuration */
+    ngx_http_websocket_stat_merge_loc_conf   /* merge location configuration */
 };
 
 /* Module definition. */
@@ -168,146 +482,2986 @@ ngx_module_t ngx_http_websocket_stat_module = {
     ngx_http_websocket_stat_commands,    /* module directives */
     NGX_HTTP_MODULE,                     /* module type */
     NULL,                                /* init master */
-    NULL,                                /* init module */
-    NULL,                                /* init process */
+    ngx_http_websocket_stat_init_module, /* init module */
+    ngx_http_websocket_stat_init_process, /* init process */
     NULL,                                /* init thread */
     NULL,                                /* exit thread */
-    NULL,                                /* exit process */
+    ngx_http_websocket_stat_exit_process, /* exit process */
     NULL,                                /* exit master */
     NGX_MODULE_V1_PADDING};
 
 static ngx_http_output_body_filter_pt ngx_http_next_body_filter;
 static ngx_http_output_header_filter_pt ngx_http_next_header_filter;
 
-static u_char responce_template[] =
-    "WebSocket connections: %lu\n"
-    "client websocket frames  | client websocket payload | client tcp data\n"
-    "%lu %lu %lu\n"
-    "upstream websocket frames  | upstream websocket payload | upstream tcp "
-    "data\n"
-    "%lu %lu %lu\n";
+// Opcodes reported by name, reserved ones are added up as "other".
+static const frame_type reported_opcodes[] = {CONTINUATION, TEXT, BINARY,
+                                              CLOSE,        PING, PONG};
+#define REPORTED_OPCODES                                                       \
+    (sizeof(reported_opcodes) / sizeof(reported_opcodes[0]))
 
-u_char msg[sizeof(responce_template) + 6 * NGX_ATOMIC_T_LEN];
+static const ngx_uint_t percentiles[] = {500, 900, 990, 999};
+static const char *percentile_names[] = {"p50", "p90", "p99", "p999"};
+static const char *quantile_names[] = {"0.5", "0.9", "0.99", "0.999"};
+#define PERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
 
-static ngx_int_t
-ngx_http_websocket_stat_handler(ngx_http_request_t *r)
+// Counters are added up once per request and every output format renders
+// from this snapshot, so measuring and writing the body see the same values.
+typedef struct {
+    ngx_atomic_uint_t connections;
+    ngx_http_websocket_stat_shard_t total;
+    ngx_http_websocket_drain_sh_t drain;
+    ngx_http_websocket_stat_opcode_t other_in;
+    ngx_http_websocket_stat_opcode_t other_out;
+    // ws_stat zone= readout
+    const char *zone_name;
+    ngx_array_t *zone_entries;
+    // ws_stat connections readout, of stat_connection_t
+    const char *conn_order;
+    ngx_array_t *conn_entries;
+} stat_snapshot_t;
+
+// Registry entry with null terminated strings for the renderers.
+typedef struct {
+    const char *id;
+    const char *addr;
+    const char *uri;
+    const char *upstream;
+    time_t age;
+    ngx_http_websocket_registry_traffic_t traffic[2];
+} stat_connection_t;
+
+// Renderers follow the template_op convention: nothing is written past last
+// and the returned position accounts for the full length.
+typedef u_char *(*stat_render_pt)(stat_snapshot_t *s, u_char *p,
+                                  u_char *last);
+
+static ngx_http_websocket_stat_shard_t *
+get_shard(ngx_uint_t n)
 {
-    ngx_buf_t *b;
-    ngx_chain_t out;
+    return (ngx_http_websocket_stat_shard_t *)(stat_shards +
+                                               n * stat_shard_size);
+}
+
+static void
+sum_statistic(ngx_http_websocket_stat_statistic_t *total,
+              ngx_http_websocket_stat_statistic_t *shard)
+{
+    total->frames += shard->frames;
+    total->total_payload_size += shard->total_payload_size;
+    total->total_size += shard->total_size;
+    for (ngx_uint_t i = 0; i < WS_OPCODES; i++) {
+        total->opcodes[i].frames += shard->opcodes[i].frames;
+        total->opcodes[i].payload += shard->opcodes[i].payload;
+    }
+    histogram_merge(&total->payload_sizes, &shard->payload_sizes);
+    total->compressed_frames += shard->compressed_frames;
+    total->compressed_payload += shard->compressed_payload;
+    total->inflate_in += shard->inflate_in;
+    total->inflate_out += shard->inflate_out;
+}
+
+static void
+sum_other_opcodes(ngx_http_websocket_stat_statistic_t *stat,
+                  ngx_http_websocket_stat_opcode_t *other)
+{
+    for (ngx_uint_t op = 0; op < WS_OPCODES; op++) {
+        if ((op > BINARY && op < CLOSE) || op > PONG) {
+            other->frames += stat->opcodes[op].frames;
+            other->payload += stat->opcodes[op].payload;
+        }
+    }
+}
 
-    /* Set the Content-Type header. */
-    r->headers_out.content_type.len = sizeof("text/plain") - 1;
-    r->headers_out.content_type.data = (u_char *)"text/plain:";
+static void
+take_snapshot(stat_snapshot_t *s)
+{
+    ngx_uint_t i;
+    s->connections = *ngx_websocket_stat_active;
+    for (i = 0; i < stat_nshards; i++) {
+        sum_statistic(&s->total.frames_in, &get_shard(i)->frames_in);
+        sum_statistic(&s->total.frames_out, &get_shard(i)->frames_out);
+        histogram_merge(&s->total.conn_age, &get_shard(i)->conn_age);
+        s->total.deflate_connections += get_shard(i)->deflate_connections;
+        s->total.inflate_connections += get_shard(i)->inflate_connections;
+        s->total.inflate_skipped += get_shard(i)->inflate_skipped;
+        s->total.log_sent += get_shard(i)->log_sent;
+        s->total.log_dropped += get_shard(i)->log_dropped;
+    }
+    if (drain_sh) {
+        s->drain = *drain_sh;
+    }
+    sum_other_opcodes(&s->total.frames_in, &s->other_in);
+    sum_other_opcodes(&s->total.frames_out, &s->other_out);
+}
 
-    /* Allocate a new buffer for sending out the reply. */
-    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+// Indexed by from_client
+static const char *direction_names[] = {"upstream", "client"};
 
-    /* Insertion in the buffer chain. */
-    out.buf = b;
-    out.next = NULL;
-    sprintf((char *)msg, (char *)responce_template, *ngx_websocket_stat_active,
-            *frames_in.frames, *frames_in.total_payload_size,
-            *frames_in.total_size, *frames_out.frames,
-            *frames_out.total_payload_size, *frames_out.total_size);
-
-    b->pos = msg; /* first position in memory of the data */
-    b->last =
-        msg + strlen((char *)msg); /* last position in memory of the data */
-    b->memory = 1;                 /* content is in read-only memory */
-    b->last_buf = 1;               /* there will be buffers in the request */
-
-    /* Sending the headers for the reply. */
-    r->headers_out.status = NGX_HTTP_OK;
-    /* Get the content length of the body. */
-    r->headers_out.content_length_n = strlen((char *)msg);
-    ngx_http_send_header(r); /* Send the headers */
+static ngx_http_websocket_stat_statistic_t *
+snapshot_direction(stat_snapshot_t *s, int from_client)
+{
+    return from_client ? &s->total.frames_in : &s->total.frames_out;
+}
 
-    /* Send the body, and return the status code of the output filter chain. */
-    return ngx_http_output_filter(r, &out);
+static ngx_http_websocket_stat_opcode_t *
+snapshot_opcode(stat_snapshot_t *s, int from_client, ngx_uint_t i)
+{
+    ngx_http_websocket_stat_statistic_t *stat =
+        snapshot_direction(s, from_client);
+    if (i == REPORTED_OPCODES) {
+        return from_client ? &s->other_in : &s->other_out;
+    }
+    return &stat->opcodes[reported_opcodes[i]];
+}
+
+static const char *
+opcode_name(ngx_uint_t i)
+{
+    return i == REPORTED_OPCODES ? "other"
+                                 : frame_type_to_str(reported_opcodes[i]);
+}
+
+// Plain text format. The first five lines are what ws_stat always printed.
+
+// Uncompressed to compressed size of sampled payload, with two decimals.
+static u_char *
+template_ratio(u_char *p, u_char *last, uint64_t out, uint64_t in)
+{
+    u_char buf[NGX_INT64_LEN + 4];
+    double ratio = in ? (double)out / in : 0;
+    return template_copy(p, last, buf,
+                         ngx_snprintf(buf, sizeof(buf), "%.2f", ratio) - buf);
+}
+
+static u_char *
+text_row(u_char *p, u_char *last, const char *name, uint64_t *values,
+         ngx_uint_t n)
+{
+    ngx_uint_t i;
+    if (name) {
+        p = template_copy_str(p, last, name);
+        p = template_copy_str(p, last, " ");
+    }
+    for (i = 0; i < n; i++) {
+        p = template_uint(p, last, values[i]);
+        p = template_copy_str(p, last, i + 1 < n ? " " : "\n");
+    }
+    return p;
+}
+
+static u_char *
+text_compression(u_char *p, u_char *last, const char *name,
+                 ngx_http_websocket_stat_statistic_t *st)
+{
+    uint64_t values[] = {st->compressed_frames, st->compressed_payload,
+                         st->inflate_in, st->inflate_out};
+    p = template_copy_str(p, last, name);
+    p = template_copy_str(p, last, " ");
+    for (ngx_uint_t i = 0; i < 4; i++) {
+        p = template_uint(p, last, values[i]);
+        p = template_copy_str(p, last, " ");
+    }
+    p = template_ratio(p, last, st->inflate_out, st->inflate_in);
+    return template_copy_str(p, last, "\n");
+}
+
+static u_char *
+text_totals(u_char *p, u_char *last, ngx_http_websocket_stat_statistic_t *st)
+{
+    uint64_t values[] = {st->frames, st->total_payload_size, st->total_size};
+    return text_row(p, last, NULL, values, 3);
+}
+
+static u_char *
+text_histogram(u_char *p, u_char *last, const char *name,
+               ngx_http_websocket_histogram_t *h)
+{
+    uint64_t values[PERCENTILES + 1];
+    ngx_uint_t i;
+    values[0] = histogram_count(h);
+    for (i = 0; i < PERCENTILES; i++) {
+        values[i + 1] = histogram_percentile(h, percentiles[i]);
+    }
+    return text_row(p, last, name, values, PERCENTILES + 1);
+}
+
+static u_char *
+render_text(stat_snapshot_t *s, u_char *p, u_char *last)
+{
+    ngx_http_websocket_stat_opcode_t *in, *out;
+    ngx_uint_t i;
+    p = template_copy_str(p, last, "WebSocket connections: ");
+    p = template_uint(p, last, s->connections);
+    p = template_copy_str(p, last,
+                          "\nclient websocket frames  | client websocket "
+                          "payload | client tcp data\n");
+    p = text_totals(p, last, &s->total.frames_in);
+    p = template_copy_str(p, last,
+                          "upstream websocket frames  | upstream websocket "
+                          "payload | upstream tcp data\n");
+    p = text_totals(p, last, &s->total.frames_out);
+
+    p = template_copy_str(p, last,
+                          "opcode | client frames | client payload | "
+                          "upstream frames | upstream payload\n");
+    for (i = 0; i <= REPORTED_OPCODES; i++) {
+        in = snapshot_opcode(s, 1, i);
+        out = snapshot_opcode(s, 0, i);
+        uint64_t values[] = {in->frames, in->payload, out->frames,
+                             out->payload};
+        p = text_row(p, last, opcode_name(i), values, 4);
+    }
+
+    p = template_copy_str(p, last,
+                          "histogram | count | p50 | p90 | p99 | p999\n");
+    p = text_histogram(p, last, "client_payload",
+                       &s->total.frames_in.payload_sizes);
+    p = text_histogram(p, last, "upstream_payload",
+                       &s->total.frames_out.payload_sizes);
+    p = text_histogram(p, last, "connection_age", &s->total.conn_age);
+
+    uint64_t drain[] = {s->drain.draining, s->drain.drained};
+    p = template_copy_str(p, last, "reload drain | draining | drained\n");
+    p = text_row(p, last, "connections", drain, 2);
+
+    p = template_copy_str(p, last,
+                          "permessage-deflate | compressed frames | "
+                          "compressed payload | sampled payload | inflated "
+                          "payload | ratio\n");
+    p = text_compression(p, last, "client", &s->total.frames_in);
+    p = text_compression(p, last, "upstream", &s->total.frames_out);
+    uint64_t deflate[] = {s->total.deflate_connections,
+                          s->total.inflate_connections,
+                          s->total.inflate_skipped};
+    p = template_copy_str(p, last,
+                          "permessage-deflate | negotiated | sampled | "
+                          "skipped\n");
+    p = text_row(p, last, "connections", deflate, 3);
+
+    uint64_t log[] = {s->total.log_sent, s->total.log_dropped};
+    p = template_copy_str(p, last, "ws_log syslog | sent | dropped\n");
+    return text_row(p, last, "lines", log, 2);
+}
+
+// Escapes quotes, backslashes and line breaks for JSON strings and
+// Prometheus label values, JSON also gets other control characters escaped.
+static u_char *
+escape_str(u_char *p, u_char *last, const char *str, int json)
+{
+    static u_char hex[] = "0123456789abcdef";
+    u_char esc[6] = {'\\', 'u', '0', '0'};
+    for (; *str; str++) {
+        u_char ch = *str;
+        if (ch == '"' || ch == '\\') {
+            esc[1] = ch;
+            p = template_copy(p, last, esc, 2);
+        } else if (ch == '\n') {
+            p = template_copy_str(p, last, "\\n");
+        } else if (json && ch < 0x20) {
+            esc[1] = 'u';
+            esc[4] = hex[ch >> 4];
+            esc[5] = hex[ch & 0xf];
+            p = template_copy(p, last, esc, 6);
+        } else {
+            p = template_copy(p, last, &ch, 1);
+        }
+    }
+    return p;
+}
+
+// JSON format
+
+static u_char *
+json_uint(u_char *p, u_char *last, const char *name, uint64_t value,
+          int first)
+{
+    p = template_copy_str(p, last, first ? "\"" : ",\"");
+    p = template_copy_str(p, last, name);
+    p = template_copy_str(p, last, "\":");
+    return template_uint(p, last, value);
+}
+
+static u_char *
+json_histogram(u_char *p, u_char *last, const char *name,
+               ngx_http_websocket_histogram_t *h)
+{
+    ngx_uint_t i;
+    p = template_copy_str(p, last, ",\"");
+    p = template_copy_str(p, last, name);
+    p = template_copy_str(p, last, "\":{");
+    p = json_uint(p, last, "count", histogram_count(h), 1);
+    for (i = 0; i < PERCENTILES; i++) {
+        p = json_uint(p, last, percentile_names[i],
+                      histogram_percentile(h, percentiles[i]), 0);
+    }
+    return template_copy_str(p, last, "}");
+}
+
+static u_char *
+json_direction(u_char *p, u_char *last, stat_snapshot_t *s, int from_client)
+{
+    ngx_http_websocket_stat_statistic_t *st =
+        snapshot_direction(s, from_client);
+    ngx_http_websocket_stat_opcode_t *op;
+    ngx_uint_t i;
+    p = template_copy_str(p, last,
+                          from_client ? ",\"client\":{" : ",\"upstream\":{");
+    p = json_uint(p, last, "frames", st->frames, 1);
+    p = json_uint(p, last, "payload", st->total_payload_size, 0);
+    p = json_uint(p, last, "tcp", st->total_size, 0);
+    p = template_copy_str(p, last, ",\"opcodes\":{");
+    for (i = 0; i <= REPORTED_OPCODES; i++) {
+        op = snapshot_opcode(s, from_client, i);
+        p = template_copy_str(p, last, i ? ",\"" : "\"");
+        p = template_copy_str(p, last, opcode_name(i));
+        p = template_copy_str(p, last, "\":{");
+        p = json_uint(p, last, "frames", op->frames, 1);
+        p = json_uint(p, last, "payload", op->payload, 0);
+        p = template_copy_str(p, last, "}");
+    }
+    p = template_copy_str(p, last, "},\"compressed\":{");
+    p = json_uint(p, last, "frames", st->compressed_frames, 1);
+    p = json_uint(p, last, "payload", st->compressed_payload, 0);
+    p = json_uint(p, last, "sampled_payload", st->inflate_in, 0);
+    p = json_uint(p, last, "inflated_payload", st->inflate_out, 0);
+    p = template_copy_str(p, last, ",\"ratio\":");
+    p = template_ratio(p, last, st->inflate_out, st->inflate_in);
+    p = template_copy_str(p, last, "}");
+    p = json_histogram(p, last, "payload_size", &st->payload_sizes);
+    return template_copy_str(p, last, "}");
+}
+
+static u_char *
+render_json(stat_snapshot_t *s, u_char *p, u_char *last)
+{
+    p = template_copy_str(p, last, "{");
+    p = json_uint(p, last, "connections", s->connections, 1);
+    p = json_uint(p, last, "draining", s->drain.draining, 0);
+    p = json_uint(p, last, "drained", s->drain.drained, 0);
+    p = template_copy_str(p, last, ",\"deflate\":{");
+    p = json_uint(p, last, "connections", s->total.deflate_connections, 1);
+    p = json_uint(p, last, "sampled", s->total.inflate_connections, 0);
+    p = json_uint(p, last, "skipped", s->total.inflate_skipped, 0);
+    p = template_copy_str(p, last, "},\"log\":{");
+    p = json_uint(p, last, "sent", s->total.log_sent, 1);
+    p = json_uint(p, last, "dropped", s->total.log_dropped, 0);
+    p = template_copy_str(p, last, "}");
+    p = json_direction(p, last, s, 1);
+    p = json_direction(p, last, s, 0);
+    p = json_histogram(p, last, "connection_age", &s->total.conn_age);
+    return template_copy_str(p, last, "}\n");
+}
+
+// Prometheus text exposition format
+
+static u_char *
+prom_family(u_char *p, u_char *last, const char *name, const char *type,
+            const char *help)
+{
+    p = template_copy_str(p, last, "# HELP ");
+    p = template_copy_str(p, last, name);
+    p = template_copy_str(p, last, " ");
+    p = template_copy_str(p, last, help);
+    p = template_copy_str(p, last, "\n# TYPE ");
+    p = template_copy_str(p, last, name);
+    p = template_copy_str(p, last, " ");
+    p = template_copy_str(p, last, type);
+    return template_copy_str(p, last, "\n");
+}
+
+// labels is a NULL terminated list of name and value pairs
+static u_char *
+prom_sample(u_char *p, u_char *last, const char *name, const char **labels,
+            uint64_t value)
+{
+    p = template_copy_str(p, last, name);
+    if (labels && *labels) {
+        p = template_copy_str(p, last, "{");
+        for (; *labels; labels += 2) {
+            p = template_copy_str(p, last, labels[0]);
+            p = template_copy_str(p, last, "=\"");
+            p = escape_str(p, last, labels[1], 0);
+            p = template_copy_str(p, last, labels[2] ? "\"," : "\"");
+        }
+        p = template_copy_str(p, last, "}");
+    }
+    p = template_copy_str(p, last, " ");
+    p = template_uint(p, last, value);
+    return template_copy_str(p, last, "\n");
+}
+
+static u_char *
+prom_summary(u_char *p, u_char *last, const char *name, const char *count_name,
+             const char *direction, ngx_http_websocket_histogram_t *h)
+{
+    const char *labels[5] = {"direction", direction};
+    const char **quantile = direction ? labels + 2 : labels;
+    ngx_uint_t i;
+    quantile[0] = "quantile";
+    quantile[2] = NULL;
+    for (i = 0; i < PERCENTILES; i++) {
+        quantile[1] = quantile_names[i];
+        p = prom_sample(p, last, name, labels,
+                        histogram_percentile(h, percentiles[i]));
+    }
+    quantile[0] = NULL;
+    return prom_sample(p, last, count_name, labels, histogram_count(h));
+}
+
+static u_char *
+render_prometheus(stat_snapshot_t *s, u_char *p, u_char *last)
+{
+    const char *labels[] = {"direction", NULL, "opcode", NULL, NULL};
+    ngx_http_websocket_stat_statistic_t *st;
+    ngx_uint_t i;
+    int dir;
+
+    p = prom_family(p, last, "websocket_connections", "gauge",
+                    "Open websocket connections.");
+    p = prom_sample(p, last, "websocket_connections", NULL, s->connections);
+    p = prom_family(p, last, "websocket_draining_connections", "gauge",
+                    "Connections left to close in workers shutting down.");
+    p = prom_sample(p, last, "websocket_draining_connections", NULL,
+                    s->drain.draining);
+    p = prom_family(p, last, "websocket_drained_connections_total", "counter",
+                    "Connections closed by ws_drain_on_reload.");
+    p = prom_sample(p, last, "websocket_drained_connections_total", NULL,
+                    s->drain.drained);
+
+    p = prom_family(p, last, "websocket_frames_total", "counter",
+                    "Websocket frames.");
+    for (dir = 1; dir >= 0; dir--) {
+        labels[1] = direction_names[dir];
+        for (i = 0; i <= REPORTED_OPCODES; i++) {
+            labels[3] = opcode_name(i);
+            p = prom_sample(p, last, "websocket_frames_total", labels,
+                            snapshot_opcode(s, dir, i)->frames);
+        }
+    }
+    p = prom_family(p, last, "websocket_payload_bytes_total", "counter",
+                    "Websocket payload bytes.");
+    for (dir = 1; dir >= 0; dir--) {
+        labels[1] = direction_names[dir];
+        for (i = 0; i <= REPORTED_OPCODES; i++) {
+            labels[3] = opcode_name(i);
+            p = prom_sample(p, last, "websocket_payload_bytes_total", labels,
+                            snapshot_opcode(s, dir, i)->payload);
+        }
+    }
+    labels[2] = NULL;
+    p = prom_family(p, last, "websocket_tcp_bytes_total", "counter",
+                    "Bytes sent and received on websocket connections.");
+    for (dir = 1; dir >= 0; dir--) {
+        labels[1] = direction_names[dir];
+        st = snapshot_direction(s, dir);
+        p = prom_sample(p, last, "websocket_tcp_bytes_total", labels,
+                        st->total_size);
+    }
+
+    // compression ratio is inflated over sampled bytes
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t offset;
+    } compression[] = {
+        {"websocket_compressed_frames_total",
+         "Frames of permessage-deflate messages.",
+         offsetof(ngx_http_websocket_stat_statistic_t, compressed_frames)},
+        {"websocket_compressed_payload_bytes_total",
+         "Payload bytes of permessage-deflate messages.",
+         offsetof(ngx_http_websocket_stat_statistic_t, compressed_payload)},
+        {"websocket_inflate_sampled_bytes_total",
+         "Compressed payload bytes of connections sampled for inflating.",
+         offsetof(ngx_http_websocket_stat_statistic_t, inflate_in)},
+        {"websocket_inflate_inflated_bytes_total",
+         "Sampled payload bytes after inflating.",
+         offsetof(ngx_http_websocket_stat_statistic_t, inflate_out)}};
+    for (i = 0; i < sizeof(compression) / sizeof(compression[0]); i++) {
+        p = prom_family(p, last, compression[i].name, "counter",
+                        compression[i].help);
+        for (dir = 1; dir >= 0; dir--) {
+            labels[1] = direction_names[dir];
+            st = snapshot_direction(s, dir);
+            p = prom_sample(p, last, compression[i].name, labels,
+                            *(ngx_atomic_t *)((u_char *)st +
+                                              compression[i].offset));
+        }
+    }
+    p = prom_family(p, last, "websocket_deflate_connections_total", "counter",
+                    "Connections that negotiated permessage-deflate.");
+    p = prom_sample(p, last, "websocket_deflate_connections_total", NULL,
+                    s->total.deflate_connections);
+    p = prom_family(p, last, "websocket_inflate_connections_total", "counter",
+                    "Connections sampled for inflating.");
+    p = prom_sample(p, last, "websocket_inflate_connections_total", NULL,
+                    s->total.inflate_connections);
+    p = prom_family(p, last, "websocket_inflate_skipped_total", "counter",
+                    "Sampled connections not inflated for lack of memory.");
+    p = prom_sample(p, last, "websocket_inflate_skipped_total", NULL,
+                    s->total.inflate_skipped);
+    p = prom_family(p, last, "websocket_log_sent_lines_total", "counter",
+                    "Log lines sent to ws_log syslog server.");
+    p = prom_sample(p, last, "websocket_log_sent_lines_total", NULL,
+                    s->total.log_sent);
+    p = prom_family(p, last, "websocket_log_dropped_lines_total", "counter",
+                    "Log lines dropped when the syslog socket was busy or "
+                    "failed.");
+    p = prom_sample(p, last, "websocket_log_dropped_lines_total", NULL,
+                    s->total.log_dropped);
+
+    p = prom_family(p, last, "websocket_frame_payload_size_bytes", "summary",
+                    "Payload size of websocket frames.");
+    for (dir = 1; dir >= 0; dir--) {
+        st = snapshot_direction(s, dir);
+        p = prom_summary(p, last, "websocket_frame_payload_size_bytes",
+                         "websocket_frame_payload_size_bytes_count",
+                         direction_names[dir], &st->payload_sizes);
+    }
+    p = prom_family(p, last, "websocket_connection_age_seconds", "summary",
+                    "Lifetime of closed websocket connections.");
+    return prom_summary(p, last, "websocket_connection_age_seconds",
+                        "websocket_connection_age_seconds_count", NULL,
+                        &s->total.conn_age);
+}
+
+// Zone readout, one row per key
+
+static const char *
+zone_key(ngx_http_websocket_zone_entry_t *entry)
+{
+    return entry->overflow ? "(overflow)" : (const char *)entry->key.data;
+}
+
+static u_char *
+render_zone_text(stat_snapshot_t *s, u_char *p, u_char *last)
+{
+    ngx_http_websocket_zone_entry_t *entry = s->zone_entries->elts;
+    ngx_http_websocket_zone_counters_t *c;
+    ngx_uint_t i;
+    p = template_copy_str(p, last,
+                          "key | connections | opened | closed | client "
+                          "frames | client payload | client tcp data | "
+                          "upstream frames | upstream payload | upstream tcp "
+                          "data\n");
+    for (i = 0; i < s->zone_entries->nelts; i++) {
+        c = &entry[i].counters;
+        uint64_t values[] = {c->connections,
+                             c->opened,
+                             c->closed,
+                             c->frames_in.frames,
+                             c->frames_in.total_payload_size,
+                             c->frames_in.total_size,
+                             c->frames_out.frames,
+                             c->frames_out.total_payload_size,
+                             c->frames_out.total_size};
+        p = text_row(p, last, zone_key(&entry[i]), values, 9);
+    }
+    return p;
+}
+
+static u_char *
+json_zone_traffic(u_char *p, u_char *last, const char *name,
+                  ngx_http_websocket_zone_traffic_t *t)
+{
+    p = template_copy_str(p, last, ",\"");
+    p = template_copy_str(p, last, name);
+    p = template_copy_str(p, last, "\":{");
+    p = json_uint(p, last, "frames", t->frames, 1);
+    p = json_uint(p, last, "payload", t->total_payload_size, 0);
+    p = json_uint(p, last, "tcp", t->total_size, 0);
+    return template_copy_str(p, last, "}");
+}
+
+static u_char *
+json_zone_counters(u_char *p, u_char *last,
+                   ngx_http_websocket_zone_counters_t *c)
+{
+    p = template_copy_str(p, last, "{");
+    p = json_uint(p, last, "connections", c->connections, 1);
+    p = json_uint(p, last, "opened", c->opened, 0);
+    p = json_uint(p, last, "closed", c->closed, 0);
+    p = json_zone_traffic(p, last, "client", &c->frames_in);
+    p = json_zone_traffic(p, last, "upstream", &c->frames_out);
+    return template_copy_str(p, last, "}");
+}
+
+static u_char *
+render_zone_json(stat_snapshot_t *s, u_char *p, u_char *last)
+{
+    ngx_http_websocket_zone_entry_t *entry = s->zone_entries->elts;
+    ngx_uint_t i, n = s->zone_entries->nelts - 1;
+    p = template_copy_str(p, last, "{\"zone\":\"");
+    p = escape_str(p, last, s->zone_name, 1);
+    p = template_copy_str(p, last, "\",\"keys\":{");
+    for (i = 0; i < n; i++) {
+        p = template_copy_str(p, last, i ? ",\"" : "\"");
+        p = escape_str(p, last, (const char *)entry[i].key.data, 1);
+        p = template_copy_str(p, last, "\":");
+        p = json_zone_counters(p, last, &entry[i].counters);
+    }
+    // overflow entry is always the last one
+    p = template_copy_str(p, last, "},\"overflow\":");
+    p = json_zone_counters(p, last, &entry[n].counters);
+    return template_copy_str(p, last, "}\n");
+}
+
+static u_char *
+render_zone_prometheus(stat_snapshot_t *s, u_char *p, u_char *last)
+{
+    ngx_http_websocket_zone_entry_t *entry = s->zone_entries->elts;
+    ngx_http_websocket_zone_traffic_t *t;
+    const char *labels[] = {"zone", s->zone_name, "key", NULL,
+                            "direction", NULL, NULL};
+    ngx_uint_t i;
+    int dir;
+
+    p = prom_family(p, last, "websocket_zone_connections", "gauge",
+                    "Open websocket connections per key.");
+    labels[4] = NULL;
+    for (i = 0; i < s->zone_entries->nelts; i++) {
+        labels[3] = zone_key(&entry[i]);
+        p = prom_sample(p, last, "websocket_zone_connections", labels,
+                        entry[i].counters.connections);
+    }
+    p = prom_family(p, last, "websocket_zone_opened_total", "counter",
+                    "Websocket connections opened per key.");
+    for (i = 0; i < s->zone_entries->nelts; i++) {
+        labels[3] = zone_key(&entry[i]);
+        p = prom_sample(p, last, "websocket_zone_opened_total", labels,
+                        entry[i].counters.opened);
+    }
+    p = prom_family(p, last, "websocket_zone_closed_total", "counter",
+                    "Websocket connections closed per key.");
+    for (i = 0; i < s->zone_entries->nelts; i++) {
+        labels[3] = zone_key(&entry[i]);
+        p = prom_sample(p, last, "websocket_zone_closed_total", labels,
+                        entry[i].counters.closed);
+    }
+    labels[4] = "direction";
+
+    p = prom_family(p, last, "websocket_zone_frames_total", "counter",
+                    "Websocket frames per key.");
+    for (i = 0; i < s->zone_entries->nelts; i++) {
+        labels[3] = zone_key(&entry[i]);
+        for (dir = 1; dir >= 0; dir--) {
+            labels[5] = direction_names[dir];
+            t = dir ? &entry[i].counters.frames_in
+                    : &entry[i].counters.frames_out;
+            p = prom_sample(p, last, "websocket_zone_frames_total", labels,
+                            t->frames);
+        }
+    }
+    p = prom_family(p, last, "websocket_zone_payload_bytes_total", "counter",
+                    "Websocket payload bytes per key.");
+    for (i = 0; i < s->zone_entries->nelts; i++) {
+        labels[3] = zone_key(&entry[i]);
+        for (dir = 1; dir >= 0; dir--) {
+            labels[5] = direction_names[dir];
+            t = dir ? &entry[i].counters.frames_in
+                    : &entry[i].counters.frames_out;
+            p = prom_sample(p, last, "websocket_zone_payload_bytes_total",
+                            labels, t->total_payload_size);
+        }
+    }
+    p = prom_family(p, last, "websocket_zone_tcp_bytes_total", "counter",
+                    "Bytes sent and received per key.");
+    for (i = 0; i < s->zone_entries->nelts; i++) {
+        labels[3] = zone_key(&entry[i]);
+        for (dir = 1; dir >= 0; dir--) {
+            labels[5] = direction_names[dir];
+            t = dir ? &entry[i].counters.frames_in
+                    : &entry[i].counters.frames_out;
+            p = prom_sample(p, last, "websocket_zone_tcp_bytes_total", labels,
+                            t->total_size);
+        }
+    }
+    return p;
+}
+
+static const char *
+conn_field(const char *value)
+{
+    return *value ? value : "-";
+}
+
+static u_char *
+render_connections_text(stat_snapshot_t *s, u_char *p, u_char *last)
+{
+    stat_connection_t *conn = s->conn_entries->elts;
+    ngx_uint_t i;
+    p = template_copy_str(p, last,
+                          "id | remote addr | uri | upstream addr | age | "
+                          "client frames | client tcp data | upstream "
+                          "frames | upstream tcp data\n");
+    for (i = 0; i < s->conn_entries->nelts; i++) {
+        uint64_t values[] = {conn[i].age, conn[i].traffic[1].frames,
+                             conn[i].traffic[1].bytes,
+                             conn[i].traffic[0].frames,
+                             conn[i].traffic[0].bytes};
+        p = template_copy_str(p, last, conn_field(conn[i].id));
+        p = template_copy_str(p, last, " ");
+        p = template_copy_str(p, last, conn_field(conn[i].addr));
+        p = template_copy_str(p, last, " ");
+        p = template_copy_str(p, last, conn_field(conn[i].uri));
+        p = template_copy_str(p, last, " ");
+        p = text_row(p, last, conn_field(conn[i].upstream), values, 5);
+    }
+    return p;
+}
+
+static u_char *
+json_str(u_char *p, u_char *last, const char *name, const char *value,
+         int first)
+{
+    p = template_copy_str(p, last, first ? "\"" : ",\"");
+    p = template_copy_str(p, last, name);
+    p = template_copy_str(p, last, "\":\"");
+    p = escape_str(p, last, value, 1);
+    return template_copy_str(p, last, "\"");
+}
+
+static u_char *
+render_connections_json(stat_snapshot_t *s, u_char *p, u_char *last)
+{
+    stat_connection_t *conn = s->conn_entries->elts;
+    ngx_uint_t i;
+    int dir;
+    p = template_copy_str(p, last, "{\"order\":\"");
+    p = template_copy_str(p, last, s->conn_order);
+    p = template_copy_str(p, last, "\",\"connections\":[");
+    for (i = 0; i < s->conn_entries->nelts; i++) {
+        p = template_copy_str(p, last, i ? ",{" : "{");
+        p = json_str(p, last, "id", conn[i].id, 1);
+        p = json_str(p, last, "remote_addr", conn[i].addr, 0);
+        p = json_str(p, last, "uri", conn[i].uri, 0);
+        p = json_str(p, last, "upstream_addr", conn[i].upstream, 0);
+        p = json_uint(p, last, "age", conn[i].age, 0);
+        for (dir = 1; dir >= 0; dir--) {
+            p = template_copy_str(p, last, ",\"");
+            p = template_copy_str(p, last, direction_names[dir]);
+            p = template_copy_str(p, last, "\":{");
+            p = json_uint(p, last, "frames", conn[i].traffic[dir].frames, 1);
+            p = json_uint(p, last, "tcp", conn[i].traffic[dir].bytes, 0);
+            p = template_copy_str(p, last, "}");
+        }
+        p = template_copy_str(p, last, "}");
+    }
+    return template_copy_str(p, last, "]}\n");
+}
+
+static u_char *
+render_connections_prometheus(stat_snapshot_t *s, u_char *p, u_char *last)
+{
+    stat_connection_t *conn = s->conn_entries->elts;
+    const char *labels[] = {"id",           NULL, "remote_addr", NULL,
+                            "uri",          NULL, "upstream_addr", NULL,
+                            "direction",    NULL, NULL};
+    ngx_uint_t i;
+    int dir;
+
+#define CONN_LABELS(c)                                                         \
+    labels[1] = (c)->id;                                                       \
+    labels[3] = (c)->addr;                                                     \
+    labels[5] = (c)->uri;                                                      \
+    labels[7] = (c)->upstream
+
+    p = prom_family(p, last, "websocket_connection_open_seconds", "gauge",
+                    "Seconds the listed websocket connections are open.");
+    labels[8] = NULL;
+    for (i = 0; i < s->conn_entries->nelts; i++) {
+        CONN_LABELS(&conn[i]);
+        p = prom_sample(p, last, "websocket_connection_open_seconds", labels,
+                        conn[i].age);
+    }
+    labels[8] = "direction";
+    p = prom_family(p, last, "websocket_connection_frames_total", "counter",
+                    "Frames of the listed websocket connections.");
+    for (i = 0; i < s->conn_entries->nelts; i++) {
+        CONN_LABELS(&conn[i]);
+        for (dir = 1; dir >= 0; dir--) {
+            labels[9] = direction_names[dir];
+            p = prom_sample(p, last, "websocket_connection_frames_total",
+                            labels, conn[i].traffic[dir].frames);
+        }
+    }
+    p = prom_family(p, last, "websocket_connection_tcp_bytes_total",
+                    "counter", "Bytes of the listed websocket connections.");
+    for (i = 0; i < s->conn_entries->nelts; i++) {
+        CONN_LABELS(&conn[i]);
+        for (dir = 1; dir >= 0; dir--) {
+            labels[9] = direction_names[dir];
+            p = prom_sample(p, last, "websocket_connection_tcp_bytes_total",
+                            labels, conn[i].traffic[dir].bytes);
+        }
+    }
+#undef CONN_LABELS
+    return p;
+}
+
+typedef struct {
+    ngx_str_t name;
+    ngx_str_t content_type;
+    stat_render_pt render;
+    stat_render_pt render_zone;
+    stat_render_pt render_connections;
+} stat_format_t;
+
+// Indexed by WS_STAT_FORMAT_*
+static stat_format_t stat_formats[] = {
+    {ngx_string("text"), ngx_string("text/plain"), render_text,
+     render_zone_text, render_connections_text},
+    {ngx_string("json"), ngx_string("application/json"), render_json,
+     render_zone_json, render_connections_json},
+    {ngx_string("prometheus"), ngx_string("text/plain; version=0.0.4"),
+     render_prometheus, render_zone_prometheus,
+     render_connections_prometheus},
+    {ngx_null_string, ngx_null_string, NULL, NULL, NULL}};
+
+static ngx_int_t
+find_stat_format(ngx_str_t *name)
+{
+    ngx_uint_t i;
+    for (i = 0; stat_formats[i].render; i++) {
+        if (stat_formats[i].name.len == name->len &&
+            ngx_strncmp(stat_formats[i].name.data, name->data, name->len) ==
+                0) {
+            return i;
+        }
+    }
+    return NGX_ERROR;
+}
+
+// ?format= wins over the Accept header, which wins over ws_stat format=.
+static ngx_int_t
+choose_stat_format(ngx_http_request_t *r)
+{
+    ngx_http_websocket_loc_conf_t *lcf;
+    ngx_str_t arg;
+    if (ngx_http_arg(r, (u_char *)"format", sizeof("format") - 1, &arg) ==
+        NGX_OK) {
+        return find_stat_format(&arg);
+    }
+#if (NGX_HTTP_HEADERS)
+    ngx_table_elt_t *accept = r->headers_in.accept;
+    if (accept) {
+        if (ngx_strlcasestrn(accept->value.data,
+                             accept->value.data + accept->value.len,
+                             (u_char *)"application/json",
+                             sizeof("application/json") - 2)) {
+            return WS_STAT_FORMAT_JSON;
+        }
+        if (ngx_strlcasestrn(accept->value.data,
+                             accept->value.data + accept->value.len,
+                             (u_char *)"version=0.0.4",
+                             sizeof("version=0.0.4") - 2) ||
+            ngx_strlcasestrn(accept->value.data,
+                             accept->value.data + accept->value.len,
+                             (u_char *)"openmetrics",
+                             sizeof("openmetrics") - 2)) {
+            return WS_STAT_FORMAT_PROMETHEUS;
+        }
+    }
+#endif
+    lcf = ngx_http_get_module_loc_conf(r, ngx_http_websocket_stat_module);
+    return lcf->format;
 }
 
-/**
- * Configuration setup function that installs the content handler.
- *
- * @param cf
- *   Module configuration structure pointer.
- * @param cmd
- *   Module directives structure pointer.
- * @param conf
- *   Module configuration structure pointer.
- * @return string
- *   Status of the configuration setup.
- */
 static char *
-ngx_http_websocket_stat(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+registry_str(ngx_pool_t *pool, u_char *data, size_t len)
 {
-    ngx_http_core_loc_conf_t *clcf; /* pointer to core location configuration */
+    u_char *str = ngx_pnalloc(pool, len + 1);
+    if (str) {
+        *ngx_cpymem(str, data, len) = '\0';
+    }
+    return (char *)str;
+}
 
-    /* Install the hello world handler. */
-    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
-    clcf->handler = ngx_http_websocket_stat_handler;
+#define WS_STAT_TOP_DEFAULT 10
+#define WS_STAT_TOP_MAX 1000
+
+// ?top=N&order=bytes|frames|age picks the connections listed.
+static ngx_int_t
+take_connections(ngx_http_request_t *r, stat_snapshot_t *snapshot)
+{
+    static const char *orders[] = {"bytes", "frames", "age", NULL};
+    ngx_http_websocket_main_conf_t *conf;
+    ngx_http_websocket_registry_slot_t *slot;
+    stat_connection_t *conn;
+    ngx_array_t *slots;
+    ngx_int_t top = WS_STAT_TOP_DEFAULT;
+    ngx_uint_t i, order = WS_REGISTRY_BY_BYTES;
+    ngx_str_t arg;
+
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    if (conf->registry == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "ws_stat connections needs ws_stat_registry");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    if (ngx_http_arg(r, (u_char *)"top", sizeof("top") - 1, &arg) == NGX_OK) {
+        top = ngx_atoi(arg.data, arg.len);
+        if (top == NGX_ERROR) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+        top = ngx_min(top, WS_STAT_TOP_MAX);
+    }
+    if (ngx_http_arg(r, (u_char *)"order", sizeof("order") - 1, &arg) ==
+        NGX_OK) {
+        for (order = 0; orders[order]; order++) {
+            if (ngx_strlen(orders[order]) == arg.len &&
+                ngx_strncmp(orders[order], arg.data, arg.len) == 0) {
+                break;
+            }
+        }
+        if (orders[order] == NULL) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+    snapshot->conn_order = orders[order];
+
+    slots = ws_registry_top(conf->registry, r->pool, order, top);
+    if (slots == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    snapshot->conn_entries = ngx_array_create(
+        r->pool, slots->nelts ? slots->nelts : 1, sizeof(stat_connection_t));
+    if (snapshot->conn_entries == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    slot = slots->elts;
+    for (i = 0; i < slots->nelts; i++) {
+        conn = ngx_array_push(snapshot->conn_entries);
+        if (conn == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        conn->id = registry_str(r->pool, slot[i].id, slot[i].id_len);
+        conn->addr = registry_str(r->pool, slot[i].addr, slot[i].addr_len);
+        conn->uri = registry_str(r->pool, slot[i].uri, slot[i].uri_len);
+        conn->upstream =
+            registry_str(r->pool, slot[i].upstream, slot[i].upstream_len);
+        if (!conn->id || !conn->addr || !conn->uri || !conn->upstream) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        conn->age = ngx_time() - slot[i].start;
+        ngx_memcpy(conn->traffic, slot[i].traffic, sizeof(conn->traffic));
+    }
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_websocket_stat_handler(ngx_http_request_t *r)
+{
+    ngx_buf_t *b;
+    ngx_chain_t out;
+    ngx_http_websocket_loc_conf_t *lcf;
+    ngx_int_t format, rc;
+    stat_snapshot_t *snapshot;
+    stat_render_pt render;
+    u_char probe;
+
+    format = choose_stat_format(r);
+    if (format == NGX_ERROR) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    snapshot = ngx_pcalloc(r->pool, sizeof(stat_snapshot_t));
+    if (snapshot == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    lcf = ngx_http_get_module_loc_conf(r, ngx_http_websocket_stat_module);
+    if (lcf->connections) {
+        rc = take_connections(r, snapshot);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+        render = stat_formats[format].render_connections;
+    } else if (lcf->zone) {
+        ngx_str_t *name = &lcf->zone->shm.name;
+        u_char *zone_name = ngx_pnalloc(r->pool, name->len + 1);
+        if (zone_name == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        *ngx_cpymem(zone_name, name->data, name->len) = '\0';
+        snapshot->zone_name = (const char *)zone_name;
+        snapshot->zone_entries = ws_zone_snapshot(lcf->zone->data, r->pool);
+        if (snapshot->zone_entries == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        render = stat_formats[format].render_zone;
+    } else {
+        take_snapshot(snapshot);
+        render = stat_formats[format].render;
+    }
+
+    // measure first, then render into a buffer of the exact size
+    size_t len = render(snapshot, &probe, &probe) - &probe;
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    b->last = render(snapshot, b->pos, b->end);
+    b->last_buf = 1;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    r->headers_out.content_type = stat_formats[format].content_type;
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = len;
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+/**
+ * Configuration setup function that installs the content handler.
+ *
+ * @param cf
+ *   Module configuration structure pointer.
+ * @param cmd
+ *   Module directives structure pointer.
+ * @param conf
+ *   Module configuration structure pointer.
+ * @return string
+ *   Status of the configuration setup.
+ */
+static char *
+ngx_http_websocket_stat(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t *clcf; /* pointer to core location configuration */
+    ngx_http_websocket_loc_conf_t *lcf = conf;
+    ngx_http_websocket_main_conf_t *main_conf;
+    ngx_shm_zone_t **zonep;
+    ngx_str_t *value, name;
+
+    value = cf->args->elts;
+    for (ngx_uint_t i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "format=", 7) == 0) {
+            name.data = value[i].data + 7;
+            name.len = value[i].len - 7;
+            ngx_int_t format = find_stat_format(&name);
+            if (format == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "unknown ws_stat format \"%V\"", &name);
+                return NGX_CONF_ERROR;
+            }
+            lcf->format = format;
+            continue;
+        }
+        if (ngx_strcmp(value[i].data, "connections") == 0) {
+            lcf->connections = 1;
+            continue;
+        }
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            name.data = value[i].data + 5;
+            name.len = value[i].len - 5;
+            // zone size comes from ws_stat_zone, unknown names fail at start
+            lcf->zone = ngx_shared_memory_add(cf, &name, 0,
+                                              &ngx_http_websocket_stat_module);
+            if (lcf->zone == NULL) {
+                return NGX_CONF_ERROR;
+            }
+            main_conf = ngx_http_conf_get_module_main_conf(
+                cf, ngx_http_websocket_stat_module);
+            if (main_conf->stat_zones == NULL) {
+                main_conf->stat_zones =
+                    ngx_array_create(cf->pool, 2, sizeof(ngx_shm_zone_t *));
+                if (main_conf->stat_zones == NULL) {
+                    return NGX_CONF_ERROR;
+                }
+            }
+            zonep = ngx_array_push(main_conf->stat_zones);
+            if (zonep == NULL) {
+                return NGX_CONF_ERROR;
+            }
+            *zonep = lcf->zone;
+            continue;
+        }
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* Install the hello world handler. */
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_websocket_stat_handler;
+
+    return NGX_CONF_OK;
+} /* ngx_http_hello_world */
+
+static char *
+ngx_http_websocket_max_conn_setup(ngx_conf_t *cf, ngx_command_t *cmd,
+                                  void *conf)
+{
+    ngx_str_t *value;
+    value = cf->args->elts;
+    ngx_http_websocket_main_conf_t *main_conf = conf;
+    main_conf->max_ws_connections = atoi((char *)value[1].data);
+    return NGX_CONF_OK;
+}
+static char *
+ngx_http_websocket_max_conn_age(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t *value, s;
+    value = cf->args->elts;
+    ngx_int_t timeout, n;
+    ngx_uint_t i;
+    timeout = ngx_parse_time(&value[1], 1);
+    if (timeout == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+    ngx_http_websocket_main_conf_t *main_conf = conf;
+    main_conf->max_ws_age = timeout;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "jitter=", 7) == 0) {
+            s.data = value[i].data + 7;
+            s.len = value[i].len - 7;
+            n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR || n > timeout * 1000) {
+                goto invalid;
+            }
+            main_conf->age_jitter = n;
+            continue;
+        }
+        if (ngx_strncmp(value[i].data, "rate=", 5) == 0) {
+            n = ngx_atoi(value[i].data + 5, value[i].len - 5);
+            if (n <= 0) {
+                goto invalid;
+            }
+            main_conf->age_close_rate = n;
+            continue;
+        }
+        goto invalid;
+    }
+    return NGX_CONF_OK;
+
+invalid:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                       &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+static char *
+ngx_http_ws_logfile(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t *value, s;
+    ngx_uint_t i;
+    ssize_t size = 0;
+    ngx_msec_t flush = 0;
+    ngx_uint_t binary = 0, syslog;
+    ssize_t datagram = 0;
+
+    value = cf->args->elts;
+    syslog = ngx_strncmp(value[1].data, "syslog:", 7) == 0;
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "buffer=", 7) == 0) {
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR || size == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid buffer size \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+        if (ngx_strncmp(value[i].data, "flush=", 6) == 0) {
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+            flush = ngx_parse_time(&s, 0);
+            if (flush == (ngx_msec_t)NGX_ERROR || flush == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid flush time \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+        if (syslog && ngx_strncmp(value[i].data, "datagram=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+            datagram = ngx_parse_size(&s);
+            if (datagram == NGX_ERROR || datagram > 65507) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid datagram size \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+        if (ngx_strcmp(value[i].data, "format=text") == 0) {
+            binary = 0;
+            continue;
+        }
+        if (ngx_strcmp(value[i].data, "format=binary") == 0) {
+            binary = 1;
+            continue;
+        }
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    ws_log = ngx_pcalloc(cf->pool, sizeof(ngx_http_websocket_log_t));
+    if (ws_log == NULL)
+        return NGX_CONF_ERROR;
+    if (syslog) {
+        if (binary) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "binary log cannot be sent to syslog");
+            return NGX_CONF_ERROR;
+        }
+        ws_log->syslog = ws_syslog_create(
+            cf, size ? size : 64 * 1024,
+            datagram ? datagram : WS_SYSLOG_DATAGRAM,
+            flush ? flush : WS_SYSLOG_FLUSH);
+        return ws_log->syslog ? NGX_CONF_OK : NGX_CONF_ERROR;
+    }
+    ws_log->file = ngx_conf_open_file(cf->cycle, &value[1]);
+    if (!ws_log->file)
+        return NGX_CONF_ERROR;
+
+    // binary records are only ever written through the buffer
+    if ((flush || binary) && size == 0) {
+        size = 64 * 1024;
+    }
+    if (binary && size < WS_BINLOG_HEADER_SIZE + WS_BINLOG_RECORD_SIZE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "buffer is too small for binary log");
+        return NGX_CONF_ERROR;
+    }
+    ws_log->binary = binary;
+    if (size && ws_log_set_buffer(cf, ws_log, size, flush) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+// Parses "1/N" and returns N.
+static ngx_int_t
+parse_sample_rate(u_char *data, size_t len)
+{
+    if (len < 3 || data[0] != '1' || data[1] != '/') {
+        return NGX_ERROR;
+    }
+    ngx_int_t rate = ngx_atoi(data + 2, len - 2);
+    return rate > 0 ? rate : NGX_ERROR;
+}
+
+static char *
+ngx_http_ws_log_sample(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_websocket_main_conf_t *main_conf = conf;
+    ngx_str_t *value;
+    ngx_uint_t i;
+    ngx_int_t rate;
+
+    value = cf->args->elts;
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "frame=", 6) == 0) {
+            rate = parse_sample_rate(value[i].data + 6, value[i].len - 6);
+            if (rate == NGX_ERROR) {
+                goto invalid;
+            }
+            main_conf->sample_frame = rate;
+            continue;
+        }
+        if (ngx_strncmp(value[i].data, "connection=", 11) == 0) {
+            rate = parse_sample_rate(value[i].data + 11, value[i].len - 11);
+            if (rate == NGX_ERROR) {
+                goto invalid;
+            }
+            main_conf->sample_connection = rate;
+            continue;
+        }
+        if (ngx_strcmp(value[i].data, "events=all") == 0) {
+            main_conf->sample_events = WS_SAMPLE_EVENTS_ALL;
+            continue;
+        }
+        if (ngx_strcmp(value[i].data, "events=sampled") == 0) {
+            main_conf->sample_events = WS_SAMPLE_EVENTS_SAMPLED;
+            continue;
+        }
+        goto invalid;
+    }
+    return NGX_CONF_OK;
+
+invalid:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                       &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+static char *
+ngx_http_ws_inflate_sample(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_websocket_main_conf_t *main_conf = conf;
+    ngx_str_t *value = cf->args->elts, s;
+    ngx_int_t rate;
+    ssize_t size;
+    ngx_uint_t i = 1;
+
+    rate = parse_sample_rate(value[1].data, value[1].len);
+    if (rate == NGX_ERROR) {
+        goto invalid;
+    }
+    main_conf->inflate_sample = rate;
+    main_conf->inflate_memory = WS_INFLATE_MEMORY;
+    if (cf->args->nelts == 3) {
+        i = 2;
+        if (ngx_strncmp(value[2].data, "memory=", 7) != 0) {
+            goto invalid;
+        }
+        s.data = value[2].data + 7;
+        s.len = value[2].len - 7;
+        size = ngx_parse_size(&s);
+        if (size <= 0) {
+            goto invalid;
+        }
+        main_conf->inflate_memory = size;
+    }
+    return NGX_CONF_OK;
+
+invalid:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                       &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+// Parses "name:size" of a shared zone.
+static ngx_int_t
+parse_zone_size(ngx_conf_t *cf, ngx_str_t *value, ngx_str_t *name,
+                ssize_t *size)
+{
+    ngx_str_t s;
+    u_char *p = (u_char *)ngx_strchr(value->data, ':');
+    if (p == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone \"%V\", expected name:size", value);
+        return NGX_ERROR;
+    }
+    name->data = value->data;
+    name->len = p - value->data;
+    s.data = p + 1;
+    s.len = value->data + value->len - s.data;
+    *size = ngx_parse_size(&s);
+    if (name->len == 0 || *size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone \"%V\"",
+                           value);
+        return NGX_ERROR;
+    }
+    if (*size < (ssize_t)(8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too small",
+                           value);
+        return NGX_ERROR;
+    }
+    return NGX_OK;
+}
+
+static ngx_int_t
+compile_key(ngx_conf_t *cf, ngx_str_t *value, ngx_http_complex_value_t *key)
+{
+    ngx_http_compile_complex_value_t ccv;
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    ccv.cf = cf;
+    ccv.value = value;
+    ccv.complex_value = key;
+    return ngx_http_compile_complex_value(&ccv);
+}
+
+static char *
+ngx_http_ws_stat_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_websocket_main_conf_t *main_conf = conf;
+    ngx_http_websocket_zone_t *zone, **zonep;
+    ngx_str_t *value, name, s;
+    ngx_int_t max;
+    ssize_t size;
+    ngx_uint_t i;
+
+    value = cf->args->elts;
+    zone = ngx_pcalloc(cf->pool, sizeof(ngx_http_websocket_zone_t));
+    if (zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    if (parse_zone_size(cf, &value[1], &name, &size) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "key=", 4) == 0) {
+            s.data = value[i].data + 4;
+            s.len = value[i].len - 4;
+            if (compile_key(cf, &s, &zone->key) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+        if (ngx_strcmp(value[i].data, "upstream") == 0) {
+            zone->upstream = 1;
+            continue;
+        }
+        if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+            max = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (max <= 0) {
+                goto invalid;
+            }
+            zone->max = max;
+            continue;
+        }
+        goto invalid;
+    }
+    if ((zone->key.value.data == NULL) == !zone->upstream) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "ws_stat_zone \"%V\" needs either key= or upstream",
+                           &name);
+        return NGX_CONF_ERROR;
+    }
+
+    zone->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                           &ngx_http_websocket_stat_module);
+    if (zone->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    if (zone->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate ws_stat_zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+    zone->shm_zone->init = ws_zone_init;
+    zone->shm_zone->data = zone;
+
+    if (main_conf->zones == NULL) {
+        main_conf->zones =
+            ngx_array_create(cf->pool, 2, sizeof(ngx_http_websocket_zone_t *));
+        if (main_conf->zones == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+    zonep = ngx_array_push(main_conf->zones);
+    if (zonep == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    *zonep = zone;
+    return NGX_CONF_OK;
+
+invalid:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                       &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+static char *
+ngx_http_ws_limit_conn(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_websocket_main_conf_t *main_conf = conf;
+    ngx_http_websocket_limit_t *limit, **limitp;
+    ngx_str_t *value, name, s;
+    ngx_int_t max;
+    ssize_t size;
+    ngx_uint_t i;
+
+    value = cf->args->elts;
+    limit = ngx_pcalloc(cf->pool, sizeof(ngx_http_websocket_limit_t));
+    if (limit == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    if (parse_zone_size(cf, &value[1], &name, &size) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "key=", 4) == 0) {
+            s.data = value[i].data + 4;
+            s.len = value[i].len - 4;
+            if (compile_key(cf, &s, &limit->key) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+        if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+            max = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (max <= 0) {
+                goto invalid;
+            }
+            limit->max = max;
+            continue;
+        }
+        goto invalid;
+    }
+    if (limit->key.value.data == NULL || limit->max == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "ws_limit_conn \"%V\" needs key= and max=", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    limit->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                            &ngx_http_websocket_stat_module);
+    if (limit->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    if (limit->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"",
+                           &name);
+        return NGX_CONF_ERROR;
+    }
+    limit->shm_zone->init = ws_limit_init;
+    limit->shm_zone->data = limit;
+
+    if (main_conf->limits == NULL) {
+        main_conf->limits = ngx_array_create(
+            cf->pool, 2, sizeof(ngx_http_websocket_limit_t *));
+        if (main_conf->limits == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+    limitp = ngx_array_push(main_conf->limits);
+    if (limitp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    *limitp = limit;
+    return NGX_CONF_OK;
+
+invalid:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                       &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+static char *
+ngx_http_ws_limit_rate(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_websocket_main_conf_t *main_conf = conf;
+    ngx_http_websocket_rate_t *rate, **ratep;
+    ngx_str_t *value, name, s;
+    ngx_int_t n, scale;
+    ssize_t size;
+    ngx_uint_t i;
+
+    value = cf->args->elts;
+    rate = ngx_pcalloc(cf->pool, sizeof(ngx_http_websocket_rate_t));
+    if (rate == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    if (parse_zone_size(cf, &value[1], &name, &size) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "key=", 4) == 0) {
+            s.data = value[i].data + 4;
+            s.len = value[i].len - 4;
+            if (compile_key(cf, &s, &rate->key) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+        if (ngx_strncmp(value[i].data, "rate=", 5) == 0) {
+            // like limit_req: "r/s" or "r/m"
+            s.data = value[i].data + 5;
+            s.len = value[i].len - 5;
+            scale = 1;
+            if (s.len > 3 &&
+                ngx_strncmp(s.data + s.len - 3, "r/s", 3) == 0) {
+                s.len -= 3;
+            } else if (s.len > 3 &&
+                       ngx_strncmp(s.data + s.len - 3, "r/m", 3) == 0) {
+                s.len -= 3;
+                scale = 60;
+            }
+            n = ngx_atoi(s.data, s.len);
+            if (n <= 0) {
+                goto invalid;
+            }
+            rate->rate = n * 1000 / scale;
+            if (rate->rate == 0) {
+                goto invalid;
+            }
+            continue;
+        }
+        if (ngx_strncmp(value[i].data, "burst=", 6) == 0) {
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (n < 0) {
+                goto invalid;
+            }
+            rate->burst = n * 1000;
+            continue;
+        }
+        if (ngx_strcmp(value[i].data, "nodelay") == 0) {
+            rate->nodelay = 1;
+            continue;
+        }
+        goto invalid;
+    }
+    if (rate->rate == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "ws_limit_rate \"%V\" needs rate=", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    rate->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                           &ngx_http_websocket_stat_module);
+    if (rate->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    if (rate->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"",
+                           &name);
+        return NGX_CONF_ERROR;
+    }
+    rate->shm_zone->init = ws_rate_init;
+    rate->shm_zone->data = rate;
+
+    if (main_conf->rates == NULL) {
+        main_conf->rates =
+            ngx_array_create(cf->pool, 2, sizeof(ngx_http_websocket_rate_t *));
+        if (main_conf->rates == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+    ratep = ngx_array_push(main_conf->rates);
+    if (ratep == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    *ratep = rate;
+    return NGX_CONF_OK;
+
+invalid:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                       &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+static char *
+ngx_http_ws_limit_traffic(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_websocket_main_conf_t *main_conf = conf;
+    ngx_str_t *value = cf->args->elts, s;
+    ngx_uint_t i, from_client, *limit;
+    ssize_t n;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        s = value[i];
+        if (ngx_strncmp(s.data, "client", 6) == 0) {
+            from_client = 1;
+            s.data += 6;
+            s.len -= 6;
+        } else if (ngx_strncmp(s.data, "upstream", 8) == 0) {
+            from_client = 0;
+            s.data += 8;
+            s.len -= 8;
+        } else {
+            goto invalid;
+        }
+        if (s.len > 8 && ngx_strncmp(s.data, "_frames=", 8) == 0) {
+            limit = &main_conf->traffic_frames[from_client];
+            s.data += 8;
+            s.len -= 8;
+            n = ngx_atoi(s.data, s.len);
+        } else if (s.len > 1 && s.data[0] == '=') {
+            limit = &main_conf->traffic_bytes[from_client];
+            s.data++;
+            s.len--;
+            n = ngx_parse_size(&s);
+        } else {
+            goto invalid;
+        }
+        if (n <= 0) {
+            goto invalid;
+        }
+        *limit = n;
+    }
+    return NGX_CONF_OK;
+
+invalid:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                       &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+static ngx_int_t
+ws_drain_zone_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_websocket_main_conf_t *main_conf = shm_zone->data;
+
+    // a new zone is zeroed, a reused one keeps counting
+    main_conf->drain_sh = (ngx_http_websocket_drain_sh_t *)shm_zone->shm.addr;
+    return NGX_OK;
+}
+
+static char *
+ngx_http_ws_drain_on_reload(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_websocket_main_conf_t *main_conf = conf;
+    ngx_str_t *value = cf->args->elts, s;
+    ngx_str_t name = ngx_string("ws_drain_on_reload");
+    ngx_shm_zone_t *shm_zone;
+    ngx_uint_t i;
+    ngx_int_t n;
+
+    // every server with the directive gets the same zone
+    shm_zone = ngx_shared_memory_add(cf, &name, ngx_pagesize,
+                                     &ngx_http_websocket_stat_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    shm_zone->init = ws_drain_zone_init;
+    shm_zone->data = main_conf;
+    shm_zone->noslab = 1;
+
+    main_conf->drain = 1;
+    main_conf->drain_window = WS_DRAIN_WINDOW;
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "window=", 7) == 0) {
+            s.data = value[i].data + 7;
+            s.len = value[i].len - 7;
+            n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR) {
+                goto invalid;
+            }
+            main_conf->drain_window = n;
+            continue;
+        }
+        if (ngx_strncmp(value[i].data, "rate=", 5) == 0) {
+            n = ngx_atoi(value[i].data + 5, value[i].len - 5);
+            if (n <= 0) {
+                goto invalid;
+            }
+            main_conf->drain_rate = n;
+            continue;
+        }
+        goto invalid;
+    }
+    return NGX_CONF_OK;
+
+invalid:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                       &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+static char *
+ngx_http_ws_ping(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_websocket_main_conf_t *main_conf = conf;
+    ngx_str_t *value = cf->args->elts;
+    ngx_int_t n;
+
+    n = ngx_parse_time(&value[1], 0);
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid interval \"%V\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+    main_conf->ping_interval = n;
+    main_conf->ping_misses = 3;
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "misses=", 7) != 0) {
+            goto invalid;
+        }
+        n = ngx_atoi(value[2].data + 7, value[2].len - 7);
+        if (n <= 0) {
+            goto invalid;
+        }
+        main_conf->ping_misses = n;
+    }
+    return NGX_CONF_OK;
+
+invalid:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                       &value[2]);
+    return NGX_CONF_ERROR;
+}
+
+static char *
+ngx_http_ws_tap(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_websocket_main_conf_t *main_conf = conf;
+    ngx_str_t *value = cf->args->elts;
+    ngx_int_t n = WS_TAP_RECORDS;
+
+    if (main_conf->tap_path.len) {
+        return "is duplicate";
+    }
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "records=", 8) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+        n = ngx_atoi(value[2].data + 8, value[2].len - 8);
+        if (n <= 0 || n > 1 << 24) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid number of records \"%V\"",
+                               &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+    // positions in a ring are taken with a mask
+    main_conf->tap_records = 1;
+    while (main_conf->tap_records < (ngx_uint_t)n) {
+        main_conf->tap_records <<= 1;
+    }
+    main_conf->tap_path = value[1];
+    if (ngx_conf_full_name(cf->cycle, &main_conf->tap_path, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_ws_stat_registry(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_websocket_main_conf_t *main_conf = conf;
+    ngx_str_t *value = cf->args->elts;
+    ngx_str_t name = ngx_string("ws_stat_registry");
+    ngx_http_websocket_registry_t *registry;
+    ngx_int_t n;
+
+    if (main_conf->registry) {
+        return "is duplicate";
+    }
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n <= 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of connections \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+    registry = ngx_pcalloc(cf->pool, sizeof(ngx_http_websocket_registry_t));
+    if (registry == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    registry->nslots = n;
+    registry->shm_zone =
+        ngx_shared_memory_add(cf, &name, ngx_align(ws_registry_size(n),
+                                                   ngx_pagesize),
+                              &ngx_http_websocket_stat_module);
+    if (registry->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    registry->shm_zone->init = ws_registry_init;
+    registry->shm_zone->data = registry;
+    registry->shm_zone->noslab = 1;
+    main_conf->registry = registry;
+    return NGX_CONF_OK;
+}
+
+// POST ?id=&remote=&upstream=&uri= marks connections matching all given
+// arguments. Their workers close them within a second.
+static ngx_int_t
+ngx_http_ws_admin_close_handler(ngx_http_request_t *r)
+{
+    static struct {
+        const char *name;
+        size_t offset;
+    } args[] = {
+        {"id", offsetof(ngx_http_websocket_registry_selector_t, id)},
+        {"remote", offsetof(ngx_http_websocket_registry_selector_t, addr)},
+        {"uri", offsetof(ngx_http_websocket_registry_selector_t, uri)},
+        {"upstream",
+         offsetof(ngx_http_websocket_registry_selector_t, upstream)}};
+    ngx_http_websocket_main_conf_t *conf;
+    ngx_http_websocket_registry_selector_t selector;
+    ngx_str_t *value;
+    ngx_uint_t i, given = 0, marked;
+    ngx_int_t rc;
+    ngx_buf_t *b;
+    ngx_chain_t out;
+
+    if (!(r->method & (NGX_HTTP_POST | NGX_HTTP_DELETE))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    if (conf->registry == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "ws_admin_close needs ws_stat_registry");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ngx_memzero(&selector, sizeof(selector));
+    for (i = 0; i < sizeof(args) / sizeof(args[0]); i++) {
+        value = (ngx_str_t *)((u_char *)&selector + args[i].offset);
+        if (ngx_http_arg(r, (u_char *)args[i].name,
+                         ngx_strlen(args[i].name), value) == NGX_OK &&
+            value->len) {
+            given++;
+        }
+    }
+    // never close everything by accident
+    if (!given) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+    marked = ws_registry_mark(conf->registry, &selector);
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "%ui websocket connections marked for closing", marked);
+
+    b = ngx_create_temp_buf(r->pool, NGX_INT_T_LEN + 1);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    b->last = ngx_sprintf(b->pos, "%ui\n", marked);
+    b->last_buf = 1;
+    b->last_in_chain = 1;
+    out.buf = b;
+    out.next = NULL;
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+    return ngx_http_output_filter(r, &out);
+}
+
+static char *
+ngx_http_ws_admin_close(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t *clcf;
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_ws_admin_close_handler;
+    return NGX_CONF_OK;
+}
+
+// Connections are picked by a hash of their request id, so a connection is
+// either logged completely or not at all. The same hash spreads the logged
+// frames of different connections.
+static uint32_t
+connection_hash(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx)
+{
+    if (ctx->connection_id.len) {
+        return ngx_murmur_hash2(ctx->connection_id.data,
+                                ctx->connection_id.len);
+    }
+    return ngx_murmur_hash2((u_char *)&r->connection->number,
+                            sizeof(r->connection->number));
+}
+
+static void
+sample_connection(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx)
+{
+    ngx_http_websocket_main_conf_t *conf;
+    uint32_t hash = connection_hash(r, ctx);
+    ctx->id_hash = hash;
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    ctx->log_connection = hash % conf->sample_connection == 0;
+    ctx->log_frame_countdown =
+        hash / conf->sample_connection % conf->sample_frame + 1;
+}
+
+// Counts down to the next frame that is logged.
+static ngx_inline int
+sample_frame(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx)
+{
+    ngx_http_websocket_main_conf_t *conf;
+    if (!ctx->log_connection || --ctx->log_frame_countdown) {
+        return 0;
+    }
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    ctx->log_frame_countdown = conf->sample_frame;
+    return 1;
+}
+
+static int
+sample_event(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx)
+{
+    ngx_http_websocket_main_conf_t *conf;
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    return conf->sample_events == WS_SAMPLE_EVENTS_ALL ||
+           (ctx && ctx->log_connection);
+}
+
+static ngx_inline void
+count_frame(ngx_http_websocket_stat_statistic_t *stat,
+            ngx_frame_counter_t *frame)
+{
+    ngx_http_websocket_stat_opcode_t *op;
+    op = &stat->opcodes[frame->current_frame_type & (WS_OPCODES - 1)];
+    op->frames++;
+    op->payload += frame->current_payload_size;
+    histogram_record(&stat->payload_sizes, frame->current_payload_size);
+}
+
+// Follows permessage-deflate messages after every parsing step and inflates
+// the payload of sampled connections piece by piece, as it passes.
+static void
+count_compressed(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx,
+                 ngx_http_websocket_stat_statistic_t *stat, int from_client,
+                 int frame_done)
+{
+    ngx_frame_counter_t *fc = &ctx->frame_counter[from_client];
+    ngx_http_websocket_inflate_t *inflate;
+    ssize_t n;
+
+    // RSV1 is set on the first frame of a message only, control frames in
+    // between are never compressed
+    if (fc->current_frame_type == TEXT || fc->current_frame_type == BINARY) {
+        ctx->compressed[from_client] = fc->rsv1;
+    } else if (fc->current_frame_type != CONTINUATION) {
+        return;
+    }
+    if (!ctx->compressed[from_client]) {
+        return;
+    }
+
+    inflate = ctx->inflate[from_client];
+    if (inflate && inflate->active && (fc->chunk_size || frame_done)) {
+        n = 0;
+        if (fc->chunk_size) {
+            n = ws_inflate_feed(inflate, fc->chunk, fc->chunk_size,
+                                fc->payload_masked ? fc->mask : NULL,
+                                fc->chunk_offset);
+        }
+        if (n != NGX_ERROR && frame_done && fc->fin) {
+            ssize_t tail = ws_inflate_finish(inflate);
+            n = tail == NGX_ERROR ? NGX_ERROR : n + tail;
+        }
+        if (n == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "websocket message does not inflate, "
+                          "connection is not sampled anymore");
+        } else {
+            stat->inflate_in += fc->chunk_size;
+            stat->inflate_out += n;
+        }
+    }
+    if (frame_done) {
+        stat->compressed_frames++;
+        stat->compressed_payload += fc->current_payload_size;
+    }
+}
+
+// Inflate streams of all connections of this worker.
+static size_t inflate_memory_used;
+
+// Records permessage-deflate accepted by the upstream and sets up inflating
+// of connections picked by ws_inflate_sample, while the memory allows.
+static void
+deflate_init(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx)
+{
+    ngx_http_websocket_main_conf_t *conf;
+    ngx_http_websocket_inflate_t *inflate[2];
+    ngx_table_elt_t *h;
+    size_t memory;
+    int i;
+
+    h = find_header(&r->headers_out.headers, "Sec-WebSocket-Extensions");
+    if (h == NULL) {
+        return;
+    }
+    ctx->extensions = h->value;
+    ws_deflate_parse(&h->value, &ctx->deflate);
+    if (!ctx->deflate.enabled) {
+        return;
+    }
+    ngx_atomic_fetch_add(&stat_shard->deflate_connections, 1);
+
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    if (conf->inflate_sample == 0 || ctx->id_hash % conf->inflate_sample) {
+        return;
+    }
+    memory = ws_inflate_memory(ctx->deflate.window_bits[0]) +
+             ws_inflate_memory(ctx->deflate.window_bits[1]);
+    if (inflate_memory_used + memory > conf->inflate_memory) {
+        ngx_atomic_fetch_add(&stat_shard->inflate_skipped, 1);
+        return;
+    }
+    // both streams or none, their memory is allocated from the request pool
+    // and goes away with it
+    for (i = 0; i < 2; i++) {
+        inflate[i] = ngx_palloc(r->pool, sizeof(ngx_http_websocket_inflate_t));
+        if (inflate[i] == NULL ||
+            ws_inflate_init(inflate[i], r->pool,
+                            ctx->deflate.window_bits[i]) != NGX_OK) {
+            return;
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        inflate_memory_used += inflate[i]->memory;
+        ctx->inflate[i] = inflate[i];
+    }
+    ngx_atomic_fetch_add(&stat_shard->inflate_connections, 1);
+}
+
+// Slots a websocket connection holds: one in the global connection counter
+// and one per ws_limit_conn zone. They are taken in the access phase and
+// released when the request pool goes away, whether or not the upgrade
+// happened.
+typedef struct {
+    ngx_http_websocket_limit_t *limit;
+    ngx_http_websocket_limit_node_t *node;
+} reservation_slot_t;
+
+typedef struct {
+    unsigned active : 1;
+    unsigned rated : 1;
+    ngx_uint_t nslots;
+    reservation_slot_t slots[1];
+} reservation_t;
+
+static void
+release_connection(void *data)
+{
+    reservation_t *res = data;
+    ngx_uint_t i;
+    for (i = 0; i < res->nslots; i++) {
+        ws_limit_release(res->slots[i].limit, res->slots[i].node);
+    }
+    if (res->active) {
+        ngx_atomic_fetch_add(ngx_websocket_stat_active, -1);
+    }
+}
+
+// Phase handlers run again after an internal redirect or a delay, while the
+// pool and its cleanups stay, so an existing reservation is found there.
+static reservation_t *
+get_reservation(ngx_http_request_t *r)
+{
+    ngx_http_websocket_main_conf_t *conf;
+    ngx_pool_cleanup_t *cln;
+    reservation_t *res;
+    ngx_uint_t nlimits;
+
+    for (cln = r->pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler == release_connection) {
+            return cln->data;
+        }
+    }
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    nlimits = conf->limits ? conf->limits->nelts : 0;
+    cln = ngx_pool_cleanup_add(
+        r->pool, sizeof(reservation_t) + nlimits * sizeof(reservation_slot_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+    res = cln->data;
+    res->active = 0;
+    res->rated = 0;
+    res->nslots = 0;
+    cln->handler = release_connection;
+    return res;
+}
+
+// Takes a token in every ws_limit_rate zone, delay is set to the longest
+// wait they ask for.
+static ngx_int_t
+rate_limit_connection(ngx_http_request_t *r, reservation_t *res,
+                      ngx_msec_t *delay)
+{
+    ngx_http_websocket_main_conf_t *conf;
+    ngx_http_websocket_rate_t **rates;
+    ngx_uint_t i;
+    ngx_msec_t wait;
+    ngx_str_t key;
+
+    res->rated = 1;
+    *delay = 0;
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    if (conf->rates == NULL) {
+        return NGX_OK;
+    }
+    rates = conf->rates->elts;
+    for (i = 0; i < conf->rates->nelts; i++) {
+        if (rates[i]->key.value.data == NULL) {
+            ngx_str_null(&key);
+        } else {
+            if (ngx_http_complex_value(r, &rates[i]->key, &key) != NGX_OK) {
+                return NGX_ERROR;
+            }
+            if (key.len == 0) {
+                continue;
+            }
+        }
+        if (ws_rate_account(rates[i], &key, &wait) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "limiting websocket upgrades by zone \"%V\"",
+                          &rates[i]->shm_zone->shm.name);
+            return NGX_BUSY;
+        }
+        if (wait > *delay) {
+            *delay = wait;
+        }
+    }
+    return NGX_OK;
+}
+
+// Reserves the connection in the global counter and in every ws_limit_conn
+// zone. Returns NGX_BUSY if a limit is reached and enforce is set.
+static ngx_int_t
+reserve_connection(ngx_http_request_t *r, reservation_t *res, int enforce)
+{
+    ngx_http_websocket_main_conf_t *conf;
+    ngx_http_websocket_limit_t **limits;
+    ngx_uint_t i, nlimits, max;
+    ngx_str_t key;
+
+    if (res->active) {
+        return NGX_OK;
+    }
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    nlimits = enforce && conf->limits ? conf->limits->nelts : 0;
+    max = enforce && conf->max_ws_connections > 0 ? conf->max_ws_connections
+                                                  : 0;
+    if (ws_limit_acquire_counter(ngx_websocket_stat_active, max) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "limiting websocket connections to %ui", max);
+        return NGX_BUSY;
+    }
+    res->active = 1;
+
+    limits = nlimits ? conf->limits->elts : NULL;
+    for (i = 0; i < nlimits; i++) {
+        if (ngx_http_complex_value(r, &limits[i]->key, &key) != NGX_OK) {
+            return NGX_ERROR;
+        }
+        if (key.len == 0) {
+            continue;
+        }
+        reservation_slot_t *slot = &res->slots[res->nslots];
+        if (ws_limit_acquire(limits[i], &key, &slot->node) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "limiting websocket connections by zone \"%V\"",
+                          &limits[i]->shm_zone->shm.name);
+            return NGX_BUSY;
+        }
+        slot->limit = limits[i];
+        res->nslots++;
+    }
+    return NGX_OK;
+}
+
+// Name of the peer the connection was proxied to, like "10.0.0.1:8080".
+static void
+upstream_peer_name(ngx_http_request_t *r, ngx_str_t *name)
+{
+    ngx_http_upstream_state_t *state;
+    if (r->upstream && r->upstream->peer.name) {
+        *name = *r->upstream->peer.name;
+        return;
+    }
+    if (r->upstream_states && r->upstream_states->nelts) {
+        state = r->upstream_states->elts;
+        state += r->upstream_states->nelts - 1;
+        if (state->peer) {
+            *name = *state->peer;
+            return;
+        }
+    }
+    ngx_str_null(name);
+}
+
+// Finds counters of the connection's key in every zone and counts the
+// connection there.
+static ngx_int_t
+open_zones(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx)
+{
+    ngx_http_websocket_main_conf_t *conf;
+    ngx_http_websocket_zone_t **zones;
+    ngx_str_t key;
+    ngx_uint_t i;
+
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    if (conf->zones == NULL) {
+        return NGX_OK;
+    }
+    zones = conf->zones->elts;
+    ctx->zone_counters =
+        ngx_palloc(r->pool, conf->zones->nelts *
+                                sizeof(ngx_http_websocket_zone_counters_t *));
+    if (ctx->zone_counters == NULL) {
+        return NGX_ERROR;
+    }
+    for (i = 0; i < conf->zones->nelts; i++) {
+        if (zones[i]->upstream) {
+            upstream_peer_name(r, &key);
+        } else if (ngx_http_complex_value(r, &zones[i]->key, &key) !=
+                   NGX_OK) {
+            return NGX_ERROR;
+        }
+        ctx->zone_counters[i] = ws_zone_lookup(zones[i], &key);
+        ngx_atomic_fetch_add(&ctx->zone_counters[i]->connections, 1);
+        ngx_atomic_fetch_add(&ctx->zone_counters[i]->opened, 1);
+        ctx->zone_count++;
+    }
+    return NGX_OK;
+}
+
+static void
+count_zones(ngx_http_websocket_stat_ctx *ctx, int from_client, size_t size,
+            ngx_atomic_uint_t frames, ngx_atomic_uint_t payload)
+{
+    ngx_http_websocket_zone_traffic_t *traffic;
+    ngx_uint_t i;
+    for (i = 0; i < ctx->zone_count; i++) {
+        traffic = from_client ? &ctx->zone_counters[i]->frames_in
+                              : &ctx->zone_counters[i]->frames_out;
+        ngx_atomic_fetch_add(&traffic->total_size, size);
+        if (frames) {
+            ngx_atomic_fetch_add(&traffic->frames, frames);
+            ngx_atomic_fetch_add(&traffic->total_payload_size, payload);
+        }
+    }
+}
+
+// Open connections of this worker.
+static ngx_queue_t worker_connections;
+static ngx_uint_t worker_connection_count;
+
+// ws_drain_on_reload state of an exiting worker: connections to close in
+// total, including ones upgraded after the drain began, and how many of them
+// this worker has added to the shared draining counter.
+static unsigned drain_started;
+static ngx_msec_t drain_start;
+static ngx_uint_t drain_total;
+static ngx_uint_t drain_reported;
+
+static void
+register_connection(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx)
+{
+    ngx_http_websocket_main_conf_t *conf;
+    u_char addr[WS_REGISTRY_ADDR_LEN];
+    ngx_str_t addr_str, upstream;
+
+    ctx->request = r;
+    ngx_queue_insert_tail(&worker_connections, &ctx->queue);
+    ctx->queued = 1;
+    worker_connection_count++;
+    if (drain_started) {
+        drain_total++;
+    }
+
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    if (conf->registry == NULL) {
+        return;
+    }
+    addr_str.data = addr;
+    addr_str.len =
+        ngx_snprintf(addr, sizeof(addr), "%V:%V",
+                     &ctx->core_vars[CORE_VAR_REMOTE_ADDR],
+                     &ctx->core_vars[CORE_VAR_REMOTE_PORT]) -
+        addr;
+    upstream_peer_name(r, &upstream);
+    ctx->registry_slot = ws_registry_add(
+        conf->registry, &ctx->connection_id, &addr_str,
+        &ctx->core_vars[CORE_VAR_URI], &upstream);
+}
+
+static void
+unregister_connection(ngx_http_websocket_stat_ctx *ctx)
+{
+    if (ctx->queued) {
+        ngx_queue_remove(&ctx->queue);
+        ctx->queued = 0;
+        worker_connection_count--;
+    }
+    if (ctx->registry_slot) {
+        ws_registry_remove(ctx->registry_slot);
+        ctx->registry_slot = NULL;
+    }
+}
+
+// The slot belongs to this connection, no other worker writes to it.
+static ngx_inline void
+count_registry(ngx_http_websocket_stat_ctx *ctx, int from_client,
+               size_t size, ngx_atomic_uint_t frames)
+{
+    if (ctx->registry_slot) {
+        ctx->registry_slot->traffic[from_client].bytes += size;
+        ctx->registry_slot->traffic[from_client].frames += frames;
+    }
+}
+
+// Open connection counters are released by the reservation cleanup, this
+// only records the close. The start time is set once the upgrade went
+// through, a connection refused before has no age.
+static void
+count_close(ngx_http_websocket_stat_ctx *ctx)
+{
+    ngx_uint_t i;
+    if (ctx) {
+        ctx->closed = 1;
+        if (ctx->ws_conn_start_time) {
+            histogram_record(&stat_shard->conn_age,
+                             ngx_time() - ctx->ws_conn_start_time);
+        }
+        for (i = 0; i < ctx->zone_count; i++) {
+            ngx_atomic_fetch_add(&ctx->zone_counters[i]->connections, -1);
+            ngx_atomic_fetch_add(&ctx->zone_counters[i]->closed, 1);
+        }
+        ctx->zone_count = 0;
+        unregister_connection(ctx);
+    }
+}
+
+typedef ssize_t (*send_func)(ngx_connection_t *c, u_char *buf, size_t size);
+send_func orig_recv, orig_send;
+
+// A close frame cannot be put inside a frame going to the client, so a close
+// waits for the frame to end, checking this often and this long at most.
+// A frame still unfinished then is cut without a close frame.
+#define WS_CLOSE_RETRY 50
+#define WS_CLOSE_WAIT 2000
+
+static void
+close_now(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx)
+{
+    template_ctx_s template_ctx;
+    if (ctx->frame_counter[0].stage == HEADER) {
+        send_close_packet(r->connection, ctx->close_status,
+                          ctx->close_reason);
+    }
+    ngx_memzero(&template_ctx, sizeof(template_ctx));
+    template_ctx.ws_ctx = ctx;
+    count_close(ctx);
+    if (sample_event(r, ctx))
+        ws_do_log(log_close_template, r, &template_ctx);
+    ngx_http_finalize_request(r, NGX_ERROR);
+}
+
+static void
+close_retry(ngx_event_t *ev)
+{
+    ngx_connection_t *c = ev->data;
+    ngx_http_request_t *r = c->data;
+    ngx_http_websocket_stat_ctx *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_websocket_stat_module);
+    if (ctx == NULL || ctx->closed) {
+        return;
+    }
+    if (ctx->frame_counter[0].stage != HEADER &&
+        (ngx_msec_int_t)(ctx->close_deadline - ngx_current_msec) > 0) {
+        ngx_add_timer(ev, WS_CLOSE_RETRY);
+        return;
+    }
+    close_now(r, ctx);
+}
+
+// Closes the connection from a timer, when neither side is in the middle of
+// a call.
+static void
+close_connection(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx,
+                 int status, const char *reason)
+{
+    if (ctx->close_timer.timer_set) {
+        // already closing
+        return;
+    }
+    ctx->close_status = status;
+    ctx->close_reason = reason;
+    if (ctx->frame_counter[0].stage == HEADER) {
+        close_now(r, ctx);
+        return;
+    }
+    // off the worker's list, so the drain does not pick it again, and the
+    // timer keeps an exiting worker until the close is done
+    if (ctx->queued) {
+        ngx_queue_remove(&ctx->queue);
+        ctx->queued = 0;
+        worker_connection_count--;
+    }
+    ctx->close_deadline = ngx_current_msec + WS_CLOSE_WAIT;
+    ctx->close_timer.data = r->connection;
+    ctx->close_timer.handler = close_retry;
+    ctx->close_timer.log = r->connection->log;
+    ngx_add_timer(&ctx->close_timer, WS_CLOSE_RETRY);
+}
+
+// How often workers look for connections marked by ws_admin_close.
+#define WS_ADMIN_CHECK_INTERVAL 1000
+
+static ngx_event_t admin_check_event;
+static ngx_atomic_uint_t admin_close_requests;
+
+// Runs once a second in every worker. Only a changed request counter makes
+// it walk this worker's connections.
+static void
+admin_check(ngx_event_t *ev)
+{
+    ngx_http_websocket_main_conf_t *conf = ev->data;
+    ngx_http_websocket_registry_sh_t *sh = conf->registry->sh;
+    ngx_http_websocket_stat_ctx *ctx;
+    ngx_queue_t *q, *next;
+
+    if (sh->close_requests != admin_close_requests) {
+        admin_close_requests = sh->close_requests;
+        for (q = ngx_queue_head(&worker_connections);
+             q != ngx_queue_sentinel(&worker_connections); q = next) {
+            // closing removes the connection from the queue
+            next = ngx_queue_next(q);
+            ctx = ngx_queue_data(q, ngx_http_websocket_stat_ctx, queue);
+            if (ctx->registry_slot == NULL ||
+                !ws_registry_marked(ctx->registry_slot)) {
+                continue;
+            }
+            ngx_log_error(NGX_LOG_INFO, ctx->request->connection->log, 0,
+                          "closing websocket connection on admin request");
+            close_connection(ctx->request, ctx, 4002,
+                             "Closed by Administrator");
+        }
+    }
+    ngx_add_timer(ev, WS_ADMIN_CHECK_INTERVAL);
+}
+
+// ws_drain_on_reload looks for shutdown once a second, an exiting worker
+// then closes its connections in small steps.
+#define WS_DRAIN_CHECK_INTERVAL 1000
+#define WS_DRAIN_STEP 100
+
+static ngx_event_t drain_event;
+// Drain closes in the current second, in this worker.
+static time_t drain_close_second;
+static ngx_uint_t drain_close_count;
+
+static void
+drain_report(void)
+{
+    ngx_atomic_fetch_add(&drain_sh->draining,
+                         (ngx_atomic_int_t)worker_connection_count -
+                             (ngx_atomic_int_t)drain_reported);
+    drain_reported = worker_connection_count;
+}
+
+// Closes the connections of an exiting worker evenly over the window, oldest
+// first. Connections that went away by themselves count as closed, so the
+// schedule is not rushed to catch up with them.
+static void
+drain_expire(ngx_event_t *ev)
+{
+    ngx_http_websocket_main_conf_t *conf = ev->data;
+    ngx_http_websocket_stat_ctx *ctx;
+    ngx_msec_t elapsed;
+    ngx_uint_t due;
+
+    if (!ngx_exiting) {
+        ngx_add_timer(ev, WS_DRAIN_CHECK_INTERVAL);
+        return;
+    }
+    if (!drain_started) {
+        drain_started = 1;
+        drain_start = ngx_current_msec;
+        drain_total = worker_connection_count;
+        ngx_log_error(NGX_LOG_NOTICE, ev->log, 0,
+                      "draining %ui websocket connections", drain_total);
+    }
+
+    elapsed = ngx_current_msec - drain_start;
+    due = drain_total;
+    if (elapsed < conf->drain_window) {
+        due = (uint64_t)drain_total * elapsed / conf->drain_window;
+    }
+    while (drain_total - worker_connection_count < due &&
+           !ngx_queue_empty(&worker_connections)) {
+        if (conf->drain_rate) {
+            if (drain_close_second != ngx_time()) {
+                drain_close_second = ngx_time();
+                drain_close_count = 0;
+            }
+            if (drain_close_count >= conf->drain_rate) {
+                break;
+            }
+            drain_close_count++;
+        }
+        // closing removes the connection from the queue
+        ctx = ngx_queue_data(ngx_queue_head(&worker_connections),
+                             ngx_http_websocket_stat_ctx, queue);
+        ngx_log_error(NGX_LOG_INFO, ctx->request->connection->log, 0,
+                      "closing websocket connection on shutdown");
+        close_connection(ctx->request, ctx, 1001, "Going Away");
+        ngx_atomic_fetch_add(&drain_sh->drained, 1);
+    }
+
+    drain_report();
+    // the worker waits for this timer, so it is not armed once all is closed
+    if (!ngx_queue_empty(&worker_connections)) {
+        ngx_add_timer(ev, WS_DRAIN_STEP);
+    }
+}
+
+// Closes made by ws_conn_age in the current second, in this worker.
+static time_t age_close_second;
+static ngx_uint_t age_close_count;
+
+static void
+age_expire(ngx_event_t *ev)
+{
+    ngx_http_websocket_main_conf_t *conf;
+    ngx_connection_t *c = ev->data;
+    ngx_http_request_t *r = c->data;
+    ngx_http_websocket_stat_ctx *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_websocket_stat_module);
+    if (ctx == NULL || ctx->closed) {
+        return;
+    }
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    if (conf->age_close_rate) {
+        if (age_close_second != ngx_time()) {
+            age_close_second = ngx_time();
+            age_close_count = 0;
+        }
+        if (age_close_count >= conf->age_close_rate) {
+            // try again somewhere within the next seconds
+            ngx_add_timer(ev, 1000 + ngx_random() % 1000);
+            return;
+        }
+        age_close_count++;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                  "closing websocket connection older than %ds",
+                  conf->max_ws_age);
+    close_connection(r, ctx, 4001, "Connection is Aged");
+}
+
+// Spreads closes of connections opened together over the jitter window
+// before ws_conn_age, so their clients do not come back all at once.
+static void
+age_arm(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx)
+{
+    ngx_http_websocket_main_conf_t *conf;
+    ngx_msec_t timeout;
+
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    if (conf->max_ws_age <= 0) {
+        return;
+    }
+    timeout = (ngx_msec_t)conf->max_ws_age * 1000;
+    if (conf->age_jitter) {
+        timeout -= ngx_random() % (conf->age_jitter + 1);
+    }
+    ctx->age_timer.data = r->connection;
+    ctx->age_timer.handler = age_expire;
+    ctx->age_timer.log = r->connection->log;
+    // a worker shutting down does not wait for it
+    ctx->age_timer.cancelable = 1;
+    ngx_add_timer(&ctx->age_timer, timeout);
+}
+
+// A ping that could not go out, mid-frame or to a full socket, is tried again
+// this soon, in milliseconds.
+#define WS_PING_RETRY 1000
+
+// Writes a ping straight to the client like send_close_packet does. Returns
+// NGX_AGAIN if the socket took nothing, and NGX_ERROR if it failed or took
+// only a part of the ping, the stream is broken then.
+static ngx_int_t
+send_ping_packet(ngx_connection_t *connection)
+{
+    u_char cbuf[2 + PING_PAYLOAD_SIZE];
+    cbuf[0] = 0x89; // Fin, Ping : 1000 1001
+    cbuf[1] = PING_PAYLOAD_SIZE;
+    memcpy(&cbuf[2], kWsPingPayload, PING_PAYLOAD_SIZE);
+    ssize_t n = orig_send(connection, cbuf, sizeof(cbuf));
+    if (n == NGX_AGAIN) {
+        return NGX_AGAIN;
+    }
+    if (n != (ssize_t)sizeof(cbuf)) {
+        return NGX_ERROR;
+    }
+    return NGX_OK;
+}
+
+static void
+ping_expire(ngx_event_t *ev)
+{
+    ngx_http_websocket_main_conf_t *conf;
+    ngx_connection_t *c = ev->data;
+    ngx_http_request_t *r = c->data;
+    ngx_http_websocket_stat_ctx *ctx;
+    ngx_msec_t idle;
+    ngx_int_t rc;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_websocket_stat_module);
+    if (ctx == NULL || ctx->closed) {
+        return;
+    }
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    idle = ngx_current_msec - ctx->last_activity;
+    if (idle < conf->ping_interval) {
+        ngx_add_timer(ev, conf->ping_interval - idle);
+        return;
+    }
+    if (ctx->pings_missed >= conf->ping_misses) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "websocket client did not answer %ui pings",
+                      ctx->pings_missed);
+        close_connection(r, ctx, 1001, "Ping Timeout");
+        return;
+    }
+    // a ping cannot be put inside a frame going to the client
+    rc = NGX_AGAIN;
+    if (ctx->frame_counter[0].stage == HEADER) {
+        rc = send_ping_packet(c);
+    }
+    if (rc == NGX_ERROR) {
+        // the close is counted by the request cleanup
+        ngx_http_finalize_request(r, NGX_ERROR);
+        return;
+    }
+    if (rc == NGX_AGAIN) {
+        // the ping did not go out, so there is no pong to miss yet
+        ngx_add_timer(ev, ngx_min(conf->ping_interval, WS_PING_RETRY));
+        return;
+    }
+    ctx->ping_sent = 1;
+    ctx->pings_missed++;
+    ngx_add_timer(ev, conf->ping_interval);
+}
+
+static void
+ping_arm(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx)
+{
+    ngx_http_websocket_main_conf_t *conf;
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    ctx->last_activity = ngx_current_msec;
+    if (conf->ping_interval == 0) {
+        return;
+    }
+    ctx->ping_timer.data = r->connection;
+    ctx->ping_timer.handler = ping_expire;
+    ctx->ping_timer.log = r->connection->log;
+    ctx->ping_timer.cancelable = 1;
+    ngx_add_timer(&ctx->ping_timer, conf->ping_interval);
+}
+
+// Whether the frame just parsed from the client, starting at start, is a
+// pong to ws_ping.
+static int
+is_own_pong(ngx_http_websocket_stat_ctx *ctx, u_char *start, u_char *end)
+{
+    ngx_frame_counter_t *fc = &ctx->frame_counter[1];
+    u_char payload[PING_PAYLOAD_SIZE];
+    if (!ctx->ping_sent || fc->current_frame_type != PONG ||
+        fc->current_payload_size != PING_PAYLOAD_SIZE ||
+        end - start < 2 + PING_PAYLOAD_SIZE) {
+        return 0;
+    }
+    if (fc->payload_masked) {
+        frame_counter_unmask(payload, end - PING_PAYLOAD_SIZE,
+                             PING_PAYLOAD_SIZE, fc->mask, 0);
+    } else {
+        memcpy(payload, end - PING_PAYLOAD_SIZE, PING_PAYLOAD_SIZE);
+    }
+    return memcmp(payload, kWsPingPayload, PING_PAYLOAD_SIZE) == 0;
+}
+
+// Points template context at the payload of the frame that ends at frame_end,
+// if all of it is in the current buffer.
+static void
+set_frame_payload(template_ctx_s *template_ctx, u_char *start,
+                  u_char *frame_end)
+{
+    ngx_frame_counter_t *fc =
+        &template_ctx->ws_ctx->frame_counter[template_ctx->from_client];
+    ngx_int_t size = fc->current_payload_size;
+    if (frame_end - start >= size) {
+        template_ctx->payload = frame_end - size;
+        template_ctx->payload_size = size;
+    } else {
+        template_ctx->payload = NULL;
+        template_ctx->payload_size = 0;
+    }
+}
+
+// Shortest wait for bytes, so that a drained connection moves in chunks
+// rather than a byte per timer.
+#define WS_SHAPE_MIN_DELAY 10
+
+static void
+shape_refill(ngx_http_websocket_bucket_t *bucket, ngx_uint_t bytes,
+             ngx_uint_t frames)
+{
+    ngx_msec_int_t ms = (ngx_msec_int_t)(ngx_current_msec - bucket->last);
+    if (ms <= 0) {
+        return;
+    }
+    bucket->last = ngx_current_msec;
+    // a second worth of traffic at most, which is also the burst
+    bucket->bytes += (int64_t)bytes * ms;
+    if (bucket->bytes > (int64_t)bytes * 1000) {
+        bucket->bytes = (int64_t)bytes * 1000;
+    }
+    bucket->frames += (int64_t)frames * ms;
+    if (bucket->frames > (int64_t)frames * 1000) {
+        bucket->frames = (int64_t)frames * 1000;
+    }
+}
+
+// Returns how many of size bytes may pass now. When none may, delay is set
+// to the time until they can, otherwise it is 0.
+static size_t
+shape_budget(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx,
+             int from_client, size_t size, ngx_msec_t *delay)
+{
+    ngx_http_websocket_main_conf_t *conf;
+    ngx_http_websocket_bucket_t *bucket = &ctx->bucket[from_client];
+    ngx_uint_t bytes, frames;
+    int64_t want;
+
+    *delay = 0;
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    bytes = conf->traffic_bytes[from_client];
+    frames = conf->traffic_frames[from_client];
+    if (bytes == 0 && frames == 0) {
+        return size;
+    }
+    shape_refill(bucket, bytes, frames);
+    if (frames && bucket->frames < 0) {
+        *delay = (-bucket->frames + frames - 1) / frames;
+    }
+    if (bytes) {
+        if (bucket->bytes >= 1000) {
+            if ((int64_t)size > bucket->bytes / 1000) {
+                size = bucket->bytes / 1000;
+            }
+        } else {
+            want = ngx_min((int64_t)size, (int64_t)bytes / 100 + 1) * 1000;
+            *delay = ngx_max(*delay, (ngx_msec_t)((want - bucket->bytes +
+                                                   bytes - 1) / bytes));
+        }
+    }
+    if (*delay) {
+        *delay = ngx_max(*delay, WS_SHAPE_MIN_DELAY);
+        return 0;
+    }
+    return size;
+}
 
-    return NGX_CONF_OK;
-} /* ngx_http_hello_world */
+static void
+shape_consume(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx,
+              int from_client, size_t size, ngx_uint_t frames)
+{
+    ngx_http_websocket_main_conf_t *conf;
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    if (conf->traffic_bytes[from_client]) {
+        ctx->bucket[from_client].bytes -= (int64_t)size * 1000;
+    }
+    if (conf->traffic_frames[from_client]) {
+        ctx->bucket[from_client].frames -= (int64_t)frames * 1000;
+    }
+}
 
-static char *
-ngx_http_websocket_max_conn_setup(ngx_conf_t *cf, ngx_command_t *cmd,
-                                  void *conf)
+// Wakes the proxy loop up again as if the socket became ready.
+static void
+shape_resume(ngx_event_t *ev)
 {
-    ngx_str_t *value;
-    value = cf->args->elts;
-    ngx_http_websocket_main_conf_t *main_conf = conf;
-    main_conf->max_ws_connections = atoi((char *)value[1].data);
-    return NGX_CONF_OK;
+    ngx_connection_t *c = ev->data;
+    ngx_event_t *target = ev->write ? c->write : c->read;
+    target->ready = 1;
+    target->handler(target);
 }
-static char *
-ngx_http_websocket_max_conn_age(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+
+// Makes the proxy loop stop on this direction until the bucket refills.
+// Only the timer resumes it: ready is cleared without re-arming the socket
+// event, so the socket becoming ready meanwhile does not wake the loop.
+static ssize_t
+shape_defer(ngx_connection_t *c, ngx_http_websocket_stat_ctx *ctx,
+            int from_client, ngx_msec_t delay)
 {
-    ngx_str_t *value;
-    value = cf->args->elts;
-    ngx_int_t timeout;
-    timeout = ngx_parse_time(&value[1], 1);
-    if (timeout == NGX_ERROR) {
-        return NGX_CONF_ERROR;
+    ngx_event_t *ev = &ctx->shape_timer[from_client];
+    if (from_client) {
+        c->read->ready = 0;
+    } else {
+        c->write->ready = 0;
     }
-    ngx_http_websocket_main_conf_t *main_conf = conf;
-    main_conf->max_ws_age = timeout;
-
-    return NGX_CONF_OK;
+    if (!ev->timer_set) {
+        ngx_add_timer(ev, delay);
+    }
+    return NGX_AGAIN;
 }
 
-static char *
-ngx_http_ws_logfile(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static void
+shape_init(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx)
 {
+    ngx_http_websocket_main_conf_t *conf;
+    ngx_uint_t i;
 
-    ws_log = ngx_palloc(cf->pool, sizeof(ngx_log_t));
-    ngx_memzero(ws_log, sizeof(ngx_log_t));
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    for (i = 0; i < 2; i++) {
+        ctx->bucket[i].last = ngx_current_msec;
+        ctx->bucket[i].bytes = (int64_t)conf->traffic_bytes[i] * 1000;
+        ctx->bucket[i].frames = (int64_t)conf->traffic_frames[i] * 1000;
+        ctx->shape_timer[i].data = r->connection;
+        ctx->shape_timer[i].handler = shape_resume;
+        ctx->shape_timer[i].log = r->connection->log;
+        ctx->shape_timer[i].write = !i;
+        // do not keep exiting workers alive for shaped connections
+        ctx->shape_timer[i].cancelable = 1;
+    }
+}
 
-    ngx_str_t *value;
-    value = cf->args->elts;
-    ws_log->log_level = NGX_LOG_NOTICE;
-    assert(cf->args->nelts >= 2);
-    ws_log->file = ngx_conf_open_file(cf->cycle, &value[1]);
-    if (!ws_log->file)
-        return NGX_CONF_ERROR;
+static void
+ctx_cleanup(void *data)
+{
+    ngx_http_websocket_stat_ctx *ctx = data;
+    template_ctx_s template_ctx;
+    ngx_uint_t i;
 
-    return NGX_CONF_OK;
+    // teardowns the filters never see, like a send timeout or a failed ping,
+    // are counted here, every close exactly once
+    if (!ctx->closed) {
+        if (ctx->ws_conn_start_time && sample_event(ctx->request, ctx)) {
+            ngx_memzero(&template_ctx, sizeof(template_ctx));
+            template_ctx.ws_ctx = ctx;
+            ws_do_log(log_close_template, ctx->request, &template_ctx);
+        }
+        count_close(ctx);
+    }
+    if (ctx->close_timer.timer_set) {
+        ngx_del_timer(&ctx->close_timer);
+    }
+    for (i = 0; i < 2; i++) {
+        if (ctx->shape_timer[i].timer_set) {
+            ngx_del_timer(&ctx->shape_timer[i]);
+        }
+    }
+    if (ctx->age_timer.timer_set) {
+        ngx_del_timer(&ctx->age_timer);
+    }
+    if (ctx->ping_timer.timer_set) {
+        ngx_del_timer(&ctx->ping_timer);
+    }
+    for (i = 0; i < 2; i++) {
+        if (ctx->inflate[i]) {
+            inflate_memory_used -= ctx->inflate[i]->memory;
+            ctx->inflate[i] = NULL;
+        }
+    }
+    unregister_connection(ctx);
 }
-typedef ssize_t (*send_func)(ngx_connection_t *c, u_char *buf, size_t size);
-send_func orig_recv, orig_send;
 
-static int
-check_ws_age(time_t conn_start_time, ngx_http_request_t *r)
+// Timers and the registry slot of the connection live in its context, they
+// are released together with the request pool.
+static ngx_int_t
+ctx_init(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx)
 {
-    ngx_http_websocket_main_conf_t *conf;
-    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
-    if (conf->max_ws_age > 0 &&
-        ngx_time() - conn_start_time >= conf->max_ws_age) {
-        send_close_packet(r->connection, 4001, "Connection is Aged");
+    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
         return NGX_ERROR;
     }
+    cln->handler = ctx_cleanup;
+    cln->data = ctx;
+    shape_init(r, ctx);
+    age_arm(r, ctx);
+    ping_arm(r, ctx);
+    deflate_init(r, ctx);
+    register_connection(r, ctx);
     return NGX_OK;
 }
+
 // Packets that being send to a client
 ssize_t
 my_send(ngx_connection_t *c, u_char *buf, size_t size)
@@ -316,73 +3470,148 @@ my_send(ngx_connection_t *c, u_char *buf, size_t size)
     ngx_http_websocket_stat_ctx *ctx;
     ssize_t sz = size;
     u_char *buffer = buf;
-    ngx_http_websocket_stat_statistic_t *frame_counter = &frames_out;
-    ngx_atomic_fetch_add(frame_counter->total_size, sz);
+    ngx_atomic_uint_t frames = 0, payload = 0;
+    ngx_http_websocket_stat_statistic_t *frame_counter;
+    frame_counter = &stat_shard->frames_out;
     ngx_http_request_t *r = c->data;
 
+    ngx_msec_t delay;
+    int done;
+
     ctx = ngx_http_get_module_ctx(r, ngx_http_websocket_stat_module);
-    if (check_ws_age(ctx->ws_conn_start_time, r) != NGX_OK) {
-        return NGX_ERROR;
-    }
     template_ctx_s template_ctx;
     template_ctx.from_client = 0;
     template_ctx.ws_ctx = ctx;
-    template_ctx.buf = buffer;
+    size = shape_budget(r, ctx, 0, size, &delay);
+    if (delay) {
+        return shape_defer(c, ctx, 0, delay);
+    }
+    // only what was sent is parsed, the rest comes again with the next call
+    ssize_t n = orig_send(c, buf, size);
+    if (n < 0) {
+        // NGX_AGAIN is a full socket on a live connection, the close is
+        // counted by the body filter or cleanup when it really goes
+        if (n == NGX_ERROR && !ctx->closed) {
+            template_ctx.pending_size = 0;
+            count_close(ctx);
+            if (sample_event(r, ctx))
+                ws_do_log(log_close_template, r, &template_ctx);
+        }
+        return n;
+    }
+    sz = n;
     template_ctx.pending_size = sz;
     while (sz > 0) {
-        if (frame_counter_process_message(&buffer, &sz,
-                                          &(ctx->frame_counter))) {
-            ngx_atomic_fetch_add(frame_counter->frames, 1);
-            ngx_atomic_fetch_add(frame_counter->total_payload_size,
-                                 ctx->frame_counter.current_payload_size);
-            ws_do_log(log_template, r, &template_ctx);
+        done = frame_counter_process_message(&buffer, &sz,
+                                             &ctx->frame_counter[0]);
+        if (ctx->deflate.enabled) {
+            count_compressed(r, ctx, frame_counter, 0, done);
+        }
+        if (done) {
+            frames++;
+            payload += ctx->frame_counter[0].current_payload_size;
+            count_frame(frame_counter, &ctx->frame_counter[0]);
+            if (sample_frame(r, ctx)) {
+                set_frame_payload(&template_ctx, buf, buffer);
+                ws_do_log(log_template, r, &template_ctx);
+            }
+            if (ws_tap_worker_ring) {
+                tap_frame(ctx, 0, template_ctx.pending_size);
+            }
             template_ctx.pending_size = 0;
         }
     }
-    int n = orig_send(c, buf, size);
-    if (n < 0) {
-        if(!ngx_atomic_cmp_set(ngx_websocket_stat_active, 0, 0)){
-          ngx_atomic_fetch_add(ngx_websocket_stat_active, -1);
-          ws_do_log(log_close_template, r, &template_ctx);
-        }
+    ngx_atomic_fetch_add(&frame_counter->total_size, n);
+    if (frames) {
+        ngx_atomic_fetch_add(&frame_counter->frames, frames);
+        ngx_atomic_fetch_add(&frame_counter->total_payload_size, payload);
     }
+    count_zones(ctx, 0, n, frames, payload);
+    count_registry(ctx, 0, n, frames);
+    shape_consume(r, ctx, 0, n, frames);
     return n;
 }
 
-// Packets received from a client
-ssize_t
-my_recv(ngx_connection_t *c, u_char *buf, size_t size)
+// Counts frames of n bytes received from the client and takes pongs to
+// ws_ping out of them. Returns the number of bytes left.
+static ssize_t
+count_received(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx,
+               u_char *buf, ssize_t n)
 {
-
-    int n = orig_recv(c, buf, size);
-    if (n <= 0) {
-        return n;
-    }
-
-    ngx_http_websocket_stat_ctx *ctx;
-    ssize_t sz = n;
-    ngx_http_websocket_stat_statistic_t *frame_counter = &frames_in;
-    ngx_http_request_t *r = c->data;
-    ctx = ngx_http_get_module_ctx(r, ngx_http_websocket_stat_module);
-    if (check_ws_age(ctx->ws_conn_start_time, r) != NGX_OK) {
-        return NGX_ERROR;
-    }
-    ngx_atomic_fetch_add(frame_counter->total_size, n);
+    ssize_t sz = n, len = n;
+    ngx_atomic_uint_t frames = 0, payload = 0;
+    ngx_http_websocket_stat_statistic_t *frame_counter;
+    frame_counter = &stat_shard->frames_in;
+    ngx_frame_counter_t *fc = &ctx->frame_counter[1];
+    int done;
     template_ctx_s template_ctx;
     template_ctx.from_client = 1;
     template_ctx.ws_ctx = ctx;
-    template_ctx.buf = buf;
     template_ctx.pending_size = sz;
+    u_char *start = buf;
+    // only frames that start in this buffer can be taken out of it
+    u_char *frame_start = fc->stage == HEADER ? buf : NULL;
     while (sz > 0) {
-        if (frame_counter_process_message(&buf, &sz, &ctx->frame_counter)) {
-
-            ngx_atomic_fetch_add(frame_counter->frames, 1);
-            ngx_atomic_fetch_add(frame_counter->total_payload_size,
-                                 ctx->frame_counter.current_payload_size);
-            ws_do_log(log_template, r, &template_ctx);
+        done = frame_counter_process_message(&buf, &sz, fc);
+        if (ctx->deflate.enabled) {
+            count_compressed(r, ctx, frame_counter, 1, done);
+        }
+        if (done) {
+            frames++;
+            payload += fc->current_payload_size;
+            count_frame(frame_counter, fc);
+            if (sample_frame(r, ctx)) {
+                set_frame_payload(&template_ctx, start, buf);
+                ws_do_log(log_template, r, &template_ctx);
+            }
+            if (ws_tap_worker_ring) {
+                tap_frame(ctx, 1, template_ctx.pending_size);
+            }
             template_ctx.pending_size = 0;
+            if (frame_start && is_own_pong(ctx, frame_start, buf)) {
+                ngx_memmove(frame_start, buf, sz);
+                len -= buf - frame_start;
+                buf = frame_start;
+            }
+            frame_start = buf;
         }
     }
+    ngx_atomic_fetch_add(&frame_counter->total_size, n);
+    if (frames) {
+        ngx_atomic_fetch_add(&frame_counter->frames, frames);
+        ngx_atomic_fetch_add(&frame_counter->total_payload_size, payload);
+    }
+    count_zones(ctx, 1, n, frames, payload);
+    count_registry(ctx, 1, n, frames);
+    shape_consume(r, ctx, 1, n, frames);
+    return len;
+}
+
+// Packets received from a client
+ssize_t
+my_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ngx_http_request_t *r = c->data;
+    ngx_http_websocket_stat_ctx *ctx;
+    ngx_msec_t delay;
+    ssize_t n;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_websocket_stat_module);
+    size = shape_budget(r, ctx, 1, size, &delay);
+    if (delay) {
+        return shape_defer(c, ctx, 1, delay);
+    }
+    // a read that held nothing but pongs must not look like end of stream,
+    // so read on until there is data or the socket says NGX_AGAIN
+    do {
+        n = orig_recv(c, buf, size);
+        if (n <= 0) {
+            return n;
+        }
+        ctx->last_activity = ngx_current_msec;
+        ctx->pings_missed = 0;
+        n = count_received(r, ctx, buf, n);
+    } while (n == 0);
 
     return n;
 }
@@ -393,6 +3622,24 @@ ngx_http_websocket_stat_header_filter(ngx_http_request_t *r)
     return ngx_http_next_header_filter(r);
 }
 
+// Values stay valid for the lifetime of the request, so only pointers are kept.
+static void
+capture_core_vars(ngx_http_request_t *r, ngx_http_websocket_stat_ctx *ctx)
+{
+    ngx_http_websocket_main_conf_t *conf;
+    ngx_http_variable_value_t *vv;
+    ngx_uint_t i;
+    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
+    for (i = 0; i < CORE_VARS_COUNT; i++) {
+        vv = ngx_http_get_indexed_variable(r, conf->core_var_index[i]);
+        if (vv == NULL || vv->not_found) {
+            continue;
+        }
+        ctx->core_vars[i].data = vv->data;
+        ctx->core_vars[i].len = vv->len;
+    }
+}
+
 static ngx_int_t
 ngx_http_websocket_stat_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
@@ -402,6 +3649,7 @@ ngx_http_websocket_stat_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_http_websocket_stat_ctx *ctx;
     ctx = ngx_http_get_module_ctx(r, ngx_http_websocket_stat_module);
     template_ctx_s template_ctx;
+    ngx_memzero(&template_ctx, sizeof(template_ctx));
     template_ctx.ws_ctx = ctx;
 
     if (r->upstream->upgrade) {
@@ -411,215 +3659,242 @@ ngx_http_websocket_stat_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             if (ctx == NULL) {
                 return NGX_HTTP_INTERNAL_SERVER_ERROR;
             }
-            const char *request_id_str = get_core_var(r, "request_id");
-            ctx->connection_id.data = ngx_pcalloc(r->pool, UID_LENGTH + 1);
-            ctx->connection_id.len = UID_LENGTH;
-            memcpy(ctx->connection_id.data, request_id_str, UID_LENGTH + 1);
+            capture_core_vars(r, ctx);
+            ctx->connection_id = ctx->core_vars[CORE_VAR_REQUEST_ID];
+            sample_connection(r, ctx);
+            ngx_uint_t headers = template_http_headers_count();
+            if (headers) {
+                ctx->http_headers =
+                    ngx_pcalloc(r->pool, headers * sizeof(ngx_str_t));
+                if (ctx->http_headers == NULL) {
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+                template_resolve_http_headers(r, ctx->http_headers);
+            }
+            if (open_zones(r, ctx) != NGX_OK ||
+                ctx_init(r, ctx) != NGX_OK) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
 
-            ws_do_log(log_open_template, r, &template_ctx);
             ngx_http_set_ctx(r, ctx, ngx_http_websocket_stat_module);
             orig_recv = r->connection->recv;
             r->connection->recv = my_recv;
             orig_send = r->connection->send;
             r->connection->send = my_send;
-            ngx_atomic_fetch_add(ngx_websocket_stat_active, 1);
-            ctx->ws_conn_start_time = ngx_time();
-        } else {
-          if(!ngx_atomic_cmp_set(ngx_websocket_stat_active, 0, 0)){
-              ngx_atomic_fetch_add(ngx_websocket_stat_active, -1);
-              ws_do_log(log_close_template, r, &template_ctx);
+            reservation_t *res = get_reservation(r);
+            if (res == NULL || reserve_connection(r, res, 0) != NGX_OK) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
             }
+            ctx->ws_conn_start_time = ngx_time();
+            template_ctx.ws_ctx = ctx;
+            if (sample_event(r, ctx))
+                ws_do_log(log_open_template, r, &template_ctx);
+        } else if (ctx && !ctx->closed) {
+            count_close(ctx);
+            if (sample_event(r, ctx))
+                ws_do_log(log_close_template, r, &template_ctx);
         }
     }
 
     return ngx_http_next_body_filter(r, in);
 }
 
-char buff[TEMPLATE_BUFF_SIZE];
-
-const char *
-ws_packet_type(ngx_http_request_t *r, void *data)
+u_char *
+ws_packet_type(ngx_http_request_t *r, void *data, u_char *buf, u_char *last)
 {
     template_ctx_s *ctx = data;
-    ngx_frame_counter_t *frame_cntr = &(ctx->ws_ctx->frame_counter);
-    if (!ctx || !frame_cntr)
-        return UNKNOWN_VAR;
-    sprintf(buff, "%d", frame_cntr->current_frame_type);
-    return buff;
+    if (!ctx || !ctx->ws_ctx)
+        return template_copy_str(buf, last, UNKNOWN_VAR);
+    return template_uint(buf, last,
+                         ctx->ws_ctx->frame_counter[ctx->from_client]
+                             .current_frame_type);
 }
 
-const char *
-ws_packet_size(ngx_http_request_t *r, void *data)
+u_char *
+ws_packet_size(ngx_http_request_t *r, void *data, u_char *buf, u_char *last)
 {
     template_ctx_s *ctx = data;
-    ngx_frame_counter_t *frame_cntr = &ctx->ws_ctx->frame_counter;
-    if (!ctx || !frame_cntr)
-        return UNKNOWN_VAR;
-    sprintf(buff, "%lu", frame_cntr->current_payload_size);
-    return (char *)buff;
+    if (!ctx || !ctx->ws_ctx)
+        return template_copy_str(buf, last, UNKNOWN_VAR);
+    return template_uint(buf, last,
+                         ctx->ws_ctx->frame_counter[ctx->from_client]
+                             .current_payload_size);
 }
 
-const char *
-ws_packet_full_size(ngx_http_request_t *r, void *data)
+u_char *
+ws_packet_full_size(ngx_http_request_t *r, void *data, u_char *buf,
+                    u_char *last)
 {
     template_ctx_s *ctx = data;
-    ngx_frame_counter_t *frame_cntr = &ctx->ws_ctx->frame_counter;
-    if (!ctx || !frame_cntr)
-        return UNKNOWN_VAR;
-    sprintf(buff, "%lu", ctx->pending_size);
-    return (char *)buff;
-}
-
-u_char mask_buff[TEMPLATE_BUFF_SIZE];
-u_char *unmask(u_char *mask, u_char *s, size_t size) {
-	u_char *p = mask_buff;
-	for (size_t i = 0; i < size; i++) {
-		p[i] = s[i] ^ mask[i % 4];
-	}
-	p[size] = '\0';
-	return mask_buff;
+    if (!ctx || !ctx->ws_ctx)
+        return template_copy_str(buf, last, UNKNOWN_VAR);
+    return template_uint(buf, last, ctx->pending_size);
 }
 
-const char *
-ws_packet_full_content(ngx_http_request_t *r, void *data)
+u_char *
+ws_packet_full_content(ngx_http_request_t *r, void *data, u_char *buf,
+                       u_char *last)
 {
     template_ctx_s *ctx = data;
-    ngx_frame_counter_t *frame_cntr = &ctx->ws_ctx->frame_counter;
-    if (!ctx || !frame_cntr)
-        return UNKNOWN_VAR;
-    if (ctx->pending_size == 0)
-        return "";
-    u_char *buf = ctx->buf;
-    size_t offset = 0;
-    u_char *mask = (u_char *)"\0\0\0\0";
-    if ((buf[1] & 0x7f) == 126) { // PAYLOAD_LEN_LARGE
-        offset = 2;
-    } else if ((buf[1] & 0x7f) == 127) { // PAYLOAD_LEN_HUGE
-        offset = 8;
-    }
-    if (buf[1] & 0x80) { // mask
-        mask = buf + 2 + offset;
-	offset += 4;
-    }
-    snprintf(buff,
-        ctx->pending_size - 2 - offset + 1, // includes NULL
-        "%s",
-        unmask(mask, buf + 2 + offset, // 2 (HEADER + PAYLOAD_LEN)
-               ctx->pending_size - 2 - offset));
-    return (char *)buff;
-}
-
-const char *
-ws_packet_source(ngx_http_request_t *r, void *data)
+    if (!ctx || !ctx->ws_ctx)
+        return template_copy_str(buf, last, UNKNOWN_VAR);
+    if (ctx->payload == NULL)
+        return buf;
+    // unmask straight into the log buffer
+    ngx_frame_counter_t *fc = &ctx->ws_ctx->frame_counter[ctx->from_client];
+    size_t size = ctx->payload_size;
+    if (buf <= last && size <= (size_t)(last - buf)) {
+        if (fc->payload_masked) {
+            frame_counter_unmask(buf, ctx->payload, size, fc->mask, 0);
+        } else {
+            ngx_memcpy(buf, ctx->payload, size);
+        }
+    }
+    return buf + size;
+}
+
+u_char *
+ws_packet_source(ngx_http_request_t *r, void *data, u_char *buf, u_char *last)
 {
     template_ctx_s *ctx = data;
     if (!ctx)
-        return UNKNOWN_VAR;
+        return template_copy_str(buf, last, UNKNOWN_VAR);
     if (ctx->from_client)
-        return "client";
-    return "upstream";
+        return template_copy_str(buf, last, "client");
+    return template_copy_str(buf, last, "upstream");
 }
 
-const char *
-get_core_var(ngx_http_request_t *r, const char *variable)
+u_char *
+ws_extensions(ngx_http_request_t *r, void *data, u_char *buf, u_char *last)
 {
-    ngx_int_t key = 0;
-    ngx_http_variable_value_t *vv;
-    ngx_str_t var;
-    var.data = (u_char *)variable;
-    var.len = strlen(variable);
-    while (*variable != '\0')
-        key = ngx_hash(key, *(variable++));
-
-    vv = ngx_http_get_variable(r, &var, key);
-    memcpy(buff, vv->data, vv->len);
-    buff[vv->len] = '\0';
-    return buff;
+    template_ctx_s *ctx = data;
+    if (!ctx || !ctx->ws_ctx)
+        return template_copy_str(buf, last, UNKNOWN_VAR);
+    return template_copy(buf, last, ctx->ws_ctx->extensions.data,
+                         ctx->ws_ctx->extensions.len);
 }
 
-const char *
-ws_connection_age(ngx_http_request_t *r, void *data)
+u_char *
+ws_compressed(ngx_http_request_t *r, void *data, u_char *buf, u_char *last)
 {
     template_ctx_s *ctx = data;
     if (!ctx || !ctx->ws_ctx)
-        return UNKNOWN_VAR;
-    sprintf(buff, "%lu", ngx_time() - ctx->ws_ctx->ws_conn_start_time);
-
-    return (char *)buff;
+        return template_copy_str(buf, last, UNKNOWN_VAR);
+    ngx_http_websocket_stat_ctx *ws = ctx->ws_ctx;
+    // control frames are never compressed
+    int compressed =
+        ws->compressed[ctx->from_client] &&
+        ws->frame_counter[ctx->from_client].current_frame_type < CLOSE;
+    return template_copy_str(buf, last, compressed ? "1" : "0");
 }
 
-const char *
-local_time(ngx_http_request_t *r, void *data)
+u_char *
+ws_connection_age(ngx_http_request_t *r, void *data, u_char *buf,
+                  u_char *last)
 {
-    return memcpy(buff, ngx_cached_http_time.data, ngx_cached_http_time.len);
+    template_ctx_s *ctx = data;
+    if (!ctx || !ctx->ws_ctx)
+        return template_copy_str(buf, last, UNKNOWN_VAR);
+    return template_uint(buf, last,
+                         ngx_time() - ctx->ws_ctx->ws_conn_start_time);
 }
 
-const char *
-remote_ip(ngx_http_request_t *r, void *data)
+u_char *
+local_time(ngx_http_request_t *r, void *data, u_char *buf, u_char *last)
 {
-    memcpy(buff, r->connection->addr_text.data, r->connection->addr_text.len);
-    buff[r->connection->addr_text.len] = '\0';
+    return template_copy(buf, last, ngx_cached_http_time.data,
+                         ngx_cached_http_time.len);
+}
 
-    return buff;
+u_char *
+remote_ip(ngx_http_request_t *r, void *data, u_char *buf, u_char *last)
+{
+    return template_copy(buf, last, r->connection->addr_text.data,
+                         r->connection->addr_text.len);
 }
 
-const char *
-request_id(ngx_http_request_t *r, void *data)
+u_char *
+request_id(ngx_http_request_t *r, void *data, u_char *buf, u_char *last)
 {
     template_ctx_s *ctx = data;
     if (!ctx || !ctx->ws_ctx)
-        return UNKNOWN_VAR;
-    return (const char *)ctx->ws_ctx->connection_id.data;
+        return template_copy_str(buf, last, UNKNOWN_VAR);
+    return template_copy(buf, last, ctx->ws_ctx->connection_id.data,
+                         ctx->ws_ctx->connection_id.len);
 }
 
-const char *
-upstream_addr(ngx_http_request_t *r, void *data)
+u_char *
+upstream_addr(ngx_http_request_t *r, void *data, u_char *buf, u_char *last)
 {
     template_ctx_s *ctx = data;
     if (!ctx || !ctx->ws_ctx)
-        return UNKNOWN_VAR;
-    if (r->upstream_states == NULL || r->upstream_states->nelts == 0)
-        return UNKNOWN_VAR;
-    ngx_http_upstream_state_t *state;
-    state = r->upstream_states->elts;
-    return (const char *)state->peer->data;
+        return template_copy_str(buf, last, UNKNOWN_VAR);
+    ngx_str_t peer;
+    upstream_peer_name(r, &peer);
+    if (peer.data == NULL)
+        return template_copy_str(buf, last, UNKNOWN_VAR);
+    return template_copy(buf, last, peer.data, peer.len);
+}
+
+u_char *
+http_header_var(ngx_http_request_t *r, void *data, ngx_uint_t index,
+                u_char *buf, u_char *last)
+{
+    template_ctx_s *ctx = data;
+    if (!ctx || !ctx->ws_ctx || !ctx->ws_ctx->http_headers ||
+        !ctx->ws_ctx->http_headers[index].data)
+        return template_copy_str(buf, last, UNKNOWN_VAR);
+    return template_copy(buf, last, ctx->ws_ctx->http_headers[index].data,
+                         ctx->ws_ctx->http_headers[index].len);
+}
+
+static u_char *
+copy_core_var(void *data, core_var_id id, u_char *buf, u_char *last)
+{
+    template_ctx_s *ctx = data;
+    if (!ctx || !ctx->ws_ctx || !ctx->ws_ctx->core_vars[id].data)
+        return template_copy_str(buf, last, UNKNOWN_VAR);
+    return template_copy(buf, last, ctx->ws_ctx->core_vars[id].data,
+                         ctx->ws_ctx->core_vars[id].len);
 }
 
 #define GEN_CORE_GET_FUNC(fname, var)                                          \
-    const char *fname(ngx_http_request_t *r, void *data)                       \
+    u_char *fname(ngx_http_request_t *r, void *data, u_char *buf,              \
+                  u_char *last)                                                \
     {                                                                          \
-        return get_core_var(r, var);                                           \
+        return copy_core_var(data, var, buf, last);                            \
     }
 
-GEN_CORE_GET_FUNC(request, "request")
-GEN_CORE_GET_FUNC(uri, "uri")
-GEN_CORE_GET_FUNC(remote_user, "remote_user")
-GEN_CORE_GET_FUNC(remote_addr, "remote_addr")
-GEN_CORE_GET_FUNC(remote_port, "remote_port")
-GEN_CORE_GET_FUNC(server_addr, "server_addr")
-GEN_CORE_GET_FUNC(server_port, "server_port")
+GEN_CORE_GET_FUNC(request, CORE_VAR_REQUEST)
+GEN_CORE_GET_FUNC(uri, CORE_VAR_URI)
+GEN_CORE_GET_FUNC(remote_user, CORE_VAR_REMOTE_USER)
+GEN_CORE_GET_FUNC(remote_addr, CORE_VAR_REMOTE_ADDR)
+GEN_CORE_GET_FUNC(remote_port, CORE_VAR_REMOTE_PORT)
+GEN_CORE_GET_FUNC(server_addr, CORE_VAR_SERVER_ADDR)
+GEN_CORE_GET_FUNC(server_port, CORE_VAR_SERVER_PORT)
 
 const template_variable variables[] = {
-    {VAR_NAME("$ws_opcode"), sizeof("ping") - 1, ws_packet_type},
-    {VAR_NAME("$ws_payload_size"), NGX_SIZE_T_LEN, ws_packet_size},
-    {VAR_NAME("$ws_payload_full_size"), NGX_SIZE_T_LEN, ws_packet_full_size},
-    {VAR_NAME("$ws_payload_full_content"), TEMPLATE_BUFF_SIZE, ws_packet_full_content},
-    {VAR_NAME("$ws_packet_source"), sizeof("upstream") - 1, ws_packet_source},
-    {VAR_NAME("$ws_conn_age"), NGX_SIZE_T_LEN, ws_connection_age},
-    {VAR_NAME("$time_local"), sizeof("Mon, 23 Oct 2017 11:27:42 GMT") - 1,
-     local_time},
-    {VAR_NAME("$upstream_addr"), 60, upstream_addr},
-    {VAR_NAME("$request"), 60, request},
-    {VAR_NAME("$uri"), 60, uri},
-    {VAR_NAME("$request_id"), UID_LENGTH, request_id},
-    {VAR_NAME("$remote_user"), 60, remote_user},
-    {VAR_NAME("$remote_addr"), 60, remote_addr},
-    {VAR_NAME("$remote_port"), 60, remote_port},
-    {VAR_NAME("$server_addr"), 60, server_addr},
-    {VAR_NAME("$server_port"), 60, server_port},
+    {VAR_NAME("$ws_opcode"), ws_packet_type},
+    {VAR_NAME("$ws_payload_size"), ws_packet_size},
+    {VAR_NAME("$ws_payload_full_size"), ws_packet_full_size},
+    {VAR_NAME("$ws_payload_full_content"), ws_packet_full_content},
+    {VAR_NAME("$ws_packet_source"), ws_packet_source},
+    {VAR_NAME("$ws_conn_age"), ws_connection_age},
+    {VAR_NAME("$ws_extensions"), ws_extensions},
+    {VAR_NAME("$ws_compressed"), ws_compressed},
+    {VAR_NAME("$time_local"), local_time},
+    {VAR_NAME("$upstream_addr"), upstream_addr},
+    {VAR_NAME("$request"), request},
+    {VAR_NAME("$uri"), uri},
+    {VAR_NAME("$request_id"), request_id},
+    {VAR_NAME("$remote_user"), remote_user},
+    {VAR_NAME("$remote_addr"), remote_addr},
+    {VAR_NAME("$remote_port"), remote_port},
+    {VAR_NAME("$server_addr"), server_addr},
+    {VAR_NAME("$server_port"), server_port},
     // TODO: Delete this since its duplicating $remote_add
-    {VAR_NAME("$remote_ip"), sizeof("000.000.000.000") - 1, remote_ip},
-    {NULL, 0, 0, NULL}};
+    {VAR_NAME("$remote_ip"), remote_ip},
+    {NULL, 0, NULL}};
 
 static void *
 ngx_http_websocket_stat_create_main_conf(ngx_conf_t *cf)
@@ -632,10 +3907,49 @@ ngx_http_websocket_stat_create_main_conf(ngx_conf_t *cf)
     }
     conf->max_ws_connections = -1;
     conf->max_ws_age = -1;
+    conf->sample_frame = 1;
+    conf->sample_connection = 1;
+
+    // globals below are allocated from the previous cycle's pool on reload
+    ws_log = NULL;
+    log_template = NULL;
+    log_open_template = NULL;
+    log_close_template = NULL;
+    template_reset_http_headers();
+    ws_tap_reset();
+
+    return conf;
+}
+
+static void *
+ngx_http_websocket_stat_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_websocket_loc_conf_t *conf;
 
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_websocket_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+    conf->format = NGX_CONF_UNSET_UINT;
+    conf->zone = NGX_CONF_UNSET_PTR;
+    conf->connections = NGX_CONF_UNSET;
     return conf;
 }
 
+static char *
+ngx_http_websocket_stat_merge_loc_conf(ngx_conf_t *cf, void *parent,
+                                       void *child)
+{
+    ngx_http_websocket_loc_conf_t *prev = parent;
+    ngx_http_websocket_loc_conf_t *conf = child;
+
+    ngx_conf_merge_uint_value(conf->format, prev->format,
+                              WS_STAT_FORMAT_TEXT);
+    ngx_conf_merge_ptr_value(conf->zone, prev->zone, NULL);
+    ngx_conf_merge_value(conf->connections, prev->connections, 0);
+    return NGX_CONF_OK;
+}
+
 static char *
 ngx_http_ws_log_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -646,16 +3960,19 @@ ngx_http_ws_log_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
     if (cf->args->nelts == 2) {
         log_template =
-            compile_template((char *)args[1].data, variables, cf->pool);
+            compile_template((char *)args[1].data, variables, http_header_var,
+                             cf->pool);
         return NGX_CONF_OK;
     }
     if (strcmp((char *)args[1].data, "close") == 0) {
         log_close_template =
-            compile_template((char *)args[2].data, variables, cf->pool);
+            compile_template((char *)args[2].data, variables, http_header_var,
+                             cf->pool);
         return NGX_CONF_OK;
     } else if (strcmp((char *)args[1].data, "open") == 0) {
         log_open_template =
-            compile_template((char *)args[2].data, variables, cf->pool);
+            compile_template((char *)args[2].data, variables, http_header_var,
+                             cf->pool);
         return NGX_CONF_OK;
     } else {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
@@ -665,47 +3982,116 @@ ngx_http_ws_log_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 }
 
-static void
-allocate_counters()
+// Workers of the previous configuration keep their own mapping of its
+// counters, so the master lets go of it once the new one is in place.
+static ngx_shm_t counters_shm;
+
+static ngx_int_t
+allocate_counters(ngx_uint_t workers)
 {
-    const int cl = 128; // cache line size
-    const int variables = 7;
+    const int cl = STAT_CACHE_LINE;
     ngx_shm_t shm;
-    shm.size = cl * variables; //
+    stat_nshards = workers;
+    stat_shard_size = ngx_align(sizeof(ngx_http_websocket_stat_shard_t), cl);
+    // first cache line holds the active connections counter
+    shm.size = cl + stat_nshards * stat_shard_size;
     shm.log = ngx_cycle->log;
     ngx_str_set(&shm.name, "websocket_stat_shared_zone");
     if (ngx_shm_alloc(&shm) != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
                       "Failed to allocate shared memory");
-        return;
+        return NGX_ERROR;
+    }
+    if (counters_shm.addr) {
+        ngx_shm_free(&counters_shm);
     }
-    int var_counter = 0;
-    frames_in.frames = (ngx_atomic_t *)(shm.addr + (var_counter++) * cl);
-    frames_in.total_payload_size =
-        (ngx_atomic_t *)(shm.addr + (var_counter++) * cl);
-    frames_in.total_size = (ngx_atomic_t *)(shm.addr + (var_counter++) * cl);
-    frames_out.frames = (ngx_atomic_t *)(shm.addr + (var_counter++) * cl);
-    frames_out.total_payload_size =
-        (ngx_atomic_t *)(shm.addr + (var_counter++) * cl);
-    frames_out.total_size = (ngx_atomic_t *)(shm.addr + (var_counter++) * cl);
-    ngx_websocket_stat_active =
-        (ngx_atomic_t *)(shm.addr + (var_counter++) * cl);
-    assert(var_counter <= variables);
+    counters_shm = shm;
+    ngx_websocket_stat_active = (ngx_atomic_t *)shm.addr;
+    stat_shards = shm.addr + cl;
+    // in single process mode there is no worker index
+    stat_shard = get_shard(0);
+    return NGX_OK;
 }
 
-static ngx_table_elt_t *
-find_header_in(ngx_http_request_t *r, const char *header_name)
+static ngx_int_t
+ngx_http_websocket_stat_init_module(ngx_cycle_t *cycle)
 {
-    if (!r) {
-        return NULL;
+    ngx_core_conf_t *ccf;
+    ngx_http_websocket_main_conf_t *conf;
+    ngx_uint_t workers;
+    ccf = (ngx_core_conf_t *)ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+    frame_counter_unmask_init();
+    workers = ccf->worker_processes > 0 ? ccf->worker_processes : 1;
+
+    conf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_websocket_stat_module);
+    // nginx -t must not replace the file the running workers write to
+    if (conf && conf->tap_path.len && !ngx_test_config &&
+        ws_tap_create(cycle, &conf->tap_path, workers, conf->tap_records) !=
+            NGX_OK) {
+        return NGX_ERROR;
+    }
+    return allocate_counters(workers);
+}
+
+static ngx_int_t
+ngx_http_websocket_stat_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_websocket_main_conf_t *conf;
+    stat_shard = get_shard(ngx_worker % stat_nshards);
+    ngx_queue_init(&worker_connections);
+    ws_tap_attach(ngx_worker);
+    if (ws_log && ws_log->syslog) {
+        ws_log->syslog->sent = &stat_shard->log_sent;
+        ws_log->syslog->dropped = &stat_shard->log_dropped;
+    }
+
+    conf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_websocket_stat_module);
+    if (conf && conf->registry) {
+        admin_close_requests = conf->registry->sh->close_requests;
+        admin_check_event.handler = admin_check;
+        admin_check_event.data = conf;
+        admin_check_event.log = cycle->log;
+        admin_check_event.cancelable = 1;
+        ngx_add_timer(&admin_check_event, WS_ADMIN_CHECK_INTERVAL);
+    }
+    if (conf && conf->drain) {
+        drain_sh = conf->drain_sh;
+        drain_event.handler = drain_expire;
+        drain_event.data = conf;
+        drain_event.log = cycle->log;
+        ngx_add_timer(&drain_event, WS_DRAIN_CHECK_INTERVAL);
+    }
+    return NGX_OK;
+}
+
+static void
+ngx_http_websocket_stat_exit_process(ngx_cycle_t *cycle)
+{
+    if (ws_log) {
+        ws_log_flush(ws_log);
+    }
+    // connections still open when the worker goes are not draining anymore
+    if (drain_reported) {
+        ngx_atomic_fetch_add(&drain_sh->draining,
+                             -(ngx_atomic_int_t)drain_reported);
+        drain_reported = 0;
     }
+}
+
+static ngx_table_elt_t *
+find_header(ngx_list_t *headers, const char *header_name)
+{
     ngx_list_part_t *part;
     ngx_table_elt_t *header;
-    part = &r->headers_in.headers.part;
+    part = &headers->part;
     header = part->elts;
     int i = part->nelts - 1;
     while (1) {
-        if (strcasecmp((char *)header[i].key.data, header_name) == 0) {
+        // deleted response headers have no hash
+        if (i >= 0 && header[i].hash &&
+            strcasecmp((char *)header[i].key.data, header_name) == 0) {
             return &header[i];
         }
         if (--i < 0) {
@@ -719,6 +4105,15 @@ find_header_in(ngx_http_request_t *r, const char *header_name)
     return NULL;
 }
 
+static ngx_table_elt_t *
+find_header_in(ngx_http_request_t *r, const char *header_name)
+{
+    if (!r) {
+        return NULL;
+    }
+    return find_header(&r->headers_in.headers, header_name);
+}
+
 static void
 send_close_packet(ngx_connection_t *connection, int status, const char *reason)
 {
@@ -765,39 +4160,115 @@ complete_ws_handshake(ngx_connection_t *connection, const char *ws_key)
     connection->send(connection, (unsigned char *)resp, strlen(resp));
 }
 
+// Resumes the phases once the ws_limit_rate delay is over. The access
+// handler runs again and finds the request already accounted.
+static void
+delay_connection(ngx_http_request_t *r)
+{
+    ngx_event_t *wev = r->connection->write;
+    if (wev->delayed && !wev->timedout) {
+        if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        }
+        return;
+    }
+    wev->delayed = 0;
+    wev->timedout = 0;
+    if (ngx_handle_read_event(r->connection->read, 0) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+    r->read_event_handler = ngx_http_block_reading;
+    r->write_event_handler = ngx_http_core_run_phases;
+    ngx_http_core_run_phases(r);
+}
+
+static ngx_int_t
+reject_connection(ngx_http_request_t *r)
+{
+    ngx_table_elt_t *hdr = find_header_in(r, kWsKey);
+    if (!hdr || hdr->value.len != KEY_SIZE) {
+        // Request should contain a valid Sec-Webscoket-Key header.
+        return NGX_HTTP_BAD_REQUEST;
+    }
+    complete_ws_handshake(r->connection, (const char *)hdr->value.data);
+    send_close_packet(r->connection, 1013, "Try Again Later");
+    return NGX_ERROR;
+}
+
 static ngx_int_t
 ngx_http_websocket_request_handler(ngx_http_request_t *r)
 {
-    ngx_http_websocket_main_conf_t *conf;
-    conf = ngx_http_get_module_main_conf(r, ngx_http_websocket_stat_module);
-    if (conf == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    ngx_table_elt_t *upgrade_hdr = find_header_in(r, "Upgrade");
+    if (!upgrade_hdr ||
+        strcasecmp((char *)upgrade_hdr->value.data, "websocket") != 0) {
+        // This is not a websocket conenction, allow it.
+        return NGX_OK;
     }
 
-    if (conf->max_ws_connections > 0 &&
-        conf->max_ws_connections == (int)*ngx_websocket_stat_active) {
-        ngx_table_elt_t *upgrade_hdr = find_header_in(r, "Upgrade");
-        if (!upgrade_hdr ||
-            strcasecmp((char *)upgrade_hdr->value.data, "websocket") != 0) {
-            // This is not a websocket conenction, allow it.
-            return NGX_OK;
+    reservation_t *res = get_reservation(r);
+    if (res == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    if (!res->rated) {
+        ngx_msec_t delay;
+        switch (rate_limit_connection(r, res, &delay)) {
+        case NGX_OK:
+            break;
+        case NGX_BUSY:
+            return reject_connection(r);
+        default:
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
-        ngx_table_elt_t *hdr = find_header_in(r, kWsKey);
-        if (!hdr || hdr->value.len != KEY_SIZE) {
-            // Request should contain a valid Sec-Webscoket-Key header.
-            return NGX_HTTP_BAD_REQUEST;
+        if (delay) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "delaying websocket upgrade for %Mms", delay);
+            r->read_event_handler = ngx_http_test_reading;
+            r->write_event_handler = delay_connection;
+            r->connection->write->delayed = 1;
+            ngx_add_timer(r->connection->write, delay);
+            return NGX_AGAIN;
         }
-        complete_ws_handshake(r->connection, (const char *)hdr->value.data);
-        send_close_packet(r->connection, 1013, "Try Again Later");
-        return NGX_ERROR;
     }
-    return NGX_OK;
+
+    switch (reserve_connection(r, res, 1)) {
+    case NGX_OK:
+        return NGX_OK;
+    case NGX_BUSY:
+        return reject_connection(r);
+    default:
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 }
 
 static ngx_int_t
 ngx_http_websocket_stat_init(ngx_conf_t *cf)
 {
-    allocate_counters();
+    ngx_http_websocket_main_conf_t *conf;
+    ngx_uint_t i;
+    conf = ngx_http_conf_get_module_main_conf(cf,
+                                              ngx_http_websocket_stat_module);
+    for (i = 0; i < CORE_VARS_COUNT; i++) {
+        conf->core_var_index[i] =
+            ngx_http_get_variable_index(cf, &core_var_names[i]);
+        if (conf->core_var_index[i] == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    // ws_stat zone= finds any zone of this module by name, and only stats
+    // zones can be read out
+    if (conf->stat_zones) {
+        ngx_shm_zone_t **zones = conf->stat_zones->elts;
+        for (i = 0; i < conf->stat_zones->nelts; i++) {
+            if (zones[i]->init != ws_zone_init) {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "zone \"%V\" is not a ws_stat_zone",
+                              &zones[i]->shm.name);
+                return NGX_ERROR;
+            }
+        }
+    }
 
     ngx_http_next_header_filter = ngx_http_top_header_filter;
     ngx_http_top_header_filter = ngx_http_websocket_stat_header_filter;
@@ -806,16 +4277,18 @@ ngx_http_websocket_stat_init(ngx_conf_t *cf)
     ngx_http_top_body_filter = ngx_http_websocket_stat_body_filter;
 
     if (!log_template) {
-        log_template =
-            compile_template(default_log_template_str, variables, cf->pool);
+        log_template = compile_template(default_log_template_str, variables,
+                                        http_header_var, cf->pool);
     }
     if (!log_open_template) {
         log_open_template = compile_template(default_open_log_template_str,
-                                             variables, cf->pool);
+                                             variables, http_header_var,
+                                             cf->pool);
     }
     if (!log_close_template) {
         log_close_template = compile_template(default_close_log_template_str,
-                                              variables, cf->pool);
+                                              variables, http_header_var,
+                                              cf->pool);
     }
 
     ngx_http_handler_pt *h;
@@ -0,0 +1,288 @@
+#include "ngx_http_websocket_stat_registry.h"
+
+size_t
+ws_registry_size(ngx_uint_t nslots)
+{
+    return offsetof(ngx_http_websocket_registry_sh_t, slots) +
+           nslots * sizeof(ngx_http_websocket_registry_slot_t);
+}
+
+// The zone is created without a slab pool, the table is laid out right at
+// its start.
+ngx_int_t
+ws_registry_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_websocket_registry_t *oregistry = data;
+    ngx_http_websocket_registry_t *registry = shm_zone->data;
+
+    registry->sh = (ngx_http_websocket_registry_sh_t *)shm_zone->shm.addr;
+    if (oregistry || shm_zone->shm.exists) {
+        return NGX_OK;
+    }
+    registry->sh->nslots = registry->nslots;
+    return NGX_OK;
+}
+
+static void
+copy_field(u_char *dst, u_char *len, size_t max, ngx_str_t *src)
+{
+    *len = src ? ngx_min(src->len, max) : 0;
+    if (*len) {
+        ngx_memcpy(dst, src->data, *len);
+    }
+}
+
+ngx_http_websocket_registry_slot_t *
+ws_registry_add(ngx_http_websocket_registry_t *registry, ngx_str_t *id,
+                ngx_str_t *addr, ngx_str_t *uri, ngx_str_t *upstream)
+{
+    ngx_http_websocket_registry_sh_t *sh = registry->sh;
+    ngx_http_websocket_registry_slot_t *slot;
+    ngx_uint_t i, start;
+
+    // workers start in different places and move on, so they rarely race
+    // for the same free slot
+    start = ngx_atomic_fetch_add(&sh->next, 1);
+    for (i = 0; i < sh->nslots; i++) {
+        slot = &sh->slots[(start + i) % sh->nslots];
+        if (slot->state == WS_SLOT_FREE &&
+            ngx_atomic_cmp_set(&slot->state, WS_SLOT_FREE, WS_SLOT_BUSY)) {
+            goto found;
+        }
+    }
+    ngx_atomic_fetch_add(&sh->overflow, 1);
+    return NULL;
+
+found:
+    slot->pid = ngx_pid;
+    slot->start = ngx_time();
+    ngx_memzero(slot->traffic, sizeof(slot->traffic));
+    copy_field(slot->id, &slot->id_len, WS_REGISTRY_ID_LEN, id);
+    copy_field(slot->addr, &slot->addr_len, WS_REGISTRY_ADDR_LEN, addr);
+    copy_field(slot->uri, &slot->uri_len, WS_REGISTRY_URI_LEN, uri);
+    copy_field(slot->upstream, &slot->upstream_len, WS_REGISTRY_UPSTREAM_LEN,
+               upstream);
+    slot->generation++;
+    ngx_memory_barrier();
+    slot->state = WS_SLOT_LIVE;
+    return slot;
+}
+
+void
+ws_registry_remove(ngx_http_websocket_registry_slot_t *slot)
+{
+    slot->state = WS_SLOT_BUSY;
+    slot->generation++;
+    ngx_memory_barrier();
+    slot->state = WS_SLOT_FREE;
+}
+
+typedef struct {
+    uint64_t value;
+    ngx_uint_t slot;
+} top_item_t;
+
+static uint64_t
+slot_value(ngx_http_websocket_registry_slot_t *slot,
+           ngx_http_websocket_registry_order_t order, time_t now)
+{
+    switch (order) {
+    case WS_REGISTRY_BY_FRAMES:
+        return slot->traffic[0].frames + slot->traffic[1].frames;
+    case WS_REGISTRY_BY_AGE:
+        return now > slot->start ? now - slot->start : 0;
+    default:
+        return slot->traffic[0].bytes + slot->traffic[1].bytes;
+    }
+}
+
+// Min-heap of the n biggest values seen so far, the smallest on top.
+static void
+heap_sift_down(top_item_t *heap, ngx_uint_t n, ngx_uint_t i)
+{
+    top_item_t item = heap[i];
+    ngx_uint_t child;
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n && heap[child + 1].value < heap[child].value) {
+            child++;
+        }
+        if (item.value <= heap[child].value) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = item;
+}
+
+static void
+heap_sift_up(top_item_t *heap, ngx_uint_t i)
+{
+    top_item_t item = heap[i];
+    while (i > 0 && heap[(i - 1) / 2].value > item.value) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = item;
+}
+
+// Copies a live slot. Returns NGX_DECLINED if it was freed or reused while
+// being read.
+static ngx_int_t
+read_slot(ngx_http_websocket_registry_slot_t *slot,
+          ngx_http_websocket_registry_slot_t *copy)
+{
+    ngx_atomic_uint_t generation = slot->generation;
+    ngx_memory_barrier();
+    if (slot->state != WS_SLOT_LIVE) {
+        return NGX_DECLINED;
+    }
+    ngx_memcpy(copy, slot, sizeof(*copy));
+    ngx_memory_barrier();
+    if (slot->state != WS_SLOT_LIVE || slot->generation != generation) {
+        return NGX_DECLINED;
+    }
+    return NGX_OK;
+}
+
+// A worker that crashed never released its slots. They are found among the
+// oldest connections and freed when they come up in a readout.
+static ngx_int_t
+reclaim_orphan(ngx_http_websocket_registry_slot_t *slot,
+               ngx_http_websocket_registry_slot_t *copy)
+{
+    if (copy->pid == ngx_pid || kill(copy->pid, 0) == 0 ||
+        ngx_errno != NGX_ESRCH) {
+        return NGX_DECLINED;
+    }
+    if (slot->generation != copy->generation ||
+        !ngx_atomic_cmp_set(&slot->state, WS_SLOT_LIVE, WS_SLOT_BUSY)) {
+        return NGX_DECLINED;
+    }
+    ws_registry_remove(slot);
+    return NGX_OK;
+}
+
+ngx_array_t *
+ws_registry_top(ngx_http_websocket_registry_t *registry, ngx_pool_t *pool,
+                ngx_http_websocket_registry_order_t order, ngx_uint_t n)
+{
+    ngx_http_websocket_registry_sh_t *sh = registry->sh;
+    ngx_http_websocket_registry_slot_t *slot, *copy;
+    ngx_uint_t i, j, size = 0;
+    ngx_array_t *result;
+    top_item_t *heap, item;
+    time_t now = ngx_time();
+
+    result = ngx_array_create(pool, n ? n : 1,
+                              sizeof(ngx_http_websocket_registry_slot_t));
+    if (result == NULL || n == 0) {
+        return result;
+    }
+    heap = ngx_palloc(pool, n * sizeof(top_item_t));
+    if (heap == NULL) {
+        return NULL;
+    }
+
+    // values are read racy, only the winners are copied consistently
+    for (i = 0; i < sh->nslots; i++) {
+        slot = &sh->slots[i];
+        if (slot->state != WS_SLOT_LIVE) {
+            continue;
+        }
+        item.value = slot_value(slot, order, now);
+        item.slot = i;
+        if (size < n) {
+            heap[size] = item;
+            heap_sift_up(heap, size++);
+        } else if (item.value > heap[0].value) {
+            heap[0] = item;
+            heap_sift_down(heap, n, 0);
+        }
+    }
+
+    if (size == 0) {
+        return result;
+    }
+    // popping the smallest first fills the result from its end
+    if (ngx_array_push_n(result, size) == NULL) {
+        return NULL;
+    }
+    copy = result->elts;
+    i = size;
+    while (size) {
+        item = heap[0];
+        heap[0] = heap[--size];
+        heap_sift_down(heap, size, 0);
+        slot = &sh->slots[item.slot];
+        if (read_slot(slot, &copy[--i]) != NGX_OK) {
+            copy[i].state = WS_SLOT_FREE;
+        } else if (reclaim_orphan(slot, &copy[i]) == NGX_OK) {
+            copy[i].state = WS_SLOT_FREE;
+        }
+    }
+
+    // drop the slots that went away while being copied
+    for (i = 0, j = 0; i < result->nelts; i++) {
+        if (copy[i].state == WS_SLOT_LIVE) {
+            copy[j++] = copy[i];
+        }
+    }
+    result->nelts = j;
+    return result;
+}
+
+static ngx_int_t
+match_field(u_char *field, u_char len, ngx_str_t *value, int prefix)
+{
+    if (value->len == 0) {
+        return 1;
+    }
+    if (len < value->len || (!prefix && len != value->len)) {
+        return 0;
+    }
+    return ngx_strncmp(field, value->data, value->len) == 0;
+}
+
+static ngx_int_t
+match_slot(ngx_http_websocket_registry_slot_t *slot,
+           ngx_http_websocket_registry_selector_t *selector)
+{
+    ngx_str_t *addr = &selector->addr;
+    if (!match_field(slot->id, slot->id_len, &selector->id, 0) ||
+        !match_field(slot->uri, slot->uri_len, &selector->uri, 1) ||
+        !match_field(slot->upstream, slot->upstream_len, &selector->upstream,
+                     0)) {
+        return 0;
+    }
+    // "10.0.0.1" matches "10.0.0.1:5000"
+    return match_field(slot->addr, slot->addr_len, addr, 0) ||
+           (match_field(slot->addr, slot->addr_len, addr, 1) &&
+            slot->addr[addr->len] == ':');
+}
+
+ngx_uint_t
+ws_registry_mark(ngx_http_websocket_registry_t *registry,
+                 ngx_http_websocket_registry_selector_t *selector)
+{
+    ngx_http_websocket_registry_sh_t *sh = registry->sh;
+    ngx_http_websocket_registry_slot_t *slot;
+    ngx_atomic_uint_t generation;
+    ngx_uint_t i, marked = 0;
+
+    for (i = 0; i < sh->nslots; i++) {
+        slot = &sh->slots[i];
+        generation = slot->generation;
+        ngx_memory_barrier();
+        if (slot->state != WS_SLOT_LIVE || !match_slot(slot, selector)) {
+            continue;
+        }
+        slot->close = generation;
+        marked++;
+    }
+    if (marked) {
+        ngx_memory_barrier();
+        ngx_atomic_fetch_add(&sh->close_requests, 1);
+    }
+    return marked;
+}
@@ -0,0 +1,97 @@
+#ifndef _NGX_HTTP_WEBSOCKET_REGISTRY
+#define _NGX_HTTP_WEBSOCKET_REGISTRY
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+// Longer values are cut.
+#define WS_REGISTRY_ID_LEN 40
+#define WS_REGISTRY_ADDR_LEN 64
+#define WS_REGISTRY_URI_LEN 128
+#define WS_REGISTRY_UPSTREAM_LEN 64
+
+#define WS_SLOT_FREE 0
+#define WS_SLOT_BUSY 1 // being filled or released
+#define WS_SLOT_LIVE 2
+
+typedef struct {
+    ngx_atomic_t frames;
+    ngx_atomic_t bytes;
+} ngx_http_websocket_registry_traffic_t;
+
+// One live connection. Only the worker owning the connection writes to it,
+// counters are plain adds. Readers copy it without locks and throw the copy
+// away if the generation changed meanwhile.
+typedef struct {
+    ngx_atomic_t state;
+    ngx_atomic_t generation;
+    // set to the generation to close it, so a mark never hits the next
+    // connection that takes the slot
+    ngx_atomic_t close;
+    ngx_pid_t pid;
+    time_t start;
+    ngx_http_websocket_registry_traffic_t traffic[2]; // indexed by from_client
+    u_char id_len;
+    u_char addr_len;
+    u_char uri_len;
+    u_char upstream_len;
+    u_char id[WS_REGISTRY_ID_LEN];
+    u_char addr[WS_REGISTRY_ADDR_LEN];
+    u_char uri[WS_REGISTRY_URI_LEN];
+    u_char upstream[WS_REGISTRY_UPSTREAM_LEN];
+} ngx_http_websocket_registry_slot_t;
+
+typedef struct {
+    ngx_uint_t nslots;
+    ngx_atomic_t next;           // where the search for a free slot starts
+    ngx_atomic_t overflow;       // connections that found the table full
+    ngx_atomic_t close_requests; // bumped when connections are marked
+    ngx_http_websocket_registry_slot_t slots[1];
+} ngx_http_websocket_registry_sh_t;
+
+typedef struct {
+    ngx_http_websocket_registry_sh_t *sh;
+    ngx_shm_zone_t *shm_zone;
+    ngx_uint_t nslots;
+} ngx_http_websocket_registry_t;
+
+typedef enum {
+    WS_REGISTRY_BY_BYTES,
+    WS_REGISTRY_BY_FRAMES,
+    WS_REGISTRY_BY_AGE
+} ngx_http_websocket_registry_order_t;
+
+// Connections matching all of the non-empty fields. Addresses match with or
+// without the port, the uri matches by prefix.
+typedef struct {
+    ngx_str_t id;
+    ngx_str_t addr;
+    ngx_str_t uri;
+    ngx_str_t upstream;
+} ngx_http_websocket_registry_selector_t;
+
+size_t ws_registry_size(ngx_uint_t nslots);
+ngx_int_t ws_registry_init(ngx_shm_zone_t *shm_zone, void *data);
+// Returns NULL when all slots are taken.
+ngx_http_websocket_registry_slot_t *
+ws_registry_add(ngx_http_websocket_registry_t *registry, ngx_str_t *id,
+                ngx_str_t *addr, ngx_str_t *uri, ngx_str_t *upstream);
+void ws_registry_remove(ngx_http_websocket_registry_slot_t *slot);
+// Marks matching connections to be closed by their workers, returns how
+// many were marked.
+ngx_uint_t ws_registry_mark(ngx_http_websocket_registry_t *registry,
+                            ngx_http_websocket_registry_selector_t *selector);
+static ngx_inline ngx_int_t
+ws_registry_marked(ngx_http_websocket_registry_slot_t *slot)
+{
+    return slot->close == slot->generation;
+}
+
+// Copies of the n biggest connections, biggest first. Only the picked slots
+// are copied.
+ngx_array_t *ws_registry_top(ngx_http_websocket_registry_t *registry,
+                             ngx_pool_t *pool,
+                             ngx_http_websocket_registry_order_t order,
+                             ngx_uint_t n);
+#endif
@@ -0,0 +1,272 @@
+#include "ngx_http_websocket_stat_syslog.h"
+#ifndef TEST
+#include <ngx_event.h>
+#endif
+
+// Room for the biggest header ngx_syslog_add_header() writes: priority,
+// time, host name and a tag of up to 32 characters.
+#define WS_SYSLOG_HEADER_MAX                                                  \
+    (sizeof("<191>Mmm dd hh:mm:ss ") - 1 + NGX_MAXHOSTNAMELEN + 32 + 2)
+
+// A server that is down fails every batch, once a minute is enough to tell.
+#define WS_SYSLOG_ERROR_INTERVAL 60
+
+static ngx_int_t
+ws_syslog_error_due(ngx_http_websocket_syslog_t *syslog)
+{
+    if (ngx_time() - syslog->error_logged < WS_SYSLOG_ERROR_INTERVAL) {
+        return 0;
+    }
+    syslog->error_logged = ngx_time();
+    return 1;
+}
+
+static void
+ws_syslog_close(void *data)
+{
+    ngx_http_websocket_syslog_t *syslog = data;
+    if (syslog->fd != (ngx_socket_t)-1) {
+        ngx_close_socket(syslog->fd);
+        syslog->fd = (ngx_socket_t)-1;
+    }
+}
+
+static void
+ws_syslog_flush_handler(ngx_event_t *ev)
+{
+    ws_syslog_flush(ev->data);
+}
+
+ngx_http_websocket_syslog_t *
+ws_syslog_create(ngx_conf_t *cf, size_t size, size_t datagram,
+                 ngx_msec_t flush)
+{
+    ngx_http_websocket_syslog_t *syslog;
+    ngx_pool_cleanup_t *cln;
+    ngx_uint_t i;
+
+    if (datagram <= WS_SYSLOG_HEADER_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "datagram size must be more than %uz bytes",
+                           WS_SYSLOG_HEADER_MAX);
+        return NULL;
+    }
+    syslog = ngx_pcalloc(cf->pool, sizeof(ngx_http_websocket_syslog_t));
+    if (syslog == NULL) {
+        return NULL;
+    }
+    if (ngx_syslog_process_conf(cf, &syslog->peer) != NGX_CONF_OK) {
+        return NULL;
+    }
+    syslog->fd = (ngx_socket_t)-1;
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+    cln->handler = ws_syslog_close;
+    cln->data = syslog;
+
+    syslog->datagram = datagram;
+    syslog->batch = ngx_max(size / datagram, 1);
+    syslog->start = ngx_pnalloc(cf->pool, syslog->batch * datagram);
+    syslog->iov = ngx_pcalloc(cf->pool, syslog->batch * sizeof(struct iovec));
+    syslog->lines = ngx_pcalloc(cf->pool, syslog->batch * sizeof(ngx_uint_t));
+    if (syslog->start == NULL || syslog->iov == NULL ||
+        syslog->lines == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < syslog->batch; i++) {
+        syslog->iov[i].iov_base = syslog->start + i * datagram;
+    }
+#if (NGX_HAVE_SENDMMSG)
+    struct mmsghdr *msgs;
+    msgs = ngx_pcalloc(cf->pool, syslog->batch * sizeof(struct mmsghdr));
+    if (msgs == NULL) {
+        return NULL;
+    }
+    // the socket is connected, so only the data changes between batches
+    for (i = 0; i < syslog->batch; i++) {
+        msgs[i].msg_hdr.msg_iov = &syslog->iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    syslog->msgs = msgs;
+#endif
+
+    syslog->flush = flush;
+    syslog->event = ngx_pcalloc(cf->pool, sizeof(ngx_event_t));
+    if (syslog->event == NULL) {
+        return NULL;
+    }
+    syslog->event->data = syslog;
+    syslog->event->handler = ws_syslog_flush_handler;
+    syslog->event->log = &cf->cycle->new_log;
+    // do not keep exiting workers alive, exit flushes the batch anyway
+    syslog->event->cancelable = 1;
+    return syslog;
+}
+
+static ngx_int_t
+ws_syslog_connect(ngx_http_websocket_syslog_t *syslog)
+{
+    ngx_addr_t *server = &syslog->peer.server;
+    ngx_socket_t fd;
+
+    fd = ngx_socket(server->sockaddr->sa_family, SOCK_DGRAM, 0);
+    if (fd == (ngx_socket_t)-1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno,
+                      ngx_socket_n " failed");
+        return NGX_ERROR;
+    }
+    if (ngx_nonblocking(fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno,
+                      ngx_nonblocking_n " failed");
+        ngx_close_socket(fd);
+        return NGX_ERROR;
+    }
+    if (connect(fd, server->sockaddr, server->socklen) == -1) {
+        if (ws_syslog_error_due(syslog)) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_socket_errno,
+                          "connect() to ws_log server %V failed",
+                          &server->name);
+        }
+        ngx_close_socket(fd);
+        return NGX_ERROR;
+    }
+    syslog->fd = fd;
+    return NGX_OK;
+}
+
+// Sends the batch, returns how many datagrams the socket took.
+static ngx_uint_t
+ws_syslog_send(ngx_http_websocket_syslog_t *syslog, ngx_err_t *err)
+{
+    ngx_uint_t i = 0;
+    ssize_t n;
+
+#if (NGX_HAVE_SENDMMSG)
+    struct mmsghdr *msgs = syslog->msgs;
+    while (i < syslog->n) {
+        n = sendmmsg(syslog->fd, msgs + i, syslog->n - i, 0);
+        if (n == -1) {
+            *err = ngx_socket_errno;
+            if (*err == NGX_EINTR) {
+                continue;
+            }
+            break;
+        }
+        i += n;
+    }
+#else
+    while (i < syslog->n) {
+        n = send(syslog->fd, syslog->iov[i].iov_base, syslog->iov[i].iov_len,
+                 0);
+        if (n == -1) {
+            *err = ngx_socket_errno;
+            if (*err == NGX_EINTR) {
+                continue;
+            }
+            break;
+        }
+        i++;
+    }
+#endif
+    return i;
+}
+
+void
+ws_syslog_flush(ngx_http_websocket_syslog_t *syslog)
+{
+    ngx_uint_t i, sent = 0, lines = 0, dropped = 0;
+    ngx_err_t err = 0;
+
+    if (syslog->event->timer_set) {
+        ngx_del_timer(syslog->event);
+    }
+    if (syslog->n == 0) {
+        return;
+    }
+    syslog->iov[syslog->n - 1].iov_len =
+        syslog->pos - (u_char *)syslog->iov[syslog->n - 1].iov_base;
+
+    if (syslog->fd != (ngx_socket_t)-1 || ws_syslog_connect(syslog) == NGX_OK) {
+        sent = ws_syslog_send(syslog, &err);
+    }
+    for (i = 0; i < syslog->n; i++) {
+        if (i < sent) {
+            lines += syslog->lines[i];
+        } else {
+            dropped += syslog->lines[i];
+        }
+    }
+    if (syslog->sent) {
+        ngx_atomic_fetch_add(syslog->sent, lines);
+        ngx_atomic_fetch_add(syslog->dropped, dropped);
+    }
+
+    // a full socket buffer clears up by itself, anything else, like a
+    // server that went away, gets a new socket with the next batch
+    if (err && err != NGX_EAGAIN) {
+        if (ws_syslog_error_due(syslog)) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, err,
+                          "sending to ws_log server %V failed, "
+                          "dropping log lines",
+                          &syslog->peer.server.name);
+        }
+        ws_syslog_close(syslog);
+    }
+    syslog->n = 0;
+}
+
+// Starts the next datagram of the batch.
+static void
+ws_syslog_next(ngx_http_websocket_syslog_t *syslog)
+{
+    u_char *p;
+
+    if (syslog->n) {
+        p = syslog->iov[syslog->n - 1].iov_base;
+        syslog->iov[syslog->n - 1].iov_len = syslog->pos - p;
+    }
+    if (syslog->n == syslog->batch) {
+        ws_syslog_flush(syslog);
+    }
+    if (syslog->n == 0 && syslog->flush) {
+        ngx_add_timer(syslog->event, syslog->flush);
+    }
+    p = syslog->iov[syslog->n].iov_base;
+    syslog->lines[syslog->n] = 0;
+    syslog->n++;
+    syslog->pos = ngx_syslog_add_header(&syslog->peer, p);
+    syslog->last = p + syslog->datagram;
+}
+
+void
+ws_syslog_render(ngx_http_websocket_syslog_t *syslog,
+                 ws_log_render_pt render, void *data)
+{
+    u_char *p, *line;
+    size_t len;
+
+    if (syslog->n == 0) {
+        ws_syslog_next(syslog);
+    }
+    // leave room for the line end
+    p = render(data, syslog->pos, syslog->last - 1);
+    if (p > syslog->last - 1 && syslog->lines[syslog->n - 1]) {
+        ws_syslog_next(syslog);
+        p = render(data, syslog->pos, syslog->last - 1);
+    }
+    if (p > syslog->last - 1) {
+        // the line does not fit into a datagram of its own; values that did
+        // not fit were skipped, so the datagram holds stale bytes after the
+        // last one written, and the line is rendered whole to cut it there
+        line = ws_log_render_scratch(render, data, &len);
+        if (line == NULL) {
+            return;
+        }
+        p = ngx_cpymem(syslog->pos, line, syslog->last - 1 - syslog->pos);
+    }
+    *p++ = '\n';
+    syslog->pos = p;
+    syslog->lines[syslog->n - 1]++;
+}
@@ -0,0 +1,40 @@
+#ifndef _NGX_HTTP_WEBSOCKET_SYSLOG
+#define _NGX_HTTP_WEBSOCKET_SYSLOG
+
+#include "ngx_http_websocket_stat_log.h"
+
+// Log lines for "ws_log syslog:server=...". Lines are packed into datagrams,
+// each with one syslog header and a line end after every line, and a batch
+// of datagrams goes out with one sendmmsg() when it fills up or the flush
+// timer fires. Sending never waits: datagrams the socket does not take right
+// away are dropped and their lines counted.
+struct ngx_http_websocket_syslog_s {
+    ngx_syslog_peer_t peer;
+    ngx_socket_t fd;     // of the worker, opened with the first batch
+    time_t error_logged; // errors are logged once a minute at most
+    size_t datagram;     // size of a datagram, at most
+    ngx_uint_t batch;    // datagrams in a batch
+    u_char *start;       // batch * datagram bytes
+    struct iovec *iov;   // one per datagram
+    void *msgs;          // struct mmsghdr, one per datagram
+    ngx_uint_t *lines;   // lines in each datagram
+    ngx_uint_t n;        // datagrams started, the last one is filled at pos
+    u_char *pos;
+    u_char *last;
+    ngx_event_t *event;
+    ngx_msec_t flush;
+    // lines sent and dropped, counters in the stats shard of the worker
+    ngx_atomic_t *sent;
+    ngx_atomic_t *dropped;
+};
+
+// Takes the "syslog:" argument of the ws_log directive being parsed.
+ngx_http_websocket_syslog_t *ws_syslog_create(ngx_conf_t *cf, size_t size,
+                                              size_t datagram,
+                                              ngx_msec_t flush);
+// Lines longer than a datagram are cut.
+void ws_syslog_render(ngx_http_websocket_syslog_t *syslog,
+                      ws_log_render_pt render, void *data);
+void ws_syslog_flush(ngx_http_websocket_syslog_t *syslog);
+
+#endif
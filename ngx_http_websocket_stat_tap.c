@@ -0,0 +1,114 @@
+#include "ngx_http_websocket_stat_tap.h"
+
+#include <sys/mman.h>
+
+ws_tap_ring_t *ws_tap_worker_ring;
+uint64_t ws_tap_mask;
+
+// Mapping of the current cycle, inherited by its workers.
+static ws_tap_header_t *tap_header;
+
+typedef struct {
+    void *addr;
+    size_t size;
+} tap_mapping_t;
+
+static void
+ws_tap_unmap(void *data)
+{
+    tap_mapping_t *mapping = data;
+    if (tap_header == mapping->addr) {
+        tap_header = NULL;
+    }
+    munmap(mapping->addr, mapping->size);
+}
+
+ngx_int_t
+ws_tap_create(ngx_cycle_t *cycle, ngx_str_t *path, ngx_uint_t nrings,
+              ngx_uint_t records)
+{
+    size_t ring_size, size;
+    u_char *name, *tmp;
+    tap_mapping_t *mapping;
+    ngx_pool_cleanup_t *cln;
+    ngx_fd_t fd;
+    void *addr;
+
+    ring_size = sizeof(ws_tap_ring_t) + records * sizeof(ws_tap_record_t);
+    size = sizeof(ws_tap_header_t) + nrings * ring_size;
+
+    name = ngx_pnalloc(cycle->pool, 2 * path->len + sizeof(".tmp") + 1);
+    if (name == NULL) {
+        return NGX_ERROR;
+    }
+    tmp = ngx_sprintf(name, "%V%Z", path);
+    ngx_sprintf(tmp, "%V.tmp%Z", path);
+    cln = ngx_pool_cleanup_add(cycle->pool, sizeof(tap_mapping_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    // a new file every cycle: readers follow the rename, and workers of the
+    // previous cycle finish writing into the old one
+    fd = ngx_open_file(tmp, NGX_FILE_RDWR, NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", tmp);
+        return NGX_ERROR;
+    }
+    if (ftruncate(fd, size) == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "ftruncate() \"%s\" failed", tmp);
+        ngx_close_file(fd);
+        return NGX_ERROR;
+    }
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ngx_close_file(fd);
+    if (addr == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap() \"%s\" failed", tmp);
+        return NGX_ERROR;
+    }
+    mapping = cln->data;
+    mapping->addr = addr;
+    mapping->size = size;
+    cln->handler = ws_tap_unmap;
+
+    tap_header = addr;
+    tap_header->version = WS_TAP_VERSION;
+    tap_header->nrings = nrings;
+    tap_header->records = records;
+    tap_header->record_size = sizeof(ws_tap_record_t);
+    tap_header->ring_offset = sizeof(ws_tap_header_t);
+    tap_header->ring_size = ring_size;
+    // readers check the magic last
+    ngx_memory_barrier();
+    ngx_memcpy(tap_header->magic, WS_TAP_MAGIC, sizeof(tap_header->magic));
+
+    if (ngx_rename_file(tmp, name) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed", tmp,
+                      name);
+        return NGX_ERROR;
+    }
+    return NGX_OK;
+}
+
+void
+ws_tap_attach(ngx_uint_t worker)
+{
+    ws_tap_worker_ring = NULL;
+    if (tap_header == NULL) {
+        return;
+    }
+    ws_tap_worker_ring = ws_tap_ring(tap_header, worker % tap_header->nrings);
+    ws_tap_worker_ring->pid = ngx_pid;
+    ws_tap_mask = tap_header->records - 1;
+}
+
+void
+ws_tap_reset(void)
+{
+    tap_header = NULL;
+}
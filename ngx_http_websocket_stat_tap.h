@@ -0,0 +1,37 @@
+#ifndef _NGX_HTTP_WEBSOCKET_TAP
+#define _NGX_HTTP_WEBSOCKET_TAP
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include "ngx_http_websocket_stat_tapfile.h"
+
+// Ring of this worker in the ws_tap file, NULL when there is no tap.
+extern ws_tap_ring_t *ws_tap_worker_ring;
+extern uint64_t ws_tap_mask;
+
+// Maps a fresh tap file with a ring per worker. Runs in the master before
+// workers are forked, the mapping goes away with the cycle.
+ngx_int_t ws_tap_create(ngx_cycle_t *cycle, ngx_str_t *path,
+                        ngx_uint_t nrings, ngx_uint_t records);
+// Picks the ring of a worker, or none if the cycle has no tap.
+void ws_tap_attach(ngx_uint_t worker);
+void ws_tap_reset(void);
+
+// Never waits: when the reader falls behind its oldest unread record is
+// overwritten and counted.
+static ngx_inline void
+ws_tap_push(ws_tap_record_t *record)
+{
+    ws_tap_ring_t *ring = ws_tap_worker_ring;
+    uint64_t head = ring->head;
+    if (ring->reader && head - ring->tail > ws_tap_mask) {
+        ring->overwritten++;
+    }
+    ws_tap_records(ring)[head & ws_tap_mask] = *record;
+    // the record has to be complete before readers see it
+    ngx_memory_barrier();
+    ring->head = head + 1;
+}
+
+#endif
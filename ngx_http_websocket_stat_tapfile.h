@@ -0,0 +1,70 @@
+#ifndef _NGX_HTTP_WEBSOCKET_TAPFILE
+#define _NGX_HTTP_WEBSOCKET_TAPFILE
+
+// Layout of the ws_tap file, shared by the module and tools/ws-tap. It uses
+// no nginx types so the tools build without it.
+//
+// The file holds a header and one ring of frame records per worker. Each
+// worker is the only writer of its ring: it fills the record at head, then
+// moves head on, and never waits for readers. A reader copies records up to
+// head and drops the ones head went more than a ring past meanwhile, they
+// were overwritten while being copied. Numbers are in host byte order, the
+// file is only read on the same machine.
+
+#include <stdint.h>
+
+#define WS_TAP_MAGIC "WSTP"
+#define WS_TAP_VERSION 1
+#define WS_TAP_CACHE_LINE 64
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t nrings;
+    uint32_t records;     // per ring, a power of two
+    uint32_t record_size;
+    uint32_t ring_offset; // of the first ring
+    uint32_t ring_size;   // ring header and records
+    uint8_t reserved[WS_TAP_CACHE_LINE - 28];
+} ws_tap_header_t;
+
+typedef struct {
+    // written by the worker
+    volatile uint64_t head; // records ever written
+    volatile uint64_t pid;
+    // records overwritten before the attached reader got to them
+    volatile uint64_t overwritten;
+    uint8_t pad[WS_TAP_CACHE_LINE - 24];
+    // written by the reader, on a cache line of their own
+    volatile uint64_t tail;   // next record the reader wants
+    volatile uint64_t reader; // its pid, 0 when none is attached
+    uint8_t reader_pad[WS_TAP_CACHE_LINE - 16];
+} ws_tap_ring_t;
+
+#define WS_TAP_FROM_CLIENT 0x01
+#define WS_TAP_COMPRESSED 0x02
+
+typedef struct {
+    uint64_t time;    // milliseconds since the epoch
+    uint64_t payload; // payload size
+    uint32_t conn;    // hash of $request_id
+    uint32_t tcp;     // bytes of the read or write the frame came with
+    uint8_t flags;
+    uint8_t opcode;
+    uint8_t reserved[6];
+} ws_tap_record_t;
+
+static inline ws_tap_ring_t *
+ws_tap_ring(ws_tap_header_t *header, uint32_t n)
+{
+    return (ws_tap_ring_t *)((uint8_t *)header + header->ring_offset +
+                             (uint64_t)n * header->ring_size);
+}
+
+static inline ws_tap_record_t *
+ws_tap_records(ws_tap_ring_t *ring)
+{
+    return (ws_tap_record_t *)(ring + 1);
+}
+
+#endif
@@ -0,0 +1,140 @@
+#include "ngx_http_websocket_stat_zone.h"
+
+ngx_int_t
+ws_zone_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_websocket_zone_t *ozone = data;
+    ngx_http_websocket_zone_t *zone = shm_zone->data;
+    size_t len;
+
+    if (ozone) {
+        // counters survive reload
+        zone->sh = ozone->sh;
+        zone->shpool = ozone->shpool;
+        return NGX_OK;
+    }
+
+    zone->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+    if (shm_zone->shm.exists) {
+        zone->sh = zone->shpool->data;
+        return NGX_OK;
+    }
+
+    zone->sh = ngx_slab_calloc(zone->shpool,
+                               sizeof(ngx_http_websocket_zone_sh_t));
+    if (zone->sh == NULL) {
+        return NGX_ERROR;
+    }
+    zone->shpool->data = zone->sh;
+    ngx_rbtree_init(&zone->sh->rbtree, &zone->sh->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    len = sizeof(" in websocket stat zone \"\"") + shm_zone->shm.name.len;
+    zone->shpool->log_ctx = ngx_slab_alloc(zone->shpool, len);
+    if (zone->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_sprintf(zone->shpool->log_ctx, " in websocket stat zone \"%V\"%Z",
+                &shm_zone->shm.name);
+    // running out of memory is expected, keys go to overflow then
+    zone->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+ngx_http_websocket_zone_counters_t *
+ws_zone_lookup(ngx_http_websocket_zone_t *zone, ngx_str_t *key)
+{
+    ngx_http_websocket_zone_node_t *node;
+    ngx_http_websocket_zone_sh_t *sh = zone->sh;
+    uint32_t hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    node = (ngx_http_websocket_zone_node_t *)ngx_str_rbtree_lookup(
+        &sh->rbtree, key, hash);
+    if (node == NULL && (zone->max == 0 || sh->keys < zone->max)) {
+        node = ngx_slab_calloc_locked(
+            zone->shpool,
+            offsetof(ngx_http_websocket_zone_node_t, data) + key->len);
+        if (node) {
+            ngx_memcpy(node->data, key->data, key->len);
+            node->sn.str.data = node->data;
+            node->sn.str.len = key->len;
+            node->sn.node.key = hash;
+            ngx_rbtree_insert(&sh->rbtree, &node->sn.node);
+            sh->keys++;
+        }
+    }
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    return node ? &node->counters : &sh->overflow;
+}
+
+static void
+copy_counters(ngx_http_websocket_zone_counters_t *dst,
+              ngx_http_websocket_zone_counters_t *src)
+{
+    dst->connections = src->connections;
+    dst->opened = src->opened;
+    dst->closed = src->closed;
+    dst->frames_in.frames = src->frames_in.frames;
+    dst->frames_in.total_payload_size = src->frames_in.total_payload_size;
+    dst->frames_in.total_size = src->frames_in.total_size;
+    dst->frames_out.frames = src->frames_out.frames;
+    dst->frames_out.total_payload_size = src->frames_out.total_payload_size;
+    dst->frames_out.total_size = src->frames_out.total_size;
+}
+
+ngx_array_t *
+ws_zone_snapshot(ngx_http_websocket_zone_t *zone, ngx_pool_t *pool)
+{
+    ngx_http_websocket_zone_sh_t *sh = zone->sh;
+    ngx_http_websocket_zone_entry_t *entry;
+    ngx_http_websocket_zone_node_t *node;
+    ngx_rbtree_node_t *n;
+    ngx_array_t *entries;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    entries = ngx_array_create(pool, sh->keys + 1,
+                               sizeof(ngx_http_websocket_zone_entry_t));
+    if (entries == NULL) {
+        goto failed;
+    }
+    if (sh->rbtree.root != sh->rbtree.sentinel) {
+        for (n = ngx_rbtree_min(sh->rbtree.root, sh->rbtree.sentinel); n;
+             n = ngx_rbtree_next(&sh->rbtree, n)) {
+            node = (ngx_http_websocket_zone_node_t *)n;
+            entry = ngx_array_push(entries);
+            if (entry == NULL) {
+                goto failed;
+            }
+            entry->key.len = node->sn.str.len;
+            entry->key.data = ngx_pnalloc(pool, entry->key.len + 1);
+            if (entry->key.data == NULL) {
+                goto failed;
+            }
+            *ngx_cpymem(entry->key.data, node->sn.str.data, entry->key.len) =
+                '\0';
+            entry->overflow = 0;
+            copy_counters(&entry->counters, &node->counters);
+        }
+    }
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    entry = ngx_array_push(entries);
+    if (entry == NULL) {
+        return NULL;
+    }
+    ngx_str_null(&entry->key);
+    entry->overflow = 1;
+    copy_counters(&entry->counters, &sh->overflow);
+    return entries;
+
+failed:
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+    return NULL;
+}
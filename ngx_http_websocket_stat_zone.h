@@ -0,0 +1,63 @@
+#ifndef _NGX_HTTP_WEBSOCKET_ZONE
+#define _NGX_HTTP_WEBSOCKET_ZONE
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+typedef struct {
+    ngx_atomic_t frames;
+    ngx_atomic_t total_payload_size;
+    ngx_atomic_t total_size;
+} ngx_http_websocket_zone_traffic_t;
+
+// Counters of one key. A connection finds them once at upgrade and then
+// updates them with atomic adds once per recv/send call.
+typedef struct {
+    ngx_atomic_t connections;
+    ngx_atomic_t opened;
+    ngx_atomic_t closed;
+    ngx_http_websocket_zone_traffic_t frames_in;
+    ngx_http_websocket_zone_traffic_t frames_out;
+} ngx_http_websocket_zone_counters_t;
+
+// Nodes are never removed, so counter pointers held by connections stay
+// valid. Once max keys exist or the zone is full, new keys are counted in
+// the overflow counters.
+typedef struct {
+    ngx_str_node_t sn;
+    ngx_http_websocket_zone_counters_t counters;
+    u_char data[1];
+} ngx_http_websocket_zone_node_t;
+
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_uint_t keys;
+    ngx_http_websocket_zone_counters_t overflow;
+} ngx_http_websocket_zone_sh_t;
+
+typedef struct {
+    ngx_http_websocket_zone_sh_t *sh;
+    ngx_slab_pool_t *shpool;
+    ngx_shm_zone_t *shm_zone;
+    ngx_http_complex_value_t key;
+    // keyed by the upstream peer the connection was proxied to
+    unsigned upstream : 1;
+    ngx_uint_t max;
+} ngx_http_websocket_zone_t;
+
+// Copy of one key's counters taken for ws_stat output.
+typedef struct {
+    ngx_str_t key; // null terminated
+    unsigned overflow : 1;
+    ngx_http_websocket_zone_counters_t counters;
+} ngx_http_websocket_zone_entry_t;
+
+ngx_int_t ws_zone_init(ngx_shm_zone_t *shm_zone, void *data);
+ngx_http_websocket_zone_counters_t *
+ws_zone_lookup(ngx_http_websocket_zone_t *zone, ngx_str_t *key);
+// Entries follow the index order, overflow counters come last.
+ngx_array_t *ws_zone_snapshot(ngx_http_websocket_zone_t *zone,
+                              ngx_pool_t *pool);
+#endif
@@ -0,0 +1,111 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Compares the old counter layout (seven global counters, three atomic adds
+// per frame) with per-worker shards updated once per recv/send call.
+// Threads stand in for nginx workers.
+
+#define CACHE_LINE 128
+#define MAX_WORKERS 64
+#define FRAMES_PER_CALL 16
+#define FRAME_PAYLOAD 24
+
+typedef unsigned long counter_t;
+
+typedef struct {
+    counter_t frames;
+    counter_t total_payload_size;
+    counter_t total_size;
+} statistic_t;
+
+typedef struct {
+    statistic_t frames_in;
+    statistic_t frames_out;
+    char pad[CACHE_LINE - 2 * sizeof(statistic_t)];
+} shard_t;
+
+static counter_t global_counters[7 * CACHE_LINE / sizeof(counter_t)]
+    __attribute__((aligned(CACHE_LINE)));
+static shard_t shards[MAX_WORKERS] __attribute__((aligned(CACHE_LINE)));
+
+static long calls_per_worker;
+static int sharded;
+
+#define GLOBAL(n) (&global_counters[(n)*CACHE_LINE / sizeof(counter_t)])
+
+static void *
+worker(void *arg)
+{
+    long id = (long)arg;
+    statistic_t *stat = &shards[id].frames_in;
+    long call;
+    int f;
+    for (call = 0; call < calls_per_worker; call++) {
+        if (sharded) {
+            counter_t frames = 0, payload = 0;
+            for (f = 0; f < FRAMES_PER_CALL; f++) {
+                frames++;
+                payload += FRAME_PAYLOAD;
+            }
+            __sync_fetch_and_add(&stat->total_size,
+                                 FRAMES_PER_CALL * (FRAME_PAYLOAD + 6));
+            __sync_fetch_and_add(&stat->frames, frames);
+            __sync_fetch_and_add(&stat->total_payload_size, payload);
+        } else {
+            __sync_fetch_and_add(GLOBAL(2),
+                                 FRAMES_PER_CALL * (FRAME_PAYLOAD + 6));
+            for (f = 0; f < FRAMES_PER_CALL; f++) {
+                __sync_fetch_and_add(GLOBAL(0), 1);
+                __sync_fetch_and_add(GLOBAL(1), FRAME_PAYLOAD);
+            }
+        }
+    }
+    return NULL;
+}
+
+static double
+run(int workers)
+{
+    pthread_t threads[MAX_WORKERS];
+    struct timespec start, end;
+    long i;
+    memset(global_counters, 0, sizeof(global_counters));
+    memset(shards, 0, sizeof(shards));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < workers; i++) {
+        pthread_create(&threads[i], NULL, worker, (void *)i);
+    }
+    for (i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds =
+        end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return (double)workers * calls_per_worker * FRAMES_PER_CALL / seconds;
+}
+
+int
+main(int argc, char **argv)
+{
+    int max_workers = argc > 1 ? atoi(argv[1]) : 8;
+    calls_per_worker = argc > 2 ? atol(argv[2]) : 1000000;
+    if (max_workers < 1 || max_workers > MAX_WORKERS) {
+        fprintf(stderr, "workers should be between 1 and %d\n", MAX_WORKERS);
+        return 1;
+    }
+    printf("workers | global atomics, Mframes/s | per-worker shards, "
+           "Mframes/s\n");
+    int w;
+    for (w = 1; w <= max_workers;
+         w = (w < max_workers && w * 2 > max_workers) ? max_workers : w * 2) {
+        sharded = 0;
+        double before = run(w);
+        sharded = 1;
+        double after = run(w);
+        printf("%7d | %25.1f | %29.1f\n", w, before / 1e6, after / 1e6);
+    }
+    return 0;
+}
@@ -4,42 +4,81 @@
 
 #include "../ngx_http_websocket_stat_format.h"
 
-const char *
-test_func(ngx_http_request_t *r, void *data)
+u_char *
+test_func(ngx_http_request_t *r, void *data, u_char *buf, u_char *last)
 {
-    return "BINGO";
+    return template_copy_str(buf, last, "BINGO");
+}
+
+u_char *
+long_func(ngx_http_request_t *r, void *data, u_char *buf, u_char *last)
+{
+    return template_copy_str(buf, last,
+                             "GET /a/rather/long/uri/that/used/to/be/cut/"
+                             "after/sixty/characters HTTP/1.1");
+}
+
+u_char *
+number_func(ngx_http_request_t *r, void *data, u_char *buf, u_char *last)
+{
+    return template_uint(buf, last, 18446744073709551615ULL);
+}
+
+u_char *
+header_func(ngx_http_request_t *r, void *data, ngx_uint_t index, u_char *buf,
+            u_char *last)
+{
+    buf = template_copy_str(buf, last, "HDR");
+    return template_uint(buf, last, index);
 }
 
 const template_variable variables[] = {
-    {VAR_NAME("$ws_opcode"), sizeof("pding") - 1, test_func},
-    {VAR_NAME("$ws_payload_size"), 10, test_func},
-    {VAR_NAME("$ws_packet_source"), sizeof("upstream") - 1, test_func},
-    {VAR_NAME("$ws_conn_age"), 10, test_func},
-    {VAR_NAME("$request"), 10, test_func},
-    {VAR_NAME("$request_id"), 10, test_func},
-    {VAR_NAME("$time_local"), sizeof("Mon, 23 Oct 2017 11:27:42 GMT") - 1,
-     test_func},
-    {NULL, 0, 0, NULL}};
+    {VAR_NAME("$ws_opcode"), test_func},
+    {VAR_NAME("$ws_payload_size"), number_func},
+    {VAR_NAME("$ws_packet_source"), test_func},
+    {VAR_NAME("$ws_conn_age"), test_func},
+    {VAR_NAME("$request"), long_func},
+    {VAR_NAME("$request_id"), test_func},
+    {VAR_NAME("$time_local"), test_func},
+    {NULL, 0, NULL}};
 
-int
-test_template(const char *template, const char *expected_result)
+u_char result[1024];
+
+void
+test_template(char *template, const char *expected_result)
 {
 
     compiled_template *template_cmpl =
-        compile_template(template, variables, NULL);
-    char *res = apply_template(template_cmpl, NULL, NULL);
-    if (strcmp(res, expected_result) == 0) {
+        compile_template(template, variables, header_func, NULL);
+    u_char *end = apply_template(template_cmpl, NULL, NULL, result,
+                                 result + sizeof(result) - 1);
+    *end = '\0';
+    if (strcmp((char *)result, expected_result) == 0) {
         printf("test passed :)\n");
     } else {
         printf("Test failed :(\n"
                "actual  : %s\n"
                "expected: %s\n",
-               res, expected_result);
+               result, expected_result);
         exit(1);
     }
 
-    free(template_cmpl->variable_occurances->elts);
-    free(template_cmpl->variable_occurances);
+    // rendering into a short buffer reports the full length
+    size_t len = strlen(expected_result);
+    if (len > 0) {
+        end = apply_template(template_cmpl, NULL, NULL, result,
+                             result + len - 1);
+        if ((size_t)(end - result) != len) {
+            printf("Test failed :(\n"
+                   "overflow reported %zu instead of %zu\n",
+                   (size_t)(end - result), len);
+            exit(1);
+        }
+    }
+
+    free(template_cmpl->segments->elts);
+    free(template_cmpl->segments);
+    free(template_cmpl);
 }
 
 int
@@ -53,8 +92,27 @@ main()
     test_template("Some template f", "Some template f");
     test_template("", "");
     test_template("$time_local", "BINGO");
-    test_template("$time_local$ws_opcode$ws_payload_size", "BINGOBINGOBINGO");
+    test_template("$time_local$ws_opcode$ws_payload_size",
+                  "BINGOBINGO18446744073709551615");
     test_template("$time_", "$time_");
-    test_template("$request $request_id", "BINGO BINGO");
+    test_template("$request $request_id",
+                  "GET /a/rather/long/uri/that/used/to/be/cut/after/sixty/"
+                  "characters HTTP/1.1 BINGO");
+    test_template("XXX $ws_opcode XmasX", "XXX BINGO XmasX");
+    test_template("$ $$ws_opcode$", "$ $BINGO$");
+    test_template("$http_user_agent $http_host $http_user_agent",
+                  "HDR0 HDR1 HDR0");
+    if (template_http_headers_count() != 2) {
+        printf("Test failed :(\nheader names are not shared\n");
+        exit(1);
+    }
+    template_reset_http_headers();
+    test_template("$http_", "$http_");
+    test_template("$http_x_b3_traceid-$http_x_b3", "HDR0-HDR1");
+    if (template_http_headers_count() != 2) {
+        printf("Test failed :(\nheader names with digits are cut\n");
+        exit(1);
+    }
+    template_reset_http_headers();
     return 0;
 }
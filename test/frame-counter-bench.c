@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../ngx_http_websocket_stat_frame_counter.h"
+
+// Measures frames per second of frame_counter_process_message over streams
+// of frames with realistic size mixes, cut into recv sized buffers. The
+// stream is small enough to stay in cache, like a freshly received buffer.
+
+#define STREAM_SIZE (1024 * 1024)
+
+typedef struct {
+    const char *name;
+    int masked;
+    // percent of frames in each size class: <126, <4k, <64k
+    int small, medium;
+    size_t small_max;
+} frame_mix;
+
+const frame_mix mixes[] = {
+    {"chat, client frames 2-64b", 1, 100, 0, 64},
+    {"feed, upstream frames 20-400b", 0, 98, 2, 400},
+    {"mixed, 90% small 9% <4k 1% <64k", 1, 90, 9, 125},
+};
+
+static u_char *stream;
+static unsigned long seed = 42;
+
+static unsigned long
+next_random()
+{
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return seed >> 33;
+}
+
+static size_t
+write_frame(u_char *p, size_t payload, int masked)
+{
+    u_char *start = p;
+    *p++ = 0x81;
+    u_char mask_bit = masked ? 0x80 : 0;
+    if (payload < 126) {
+        *p++ = mask_bit | payload;
+    } else if (payload < 65536) {
+        *p++ = mask_bit | 126;
+        *p++ = payload >> 8;
+        *p++ = payload & 0xff;
+    } else {
+        *p++ = mask_bit | 127;
+        for (int i = 7; i >= 0; i--) {
+            *p++ = (payload >> (i * 8)) & 0xff;
+        }
+    }
+    if (masked) {
+        memcpy(p, "mask", 4);
+        p += 4;
+    }
+    return p + payload - start;
+}
+
+static size_t
+generate(const frame_mix *mix, size_t *frames)
+{
+    size_t len = 0;
+    *frames = 0;
+    for (;;) {
+        size_t payload;
+        unsigned long r = next_random() % 100;
+        if ((int)r < mix->small) {
+            payload = 2 + next_random() % (mix->small_max - 1);
+        } else if ((int)r < mix->small + mix->medium) {
+            payload = 126 + next_random() % (4096 - 126);
+        } else {
+            payload = 4096 + next_random() % (65536 - 4096);
+        }
+        if (len + payload + 14 > STREAM_SIZE)
+            break;
+        len += write_frame(stream + len, payload, mix->masked);
+        (*frames)++;
+    }
+    return len;
+}
+
+static double
+run(size_t len, size_t recv_size, size_t expected)
+{
+    ngx_frame_counter_t counter;
+    struct timespec start, end;
+    size_t frames = 0, pos;
+    int rounds = 200, i;
+    memset(&counter, 0, sizeof(counter));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < rounds; i++) {
+        for (pos = 0; pos < len; pos += recv_size) {
+            ssize_t size = len - pos < recv_size ? len - pos : recv_size;
+            u_char *buf = stream + pos;
+            while (size > 0) {
+                frames += frame_counter_process_message(&buf, &size, &counter);
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (frames != expected * rounds) {
+        fprintf(stderr, "parsed %zu frames, expected %zu\n", frames,
+                expected * rounds);
+        exit(1);
+    }
+    double seconds =
+        end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return frames / seconds;
+}
+
+// the loop $ws_payload_full_content used before
+static void
+unmask_bytes(u_char *dst, const u_char *src, size_t len, const u_char *mask)
+{
+    for (size_t i = 0; i < len; i++) {
+        dst[i] = src[i] ^ mask[i % 4];
+    }
+}
+
+static double
+run_unmask(size_t payload, int bytewise)
+{
+    static u_char out[65536];
+    const u_char mask[4] = {1, 2, 3, 4};
+    struct timespec start, end;
+    size_t done = 0, pos;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (done < 2000UL * 1024 * 1024) {
+        for (pos = 0; pos + payload <= STREAM_SIZE; pos += payload) {
+            if (bytewise) {
+                unmask_bytes(out, stream + pos, payload, mask);
+            } else {
+                frame_counter_unmask(out, stream + pos, payload, mask, 0);
+            }
+        }
+        done += pos;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (out[0] == 0xff && out[payload - 1] == 0xff)
+        printf(" ");
+    double seconds =
+        end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return done / seconds;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t recv_size = argc > 1 ? atol(argv[1]) : 16384;
+    size_t i, frames;
+    stream = malloc(STREAM_SIZE);
+    printf("recv buffer %zu bytes\n", recv_size);
+    printf("%-35s | Mframes/s\n", "frame mix");
+    for (i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++) {
+        size_t len = generate(&mixes[i], &frames);
+        printf("%-35s | %9.1f\n", mixes[i].name,
+               run(len, recv_size, frames) / 1e6);
+    }
+
+    size_t payloads[] = {64, 1024, 16384};
+    const char *word = frame_counter_unmask_init();
+    printf("\n%-11s | bytes, GB/s | %s, GB/s\n", "unmask", word);
+    for (i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+        printf("%5zu bytes | %11.2f | %*.2f\n", payloads[i],
+               run_unmask(payloads[i], 1) / 1e9, (int)strlen(word) + 6,
+               run_unmask(payloads[i], 0) / 1e9);
+    }
+    free(stream);
+    return 0;
+}
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../ngx_http_websocket_stat_frame_counter.h"
+
+#define FIN 0x80
+#define RSV1 0x40
+
+typedef struct {
+    int type;
+    size_t payload;
+    int masked;
+    int flags;
+} test_frame;
+
+const test_frame frames[] = {
+    {TEXT, 0, 0, FIN},       {TEXT, 0, 1, FIN},
+    {BINARY, 1, 1, FIN},     {TEXT, 125, 0, FIN | RSV1},
+    {TEXT, 126, 1, FIN},     {BINARY, 127, 0, FIN},
+    {PING, 4, 1, FIN},       {PONG, 4, 0, FIN},
+    {BINARY, 65535, 1, FIN}, {BINARY, 65536, 0, FIN | RSV1},
+    {TEXT, 70000, 1, RSV1},  {CONTINUATION, 3, 1, FIN},
+    {CLOSE, 2, 1, FIN}};
+#define FRAMES (sizeof(frames) / sizeof(frames[0]))
+
+u_char stream[FRAMES * (14 + 70000)];
+
+static size_t
+write_frame(u_char *p, const test_frame *f, int n)
+{
+    u_char *start = p;
+    *p++ = f->flags | f->type;
+    u_char mask_bit = f->masked ? 0x80 : 0;
+    if (f->payload < 126) {
+        *p++ = mask_bit | f->payload;
+    } else if (f->payload < 65536) {
+        *p++ = mask_bit | 126;
+        *p++ = f->payload >> 8;
+        *p++ = f->payload & 0xff;
+    } else {
+        *p++ = mask_bit | 127;
+        for (int i = 7; i >= 0; i--) {
+            *p++ = (f->payload >> (i * 8)) & 0xff;
+        }
+    }
+    if (f->masked) {
+        for (int i = 0; i < 4; i++) {
+            *p++ = n * 4 + i;
+        }
+    }
+    memset(p, 'a', f->payload);
+    return p + f->payload - start;
+}
+
+static void
+fail(const char *what, size_t chunk, size_t frame)
+{
+    printf("Test failed :(\n%s, chunk size %zu, frame %zu\n", what, chunk,
+           frame);
+    exit(1);
+}
+
+static void
+test_chunks(size_t len, size_t chunk)
+{
+    ngx_frame_counter_t counter;
+    memset(&counter, 0, sizeof(counter));
+    size_t n = 0, pos = 0, seen = 0;
+    while (pos < len) {
+        ssize_t size = len - pos < chunk ? len - pos : chunk;
+        u_char *buf = stream + pos;
+        pos += size;
+        while (size > 0) {
+            int done = frame_counter_process_message(&buf, &size, &counter);
+            if (counter.chunk_size) {
+                if ((size_t)counter.chunk_offset != seen)
+                    fail("chunk out of order", chunk, n);
+                if (counter.chunk + counter.chunk_size != buf)
+                    fail("wrong chunk", chunk, n);
+                seen += counter.chunk_size;
+            }
+            if (done) {
+                if (n >= FRAMES)
+                    fail("too many frames", chunk, n);
+                if ((int)counter.current_frame_type != frames[n].type)
+                    fail("wrong type", chunk, n);
+                if ((size_t)counter.current_payload_size != frames[n].payload)
+                    fail("wrong payload size", chunk, n);
+                if (frames[n].masked && counter.mask[3] != n * 4 + 3)
+                    fail("wrong mask", chunk, n);
+                if (!counter.fin != !(frames[n].flags & FIN) ||
+                    !counter.rsv1 != !(frames[n].flags & RSV1))
+                    fail("wrong flags", chunk, n);
+                if (seen != frames[n].payload)
+                    fail("payload chunks lost", chunk, n);
+                seen = 0;
+                n++;
+            }
+        }
+    }
+    if (n != FRAMES)
+        fail("frames lost", chunk, n);
+}
+
+// A length with the most significant bit set must not turn into a negative
+// size that walks the buffer backwards.
+static void
+test_invalid_length(size_t chunk)
+{
+    u_char bad[] = {FIN | BINARY, 0x80 | 127, 0x80, 0, 0, 0, 0, 0, 0, 1,
+                    1, 2, 3, 4, 'a', 'b', FIN | TEXT, 0};
+    ngx_frame_counter_t counter;
+    memset(&counter, 0, sizeof(counter));
+    size_t pos = 0;
+    while (pos < sizeof(bad)) {
+        ssize_t size = sizeof(bad) - pos < chunk ? sizeof(bad) - pos : chunk;
+        u_char *buf = bad + pos, *end = buf + size;
+        pos += size;
+        while (size > 0) {
+            if (frame_counter_process_message(&buf, &size, &counter))
+                fail("frame of invalid length counted", chunk, 0);
+            if (buf > end || size < 0)
+                fail("invalid length moved out of the buffer", chunk, 0);
+        }
+    }
+    if (counter.stage != INVALID)
+        fail("invalid length not rejected", chunk, 0);
+}
+
+static void
+test_unmask(const char *impl)
+{
+    static u_char src[1100], dst[1100], expected[1100];
+    const u_char mask[4] = {0x12, 0x34, 0x56, 0x78};
+    size_t len, offset, align, i;
+    for (i = 0; i < sizeof(src); i++) {
+        src[i] = i * 7;
+    }
+    for (len = 0; len < 1024; len += len < 80 ? 1 : 61) {
+        for (offset = 0; offset < 8; offset++) {
+            for (align = 0; align < 4; align++) {
+                for (i = 0; i < len; i++) {
+                    expected[i] = src[align + i] ^ mask[(offset + i) % 4];
+                }
+                frame_counter_unmask(dst + align, src + align, len, mask,
+                                     offset);
+                if (memcmp(dst + align, expected, len) != 0) {
+                    printf("Test failed :(\n%s unmask, len %zu, offset %zu\n",
+                           impl, len, offset);
+                    exit(1);
+                }
+                // in place
+                memcpy(dst, src + align, len);
+                frame_counter_unmask(dst, dst, len, mask, offset);
+                if (memcmp(dst, expected, len) != 0) {
+                    printf("Test failed :(\n%s unmask in place, len %zu\n",
+                           impl, len);
+                    exit(1);
+                }
+            }
+        }
+    }
+}
+
+int
+main()
+{
+    size_t len = 0, chunk;
+    for (size_t i = 0; i < FRAMES; i++) {
+        len += write_frame(stream + len, &frames[i], i);
+    }
+    printf("test started\n");
+    test_chunks(len, len);
+    for (chunk = 1; chunk <= 20; chunk++) {
+        test_chunks(len, chunk);
+    }
+    test_chunks(len, 4096);
+    test_chunks(len, 16384);
+    for (chunk = 1; chunk <= 18; chunk++) {
+        test_invalid_length(chunk);
+    }
+    test_unmask("word");
+    test_unmask(frame_counter_unmask_init());
+    printf("test passed :)\n");
+    return 0;
+}
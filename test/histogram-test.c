@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../ngx_http_websocket_stat_histogram.h"
+
+static ngx_http_websocket_histogram_t h1, h2;
+
+static void
+fail(const char *what, unsigned long long value)
+{
+    printf("Test failed :(\n%s: %llu\n", what, value);
+    exit(1);
+}
+
+// reported value is never below the recorded one and within 12.5% above it
+static void
+check_close(const char *what, uint64_t reported, uint64_t expected)
+{
+    if (reported < expected || reported - expected > expected / 8)
+        fail(what, reported);
+}
+
+static void
+test_buckets()
+{
+    uint64_t v, prev = 0;
+    for (v = 0; v < 100000; v++) {
+        ngx_uint_t b = histogram_bucket(v);
+        if (b < prev || b > prev + 1)
+            fail("buckets are not contiguous", v);
+        prev = b;
+    }
+    if (histogram_bucket(~0ULL) != HISTOGRAM_BUCKETS - 1)
+        fail("largest value is out of range", histogram_bucket(~0ULL));
+    for (int shift = 0; shift < 64; shift++) {
+        v = 1ULL << shift;
+        memset(&h1, 0, sizeof(h1));
+        histogram_record(&h1, v);
+        histogram_record(&h1, v + v / 3);
+        check_close("single value", histogram_percentile(&h1, 500), v);
+    }
+}
+
+static void
+test_percentiles()
+{
+    uint64_t v;
+    memset(&h1, 0, sizeof(h1));
+    memset(&h2, 0, sizeof(h2));
+    for (v = 1; v <= 5000; v++) {
+        histogram_record(&h1, v);
+    }
+    for (v = 5001; v <= 10000; v++) {
+        histogram_record(&h2, v);
+    }
+    histogram_merge(&h1, &h2);
+    if (histogram_count(&h1) != 10000)
+        fail("merged count", histogram_count(&h1));
+    check_close("p50", histogram_percentile(&h1, 500), 5000);
+    check_close("p90", histogram_percentile(&h1, 900), 9000);
+    check_close("p99", histogram_percentile(&h1, 990), 9900);
+    check_close("p999", histogram_percentile(&h1, 999), 9990);
+    check_close("p100", histogram_percentile(&h1, 1000), 10000);
+
+    // tail is not hidden by the bulk
+    memset(&h1, 0, sizeof(h1));
+    for (v = 0; v < 9989; v++) {
+        histogram_record(&h1, 20);
+    }
+    for (v = 0; v < 11; v++) {
+        histogram_record(&h1, 1 << 20);
+    }
+    check_close("bulk p99", histogram_percentile(&h1, 990), 20);
+    check_close("tail p999", histogram_percentile(&h1, 999), 1 << 20);
+
+    memset(&h1, 0, sizeof(h1));
+    if (histogram_percentile(&h1, 500) != 0)
+        fail("empty histogram", histogram_percentile(&h1, 500));
+}
+
+int
+main()
+{
+    printf("test started\n");
+    test_buckets();
+    test_percentiles();
+    printf("test passed :)\n");
+    return 0;
+}
@@ -0,0 +1,202 @@
+#include "../ngx_http_websocket_stat_syslog.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+
+#define HEADER "<190>nginx: "
+#define HEADER_LEN (sizeof(HEADER) - 1)
+#define DATAGRAM 400
+#define BATCH 4
+
+static ngx_cycle_t cycle;
+ngx_cycle_t *ngx_cycle = &cycle;
+
+static struct sockaddr_in server;
+static int listener;
+
+ngx_pool_cleanup_t *
+ngx_pool_cleanup_add(ngx_pool_t *p, size_t size)
+{
+    return calloc(1, sizeof(ngx_pool_cleanup_t));
+}
+
+char *
+ngx_syslog_process_conf(ngx_conf_t *cf, ngx_syslog_peer_t *peer)
+{
+    peer->server.sockaddr = (struct sockaddr *)&server;
+    peer->server.socklen = sizeof(server);
+    return NGX_CONF_OK;
+}
+
+u_char *
+ngx_syslog_add_header(ngx_syslog_peer_t *peer, u_char *buf)
+{
+    return ngx_cpymem(buf, HEADER, HEADER_LEN);
+}
+
+static void
+fail(const char *what, size_t value)
+{
+    printf("Test failed :(\n%s: %zu\n", what, value);
+    exit(1);
+}
+
+// Writes a value only if it fits whole, like the log format variables do.
+static u_char *
+copy_value(u_char *buf, u_char *last, int c, size_t len)
+{
+    if (len <= (size_t)(last - buf)) {
+        memset(buf, c, len);
+    }
+    return buf + len;
+}
+
+typedef struct {
+    int c;
+    size_t len;
+    size_t tail; // a second value of 'z', none if 0
+} test_line;
+
+static u_char *
+render_line(void *data, u_char *buf, u_char *last)
+{
+    test_line *line = data;
+    u_char *p = copy_value(buf, last, line->c, line->len);
+    if (line->tail) {
+        p = copy_value(p, last, 'z', line->tail);
+    }
+    return p;
+}
+
+static ngx_http_websocket_syslog_t *
+create()
+{
+    ngx_conf_t cf;
+    ngx_cycle_t conf_cycle;
+    ngx_http_websocket_syslog_t *syslog;
+    static ngx_atomic_t sent, dropped;
+
+    memset(&cf, 0, sizeof(cf));
+    cf.cycle = &conf_cycle;
+    syslog = ws_syslog_create(&cf, BATCH * DATAGRAM, DATAGRAM, 1000);
+    if (syslog == NULL)
+        fail("syslog not created", 0);
+    sent = dropped = 0;
+    syslog->sent = &sent;
+    syslog->dropped = &dropped;
+    return syslog;
+}
+
+static ssize_t
+receive(u_char *buf)
+{
+    ssize_t n = recv(listener, buf, DATAGRAM + 1, MSG_DONTWAIT);
+    if (n > DATAGRAM)
+        fail("datagram too large", n);
+    if (n > 0 && (memcmp(buf, HEADER, HEADER_LEN) != 0 || buf[n - 1] != '\n'))
+        fail("datagram is not a header and whole lines", n);
+    return n;
+}
+
+// Lines of 100 bytes, three fit a datagram; they go out only when the batch
+// fills up or is flushed, and no line is split between datagrams.
+static void
+test_batch(ngx_http_websocket_syslog_t *syslog)
+{
+    u_char buf[DATAGRAM + 1];
+    test_line line = {'a', 99, 0};
+    ssize_t n;
+    size_t i, lines = 0, datagrams = 0;
+
+    for (i = 0; i < BATCH * 3; i++) {
+        line.c = 'a' + i % 26;
+        ws_syslog_render(syslog, render_line, &line);
+    }
+    if (receive(buf) != -1)
+        fail("sent before the batch filled up", 0);
+    if (!syslog->event->timer_set)
+        fail("flush timer not armed", 0);
+
+    // the first line of the next batch sends this one
+    line.c = '.';
+    ws_syslog_render(syslog, render_line, &line);
+    while ((n = receive(buf)) > 0) {
+        if ((size_t)n != HEADER_LEN + 3 * 100)
+            fail("datagram not filled with lines", n);
+        for (i = 0; i < 3; i++) {
+            u_char *l = buf + HEADER_LEN + i * 100;
+            if (l[0] != 'a' + lines % 26 || l[98] != l[0] || l[99] != '\n')
+                fail("line split or out of order", lines);
+            lines++;
+        }
+        datagrams++;
+    }
+    if (datagrams != BATCH || *syslog->sent != BATCH * 3)
+        fail("lines of a full batch not sent", lines);
+
+    ws_syslog_flush(syslog);
+    n = receive(buf);
+    if (n != HEADER_LEN + 100 || buf[HEADER_LEN] != '.')
+        fail("flushed datagram", n);
+    if (syslog->event->timer_set)
+        fail("flush timer left armed", 0);
+    if (*syslog->sent != BATCH * 3 + 1 || *syslog->dropped != 0)
+        fail("lines counted", *syslog->sent);
+}
+
+// A line larger than a datagram is cut, and the cut part ends with what the
+// line had there, not with what the datagram held before.
+static void
+test_oversize(ngx_http_websocket_syslog_t *syslog)
+{
+    u_char buf[DATAGRAM + 1];
+    test_line small = {'s', 9, 0};
+    test_line large = {'L', 300, 200};
+    size_t i, room = DATAGRAM - HEADER_LEN - 1;
+    ssize_t n;
+
+    ws_syslog_render(syslog, render_line, &small);
+    // goes to a datagram of its own
+    ws_syslog_render(syslog, render_line, &large);
+    ws_syslog_render(syslog, render_line, &small);
+    ws_syslog_flush(syslog);
+
+    n = receive(buf);
+    if (n != HEADER_LEN + 10)
+        fail("line before the large one", n);
+    n = receive(buf);
+    if (n != DATAGRAM)
+        fail("large line not cut at the datagram size", n);
+    for (i = 0; i < room; i++) {
+        if (buf[HEADER_LEN + i] != (i < 300 ? 'L' : 'z'))
+            fail("large line cut with stale bytes", i);
+    }
+    n = receive(buf);
+    if (n != HEADER_LEN + 10 || buf[HEADER_LEN] != 's')
+        fail("line after the large one", n);
+    if (receive(buf) != -1)
+        fail("extra datagram", 0);
+}
+
+int
+main()
+{
+    ngx_http_websocket_syslog_t *syslog;
+    socklen_t len = sizeof(server);
+
+    printf("test started\n");
+    listener = socket(AF_INET, SOCK_DGRAM, 0);
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr *)&server, sizeof(server)) == -1 ||
+        getsockname(listener, (struct sockaddr *)&server, &len) == -1)
+        fail("no udp listener", errno);
+
+    syslog = create();
+    test_batch(syslog);
+    // the batch buffer now holds old lines the large one must not show
+    test_oversize(syslog);
+    printf("test passed :)\n");
+    return 0;
+}
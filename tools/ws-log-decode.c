@@ -0,0 +1,188 @@
+// Converts websocket logs written with "ws_log ... format=binary" to text or
+// CSV.
+//
+//   ws-log-decode [-f text|csv] [file ...]
+//
+// Without files the log is read from stdin.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../ngx_http_websocket_stat_binlog.h"
+
+#define FORMAT_TEXT 0
+#define FORMAT_CSV 1
+
+static const char *opcodes[16] = {"cont", "text", "bin", NULL,   NULL,
+                                  NULL,   NULL,   NULL,  "cls",  "ping",
+                                  "pong", NULL,   NULL,  NULL,   NULL,
+                                  NULL};
+
+static const char *
+event_name(int type)
+{
+    switch (type) {
+    case WS_BINLOG_RECORD_FRAME:
+        return "frame";
+    case WS_BINLOG_RECORD_OPEN:
+        return "open";
+    case WS_BINLOG_RECORD_CLOSE:
+        return "close";
+    default:
+        return NULL;
+    }
+}
+
+static void
+print_record(const uint8_t *p, int format)
+{
+    uint64_t time_ms = ws_binlog_get64(p + WS_BINLOG_RECORD_TIME);
+    uint32_t conn = ws_binlog_get32(p + WS_BINLOG_RECORD_CONN);
+    uint32_t tcp = ws_binlog_get32(p + WS_BINLOG_RECORD_TCP);
+    uint64_t payload = ws_binlog_get64(p + WS_BINLOG_RECORD_PAYLOAD);
+    int type = p[WS_BINLOG_RECORD_TYPE];
+    int flags = p[WS_BINLOG_RECORD_FLAGS];
+    int opcode = p[WS_BINLOG_RECORD_OPCODE] & 0x0f;
+    const char *event = event_name(type);
+    const char *source = flags & WS_BINLOG_FLAG_FROM_CLIENT ? "client"
+                                                              : "upstream";
+    const char *op = opcodes[opcode] ? opcodes[opcode] : "uknw";
+    int compressed = (flags & WS_BINLOG_FLAG_COMPRESSED) != 0;
+    char stamp[32];
+    time_t sec = time_ms / 1000;
+    struct tm tm;
+
+    if (event == NULL) {
+        // written by a newer module
+        return;
+    }
+    gmtime_r(&sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    if (format == FORMAT_CSV) {
+        printf("%s.%03uZ,%08x,%s", stamp, (unsigned)(time_ms % 1000), conn,
+               event);
+        if (type == WS_BINLOG_RECORD_FRAME) {
+            printf(",%s,%s,%d,%llu,%u,\n", source, op, compressed,
+                   (unsigned long long)payload, tcp);
+        } else if (type == WS_BINLOG_RECORD_CLOSE) {
+            printf(",,,,,,%llu\n", (unsigned long long)payload);
+        } else {
+            printf(",,,,,,\n");
+        }
+        return;
+    }
+
+    printf("%s.%03uZ %08x %s", stamp, (unsigned)(time_ms % 1000), conn, event);
+    if (type == WS_BINLOG_RECORD_FRAME) {
+        printf(" %s %s%s payload=%llu tcp=%u\n", source, op,
+               compressed ? " compressed" : "", (unsigned long long)payload,
+               tcp);
+    } else if (type == WS_BINLOG_RECORD_CLOSE) {
+        printf(" age=%llu\n", (unsigned long long)payload);
+    } else {
+        printf("\n");
+    }
+}
+
+// Returns 0 when the whole input was decoded.
+static int
+decode(FILE *in, const char *name, int format)
+{
+    static uint8_t buf[1 << 16];
+    size_t len = 0, pos = 0, n, size;
+    unsigned version;
+    int have_header = 0;
+
+    for (;;) {
+        // keep the unread tail and fill the buffer up
+        memmove(buf, buf + pos, len - pos);
+        len -= pos;
+        pos = 0;
+        n = fread(buf + len, 1, sizeof(buf) - len, in);
+        len += n;
+        if (len == 0) {
+            return 0;
+        }
+        while (len - pos >= WS_BINLOG_MAGIC_LEN + 4) {
+            if (memcmp(buf + pos, WS_BINLOG_MAGIC, WS_BINLOG_MAGIC_LEN) == 0) {
+                version = ws_binlog_get16(buf + pos + WS_BINLOG_HEADER_VERSION);
+                size = ws_binlog_get16(buf + pos + WS_BINLOG_HEADER_SIZE_FIELD);
+                if (version != WS_BINLOG_VERSION ||
+                    size < WS_BINLOG_MAGIC_LEN + 4) {
+                    fprintf(stderr, "%s: unsupported log version %u\n", name,
+                            version);
+                    return 1;
+                }
+                have_header = 1;
+            } else {
+                if (!have_header) {
+                    fprintf(stderr, "%s: not a binary websocket log\n", name);
+                    return 1;
+                }
+                size = ws_binlog_get16(buf + pos + WS_BINLOG_RECORD_LEN);
+                if (size < WS_BINLOG_RECORD_SIZE) {
+                    fprintf(stderr, "%s: broken record at byte %zu\n", name,
+                            pos);
+                    return 1;
+                }
+                if (len - pos >= size) {
+                    print_record(buf + pos, format);
+                }
+            }
+            if (len - pos < size) {
+                break;
+            }
+            pos += size;
+        }
+        if (n == 0) {
+            if (ferror(in)) {
+                fprintf(stderr, "%s: %s\n", name, strerror(errno));
+                return 1;
+            }
+            if (len != pos) {
+                fprintf(stderr, "%s: truncated at the end\n", name);
+                return 1;
+            }
+            return 0;
+        }
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    int format = FORMAT_TEXT, i = 1, rc = 0;
+    FILE *in;
+
+    if (argc > 2 && strcmp(argv[1], "-f") == 0) {
+        if (strcmp(argv[2], "csv") == 0) {
+            format = FORMAT_CSV;
+        } else if (strcmp(argv[2], "text") != 0) {
+            fprintf(stderr, "usage: %s [-f text|csv] [file ...]\n", argv[0]);
+            return 2;
+        }
+        i = 3;
+    }
+    if (format == FORMAT_CSV) {
+        printf("time,connection,event,source,opcode,compressed,payload,tcp,"
+               "age\n");
+    }
+    if (i == argc) {
+        return decode(stdin, "stdin", format);
+    }
+    for (; i < argc; i++) {
+        in = fopen(argv[i], "rb");
+        if (in == NULL) {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+            rc = 1;
+            continue;
+        }
+        rc |= decode(in, argv[i], format);
+        fclose(in);
+    }
+    return rc;
+}
@@ -0,0 +1,320 @@
+// Follows the frame rings of "ws_tap" and prints the frames of all workers
+// merged by time, as text or CSV.
+//
+//   ws-tap [-f text|csv] [-i milliseconds] file
+//
+// Records the workers overwrite before they are read are counted on stderr.
+// After a reload nginx puts a new file in place and ws-tap follows it.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../ngx_http_websocket_stat_tapfile.h"
+
+#define FORMAT_TEXT 0
+#define FORMAT_CSV 1
+
+static const char *opcodes[16] = {"cont", "text", "bin", NULL,   NULL,
+                                  NULL,   NULL,   NULL,  "cls",  "ping",
+                                  "pong", NULL,   NULL,  NULL,   NULL,
+                                  NULL};
+
+typedef struct {
+    ws_tap_ring_t *ring;
+    uint64_t next;            // next record to read
+    ws_tap_record_t *records; // copied in the last poll
+    size_t count, pos;
+} reader_ring_t;
+
+typedef struct {
+    ws_tap_header_t *header;
+    size_t size;
+    ino_t inode;
+    int writable; // tails are published to the workers
+    reader_ring_t *rings;
+} tap_t;
+
+static volatile sig_atomic_t stop;
+
+static void
+on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void
+tap_close(tap_t *tap)
+{
+    uint32_t i;
+
+    if (tap->header == NULL) {
+        return;
+    }
+    for (i = 0; i < tap->header->nrings; i++) {
+        if (tap->writable) {
+            tap->rings[i].ring->reader = 0;
+        }
+        free(tap->rings[i].records);
+    }
+    free(tap->rings);
+    munmap(tap->header, tap->size);
+    tap->header = NULL;
+}
+
+// Returns 0 and starts reading at the newest records of every ring.
+static int
+tap_open(tap_t *tap, const char *path)
+{
+    struct stat st;
+    ws_tap_header_t *header;
+    reader_ring_t *rr;
+    uint32_t i;
+    int fd, prot = PROT_READ | PROT_WRITE;
+
+    fd = open(path, O_RDWR);
+    if (fd == -1 && errno == EACCES) {
+        // still fine to watch, the workers just cannot count what we miss
+        prot = PROT_READ;
+        fd = open(path, O_RDONLY);
+    }
+    if (fd == -1) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 ||
+        (size_t)st.st_size < sizeof(ws_tap_header_t)) {
+        fprintf(stderr, "%s: not a websocket tap\n", path);
+        close(fd);
+        return -1;
+    }
+    header = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (memcmp(header->magic, WS_TAP_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != WS_TAP_VERSION ||
+        header->record_size != sizeof(ws_tap_record_t) ||
+        header->records == 0 ||
+        (header->records & (header->records - 1)) != 0 ||
+        header->ring_offset + (uint64_t)header->nrings * header->ring_size >
+            (uint64_t)st.st_size) {
+        fprintf(stderr, "%s: not a websocket tap or unsupported version\n",
+                path);
+        munmap(header, st.st_size);
+        return -1;
+    }
+
+    tap->rings = calloc(header->nrings, sizeof(reader_ring_t));
+    if (tap->rings == NULL) {
+        munmap(header, st.st_size);
+        return -1;
+    }
+    tap->header = header;
+    tap->size = st.st_size;
+    tap->inode = st.st_ino;
+    tap->writable = prot & PROT_WRITE;
+    for (i = 0; i < header->nrings; i++) {
+        rr = &tap->rings[i];
+        rr->ring = ws_tap_ring(header, i);
+        if (tap->writable && rr->ring->reader &&
+            (pid_t)rr->ring->reader != getpid() &&
+            kill(rr->ring->reader, 0) == 0) {
+            fprintf(stderr,
+                    "%s: another reader (%llu) is attached, overwrites "
+                    "are not counted for this one\n",
+                    path, (unsigned long long)rr->ring->reader);
+            tap->writable = 0;
+        }
+    }
+    for (i = 0; i < header->nrings; i++) {
+        rr = &tap->rings[i];
+        rr->records = malloc(header->records * sizeof(ws_tap_record_t));
+        if (rr->records == NULL) {
+            tap_close(tap);
+            return -1;
+        }
+        rr->next = rr->ring->head;
+        if (tap->writable) {
+            rr->ring->tail = rr->next;
+            rr->ring->reader = getpid();
+        }
+    }
+    return 0;
+}
+
+// Copies new records of a ring, returns how many were lost.
+static uint64_t
+ring_poll(tap_t *tap, reader_ring_t *rr)
+{
+    uint64_t records = tap->header->records, mask = records - 1;
+    uint64_t head, lost = 0, n, i, stale;
+
+    head = rr->ring->head;
+    // head is read before the records it covers
+    __sync_synchronize();
+    if (head - rr->next > records) {
+        lost += head - rr->next - records;
+        rr->next = head - records;
+    }
+    n = head - rr->next;
+    for (i = 0; i < n; i++) {
+        rr->records[i] = ws_tap_records(rr->ring)[(rr->next + i) & mask];
+    }
+    __sync_synchronize();
+    // whatever the worker wrote meanwhile may have replaced the first ones
+    stale = rr->ring->head - rr->next;
+    stale = stale > records ? stale - records : 0;
+    if (stale > n) {
+        stale = n;
+    }
+    lost += stale;
+    rr->pos = stale;
+    rr->count = n;
+    rr->next = head;
+    if (tap->writable) {
+        rr->ring->tail = head;
+    }
+    return lost;
+}
+
+static void
+print_record(ws_tap_record_t *rec, unsigned long long pid, int format)
+{
+    const char *source = rec->flags & WS_TAP_FROM_CLIENT ? "client"
+                                                         : "upstream";
+    const char *op = opcodes[rec->opcode & 0x0f] ? opcodes[rec->opcode & 0x0f]
+                                                 : "uknw";
+    int compressed = (rec->flags & WS_TAP_COMPRESSED) != 0;
+    char stamp[32];
+    time_t sec = rec->time / 1000;
+    struct tm tm;
+
+    gmtime_r(&sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    if (format == FORMAT_CSV) {
+        printf("%s.%03uZ,%llu,%08x,%s,%s,%d,%llu,%u\n", stamp,
+               (unsigned)(rec->time % 1000), pid, rec->conn, source, op,
+               compressed, (unsigned long long)rec->payload, rec->tcp);
+        return;
+    }
+    printf("%s.%03uZ %llu %08x %s %s%s payload=%llu tcp=%u\n", stamp,
+           (unsigned)(rec->time % 1000), pid, rec->conn, source, op,
+           compressed ? " compressed" : "", (unsigned long long)rec->payload,
+           rec->tcp);
+}
+
+// Every ring is in time order already, picks the oldest head of them.
+static void
+merge(tap_t *tap, int format)
+{
+    reader_ring_t *rr, *oldest;
+    uint32_t i;
+
+    for (;;) {
+        oldest = NULL;
+        for (i = 0; i < tap->header->nrings; i++) {
+            rr = &tap->rings[i];
+            if (rr->pos < rr->count &&
+                (oldest == NULL || rr->records[rr->pos].time <
+                                       oldest->records[oldest->pos].time)) {
+                oldest = rr;
+            }
+        }
+        if (oldest == NULL) {
+            return;
+        }
+        print_record(&oldest->records[oldest->pos++], oldest->ring->pid,
+                     format);
+    }
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-f text|csv] [-i milliseconds] file\n", name);
+}
+
+int
+main(int argc, char **argv)
+{
+    int format = FORMAT_TEXT, interval = 100, opt;
+    tap_t tap = {0};
+    struct stat st;
+    struct timespec pause;
+    uint64_t lost;
+    uint32_t i;
+    const char *path;
+
+    while ((opt = getopt(argc, argv, "f:i:")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (strcmp(optarg, "csv") == 0) {
+                format = FORMAT_CSV;
+            } else if (strcmp(optarg, "text") != 0) {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            if (interval <= 0) {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    path = argv[optind];
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    if (tap_open(&tap, path) != 0) {
+        return 1;
+    }
+    if (format == FORMAT_CSV) {
+        printf("time,pid,connection,source,opcode,compressed,payload,tcp\n");
+    }
+    pause.tv_sec = interval / 1000;
+    pause.tv_nsec = interval % 1000 * 1000000L;
+
+    while (!stop) {
+        lost = 0;
+        for (i = 0; i < tap.header->nrings; i++) {
+            lost += ring_poll(&tap, &tap.rings[i]);
+        }
+        merge(&tap, format);
+        fflush(stdout);
+        if (lost) {
+            fprintf(stderr, "ws-tap: %llu records lost\n",
+                    (unsigned long long)lost);
+        }
+        nanosleep(&pause, NULL);
+        // a reload replaces the file
+        if (stat(path, &st) == 0 && st.st_ino != tap.inode) {
+            tap_close(&tap);
+            if (tap_open(&tap, path) != 0) {
+                return 1;
+            }
+        }
+    }
+    tap_close(&tap);
+    return 0;
+}